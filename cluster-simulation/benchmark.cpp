@@ -0,0 +1,697 @@
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include "birch.h"
+#include "coreset.h"
+#include "csv_loader.h"
+#include "dataset_file.h"
+#include "dataset_generator.h"
+#include "dbscan.h"
+#include "ensemble.h"
+#include "k_means.h"
+#include "k_selection.h"
+#include "profile_export.h"
+#include "sharded_k_means.h"
+
+// Counts heap allocations so profiles can report them. GCC inlines these into callers and then
+// takes the std::free of memory from operator new for a mismatched pair, though both go through
+// malloc here.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void* operator new(std::size_t size)
+{
+    ntf::cluster::heap_allocations.fetch_add(1, std::memory_order_relaxed);
+
+    if (void* memory = std::malloc(size == 0 ? 1 : size))
+        return memory;
+
+    throw std::bad_alloc();
+}
+
+void operator delete(void* memory) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete(void* memory, std::size_t) noexcept
+{
+    std::free(memory);
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+namespace ntf::cluster::benchmark
+{
+    constexpr int32_t DEFAULT_PLANE_SIZE = 10000;
+    constexpr int32_t DEFAULT_OFFSET = 100;
+    constexpr size_t DEFAULT_ROOT_OBSERVATIONS_AMOUNT = 20;
+
+    enum class output_format { csv, json };
+
+    enum class dataset_distribution { root_offset, gaussian_blobs, skewed };
+
+    struct options
+    {
+        std::vector<size_t> sizes{ 10000, 40000 };
+        std::vector<size_t> ks{ 5, 15, 30 };
+        std::vector<uint32_t> seeds{ 1, 2, 3 };
+        size_t threads = 1;
+        size_t dimensions = 2;
+
+        // Above one, a best-of-restarts K means runs alongside the others.
+        size_t restarts = 1;
+
+        // Adds a K selection sweeping up to each K of the run and keeping the one this picks.
+        bool select_k = false;
+        k_criterion criterion = k_criterion::silhouette;
+
+        // Above zero, a K means sharded over that many forked worker processes runs too.
+        size_t shards = 0;
+        std::vector<shard_channel*> shard_channels;
+
+        // Bytes the BIRCH CF tree may use for its nodes.
+        size_t birch_memory = 1 << 20;
+
+        // Adds a DBSCAN with each K of the run as its least neighbours and this epsilon, zero to
+        // estimate it.
+        bool use_dbscan = false;
+        double dbscan_epsilon = 0;
+
+        // Above zero, a K means over a coreset of about this many observations runs too, and
+        // reports its inertia gap to K means over all of them.
+        size_t coreset_size = 0;
+        seeding_strategy seeding = seeding_strategy::random;
+        convergence_criteria convergence;
+        empty_cluster_repair repair = empty_cluster_repair::farthest_point;
+        dataset_distribution distribution = dataset_distribution::root_offset;
+        bool use_index = false;
+        output_format format = output_format::csv;
+
+        // Optional files for the Chrome trace and the per-iteration CSV of every run.
+        std::string trace_path;
+        std::string history_path;
+
+        // A dataset file replaces the generated datasets; generated ones can be saved for replay.
+        std::string dataset_path;
+        std::string csv_path;
+        std::string save_dataset_prefix;
+    };
+
+    struct result
+    {
+        std::string partitioner;
+        size_t observations;
+        size_t dimensions;
+        size_t k;
+        uint32_t seed;
+        size_t threads;
+        partitioning_profile profile;
+        double dissimilarity;
+    };
+
+    // The root offset model matches simulator::generate_observations, so benchmark datasets look
+    // like what the window shows.
+    std::vector<v2d<int32_t>> generate_observations(size_t amount, uint32_t seed, dataset_distribution distribution, size_t threads)
+    {
+        v2d<int32_t> plane_start{ 0, 0 };
+        v2d<int32_t> plane_end{ DEFAULT_PLANE_SIZE - 1, DEFAULT_PLANE_SIZE - 1 };
+
+        std::shared_ptr<observation_distribution<int32_t>> model;
+
+        switch (distribution)
+        {
+        case dataset_distribution::gaussian_blobs:
+            model = std::make_shared<gaussian_blobs_distribution<int32_t>>(plane_start, plane_end, DEFAULT_ROOT_OBSERVATIONS_AMOUNT, DEFAULT_OFFSET, DEFAULT_OFFSET * 5);
+            break;
+
+        case dataset_distribution::skewed:
+            model = std::make_shared<skewed_distribution<int32_t>>(plane_start, plane_end, 3.0);
+            break;
+
+        default:
+            model = std::make_shared<root_offset_distribution<int32_t>>(plane_start, plane_end, DEFAULT_ROOT_OBSERVATIONS_AMOUNT, v2d<int32_t>{ DEFAULT_OFFSET, DEFAULT_OFFSET });
+        }
+
+        return dataset_generator<int32_t>(model, seed, threads).generate(amount);
+    }
+
+    // Gaussian blobs of D coordinates for runs above two dimensions, which the dataset
+    // generator and the file formats do not cover.
+    template <size_t D>
+    std::vector<point<int32_t, D>> generate_points(size_t amount, uint32_t seed)
+    {
+        std::mt19937_64 random_engine(mix_seed(seed, D));
+        std::uniform_real_distribution<double> center_distribution(0, DEFAULT_PLANE_SIZE - 1);
+        std::uniform_real_distribution<double> deviation_distribution(DEFAULT_OFFSET, DEFAULT_OFFSET * 5);
+        std::uniform_int_distribution<size_t> blob_distribution(0, DEFAULT_ROOT_OBSERVATIONS_AMOUNT - 1);
+        std::normal_distribution<double> normal_distribution;
+
+        std::vector<point<double, D>> centers(DEFAULT_ROOT_OBSERVATIONS_AMOUNT);
+        std::vector<double> deviations(DEFAULT_ROOT_OBSERVATIONS_AMOUNT);
+
+        for (size_t i = 0; i < centers.size(); i++)
+        {
+            for (size_t d = 0; d < D; d++)
+                centers[i][d] = center_distribution(random_engine);
+
+            deviations[i] = deviation_distribution(random_engine);
+        }
+
+        std::vector<point<int32_t, D>> points(amount);
+
+        for (auto& point : points)
+        {
+            size_t blob = blob_distribution(random_engine);
+
+            for (size_t d = 0; d < D; d++)
+                point[d] = to_coordinate<int32_t>(centers[blob][d] + normal_distribution(random_engine) * deviations[blob]);
+        }
+
+        return points;
+    }
+
+    template <typename N>
+    std::vector<N> parse_list(const std::string& arg)
+    {
+        std::vector<N> values;
+        std::stringstream stream(arg);
+        std::string item;
+
+        while (std::getline(stream, item, ','))
+        {
+            if (!item.empty())
+                values.push_back(static_cast<N>(std::stoull(item)));
+        }
+
+        return values;
+    }
+
+    void print_usage(const char* program)
+    {
+        std::cerr
+            << "Usage: " << program << " [--sizes N,...] [--ks K,...] [--seeds S,...] [--threads T]\n"
+            << "       [--seeding random|k-means++|k-means||] [--distribution root-offset|blobs|skewed]\n"
+            << "       [--index] [--format csv|json]\n"
+            << "       [--trace FILE] [--history FILE] [--dataset FILE] [--csv FILE] [--save-datasets PREFIX]\n"
+            << "       [--dimensions 2|3|4|8|16|32] [--mean-shift S] [--inertia-change R] [--max-iterations N]\n"
+            << "       [--repair farthest|split|steal] [--restarts N]\n"
+            << "       [--select-k elbow|silhouette|gap] [--shards N] [--birch-memory BYTES]\n"
+            << "       [--dbscan EPSILON] [--coreset SIZE]\n"
+            << "Runs every partitioner over each (size, K, seed) combination and prints one record per run.\n"
+            << "--trace writes the phases of every run as a Chrome trace, --history a CSV row per iteration.\n"
+            << "--dataset maps a dataset file and runs on it instead of generating; --save-datasets writes\n"
+            << "every generated dataset to PREFIX-<size>-<seed>.ntfo. --csv loads the first two columns of a\n"
+            << "CSV file instead. Above two dimensions, observations are Gaussian blobs and --distribution,\n"
+            << "--index and the dataset options are ignored. The convergence options stop the K means runs\n"
+            << "early; zero disables each of them. --restarts adds an ensemble keeping the best of N K means.\n"
+            << "--select-k adds a sweep over K up to each K, returning the one the criterion recommends.\n"
+            << "--shards forks N local workers for a K means sharded over Unix-domain sockets.\n"
+            << "--birch-memory bounds the nodes of the BIRCH CF tree, 1 MiB by default.\n"
+            << "--dbscan adds a DBSCAN taking each K as its minimum points; an EPSILON of 0 estimates it.\n"
+            << "--coreset adds a K means over a weighted sample of about SIZE observations.\n";
+    }
+
+    bool parse_options(int argc, char** argv, options& parsed)
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            std::string arg = argv[i];
+
+            if (arg == "--index")
+            {
+                parsed.use_index = true;
+                continue;
+            }
+
+            if (arg == "--help" || arg == "-h" || i + 1 >= argc)
+                return false;
+
+            std::string value = argv[++i];
+
+            if (arg == "--sizes")
+                parsed.sizes = parse_list<size_t>(value);
+
+            else if (arg == "--ks")
+                parsed.ks = parse_list<size_t>(value);
+
+            else if (arg == "--seeds")
+                parsed.seeds = parse_list<uint32_t>(value);
+
+            else if (arg == "--threads")
+                parsed.threads = std::max<size_t>(std::stoull(value), 1);
+
+            else if (arg == "--dimensions")
+                parsed.dimensions = std::stoull(value);
+
+            else if (arg == "--restarts")
+                parsed.restarts = std::max<size_t>(std::stoull(value), 1);
+
+            else if (arg == "--shards")
+                parsed.shards = std::stoull(value);
+
+            else if (arg == "--birch-memory")
+                parsed.birch_memory = std::stoull(value);
+
+            else if (arg == "--dbscan")
+            {
+                parsed.use_dbscan = true;
+                parsed.dbscan_epsilon = std::stod(value);
+            }
+
+            else if (arg == "--coreset")
+                parsed.coreset_size = std::stoull(value);
+
+            else if (arg == "--select-k" && (value == "elbow" || value == "silhouette" || value == "gap"))
+            {
+                parsed.select_k = true;
+                parsed.criterion = value == "elbow" ? k_criterion::elbow : value == "gap" ? k_criterion::gap : k_criterion::silhouette;
+            }
+
+            else if (arg == "--mean-shift")
+                parsed.convergence.mean_shift = std::stod(value);
+
+            else if (arg == "--inertia-change")
+                parsed.convergence.relative_inertia_change = std::stod(value);
+
+            else if (arg == "--max-iterations")
+                parsed.convergence.max_iterations = std::stoull(value);
+
+            else if (arg == "--seeding" && value == "random")
+                parsed.seeding = seeding_strategy::random;
+
+            else if (arg == "--seeding" && value == "k-means++")
+                parsed.seeding = seeding_strategy::k_means_plus_plus;
+
+            else if (arg == "--seeding" && value == "k-means||")
+                parsed.seeding = seeding_strategy::k_means_parallel;
+
+            else if (arg == "--repair" && value == "farthest")
+                parsed.repair = empty_cluster_repair::farthest_point;
+
+            else if (arg == "--repair" && value == "split")
+                parsed.repair = empty_cluster_repair::split_largest;
+
+            else if (arg == "--repair" && value == "steal")
+                parsed.repair = empty_cluster_repair::steal_largest;
+
+            else if (arg == "--distribution" && value == "root-offset")
+                parsed.distribution = dataset_distribution::root_offset;
+
+            else if (arg == "--distribution" && value == "blobs")
+                parsed.distribution = dataset_distribution::gaussian_blobs;
+
+            else if (arg == "--distribution" && value == "skewed")
+                parsed.distribution = dataset_distribution::skewed;
+
+            else if (arg == "--format" && (value == "csv" || value == "json"))
+                parsed.format = value == "csv" ? output_format::csv : output_format::json;
+
+            else if (arg == "--trace")
+                parsed.trace_path = value;
+
+            else if (arg == "--history")
+                parsed.history_path = value;
+
+            else if (arg == "--dataset")
+                parsed.dataset_path = value;
+
+            else if (arg == "--csv")
+                parsed.csv_path = value;
+
+            else if (arg == "--save-datasets")
+                parsed.save_dataset_prefix = value;
+
+            else return false;
+        }
+
+        bool supported_dimensions = parsed.dimensions == 2 || parsed.dimensions == 3 || parsed.dimensions == 4
+            || parsed.dimensions == 8 || parsed.dimensions == 16 || parsed.dimensions == 32;
+
+        return supported_dimensions && !parsed.sizes.empty() && !parsed.ks.empty() && !parsed.seeds.empty();
+    }
+
+    void print_results(const std::vector<result>& results, output_format format)
+    {
+        if (format == output_format::csv)
+        {
+            std::cout << "partitioner,observations,dimensions,k,seed,threads,iterations,elapsed_us";
+
+            for (size_t i = 0; i < PARTITIONING_PHASES_AMOUNT; i++)
+                std::cout << ',' << phase_name(static_cast<partitioning_phase>(i)) << "_us";
+
+            std::cout << ",distance_evaluations,skipped_distance_evaluations,reassigned_observations,heap_allocations,repaired_clusters,coreset_us,inertia_gap,stopped_by,dissimilarity\n";
+
+            for (auto& result : results)
+            {
+                std::cout
+                    << result.partitioner << ','
+                    << result.observations << ','
+                    << result.dimensions << ','
+                    << result.k << ','
+                    << result.seed << ','
+                    << result.threads << ','
+                    << result.profile.iterations << ','
+                    << result.profile.elapsed_time.count() << ',';
+
+                for (auto& phase_time : result.profile.phase_times)
+                    std::cout << phase_time.count() << ',';
+
+                std::cout
+                    << result.profile.distance_evaluations << ','
+                    << result.profile.skipped_distance_evaluations << ','
+                    << result.profile.reassigned_observations << ','
+                    << result.profile.heap_allocations << ','
+                    << result.profile.repaired_clusters << ','
+                    << result.profile.coreset_time.count() << ','
+                    << result.profile.inertia_gap << ','
+                    << stop_reason_name(result.profile.stopped_by) << ','
+                    << result.dissimilarity << '\n';
+            }
+
+            return;
+        }
+
+        std::cout << "[\n";
+
+        for (size_t i = 0; i < results.size(); i++)
+        {
+            auto& result = results[i];
+
+            std::cout
+                << "  { \"partitioner\": \"" << result.partitioner << "\""
+                << ", \"observations\": " << result.observations
+                << ", \"dimensions\": " << result.dimensions
+                << ", \"k\": " << result.k
+                << ", \"seed\": " << result.seed
+                << ", \"threads\": " << result.threads
+                << ", \"dissimilarity\": " << result.dissimilarity
+                << ", \"profile\": ";
+
+            write_profile_json(std::cout, result.profile);
+            std::cout << " }" << (i + 1 < results.size() ? ",\n" : "\n");
+        }
+
+        std::cout << "]\n";
+    }
+
+#ifndef _WIN32
+    template <size_t D>
+    void serve_shard(shard_channel& channel)
+    {
+        shard_worker<int32_t, D>().serve(channel);
+    }
+
+    bool spawn_shards(options& options, local_shard_processes& processes)
+    {
+        void (*serve)(shard_channel&) = serve_shard<2>;
+
+        switch (options.dimensions)
+        {
+        case 3: serve = serve_shard<3>; break;
+        case 4: serve = serve_shard<4>; break;
+        case 8: serve = serve_shard<8>; break;
+        case 16: serve = serve_shard<16>; break;
+        case 32: serve = serve_shard<32>; break;
+        }
+
+        if (!processes.spawn(options.shards, serve))
+            return false;
+
+        for (auto& channel : processes.channels)
+            options.shard_channels.push_back(channel.get());
+
+        return true;
+    }
+#endif
+
+    template <size_t D>
+    std::vector<std::shared_ptr<partitioner<int32_t, D>>> make_partitioners(const options& options)
+    {
+        auto seeded = [options](auto partitioner) {
+            partitioner->seeding = options.seeding;
+            partitioner->convergence = options.convergence;
+            partitioner->repair = options.repair;
+            return partitioner;
+        };
+
+        std::vector<std::shared_ptr<partitioner<int32_t, D>>> partitioners{
+            seeded(std::make_shared<k_means<int32_t, D>>(options.threads)),
+            seeded(std::make_shared<hamerly_k_means<int32_t, D>>(options.threads)),
+            seeded(std::make_shared<mini_batch_k_means<int32_t, D>>(options.threads)),
+            std::make_shared<k_medoids<int32_t, D>>(options.threads),
+            std::make_shared<birch<int32_t, D>>(options.threads, options.birch_memory),
+        };
+
+        // Restarts run single-threaded; the ensemble spreads them over the threads instead.
+        if (options.restarts > 1)
+        {
+            partitioners.push_back(std::make_shared<ensemble_partitioner<int32_t, D>>(
+                [seeded] { return seeded(std::make_shared<k_means<int32_t, D>>()); },
+                options.restarts,
+                options.threads
+            ));
+        }
+
+        if (!options.shard_channels.empty())
+            partitioners.push_back(seeded(std::make_shared<sharded_k_means<int32_t, D>>(options.shard_channels, options.threads)));
+
+        if (options.use_dbscan)
+            partitioners.push_back(std::make_shared<dbscan<int32_t, D>>(options.threads, options.dbscan_epsilon));
+
+        if (options.coreset_size > 0)
+        {
+            auto coreset = std::make_shared<coreset_partitioner<int32_t, D>>(
+                seeded(std::make_shared<k_means<int32_t, D>>(options.threads)),
+                options.coreset_size,
+                options.threads
+            );
+
+            coreset->measure_gap = true;
+            partitioners.push_back(coreset);
+        }
+
+        if (options.select_k)
+        {
+            auto selection = std::make_shared<k_selection<int32_t, D>>(
+                [seeded] { return seeded(std::make_shared<k_means<int32_t, D>>()); },
+                options.threads
+            );
+
+            selection->criterion = options.criterion;
+            partitioners.push_back(selection);
+        }
+
+        return partitioners;
+    }
+
+    // Runs every partitioner for every K over one dataset.
+    template <size_t D>
+    void run_partitioners(
+        const std::vector<std::shared_ptr<partitioner<int32_t, D>>>& partitioners,
+        observation_span<int32_t, D> observations,
+        uint32_t seed,
+        const options& options,
+        std::vector<result>& results
+    )
+    {
+        for (size_t k : options.ks)
+        {
+            for (auto& partitioner : partitioners)
+            {
+                partitioning_profile profile;
+
+                partitioner->param = static_cast<uint8_t>(std::min<size_t>(k, UINT8_MAX));
+                partitioner->seed(seed);
+
+                auto clusters = partitioner->partition(observations, profile);
+
+                results.push_back({
+                    partitioner->name,
+                    observations.size(),
+                    D,
+                    static_cast<size_t>(partitioner->param),
+                    seed,
+                    options.threads,
+                    profile,
+                    dissimilarity(clusters)
+                });
+            }
+        }
+    }
+
+    template <size_t D>
+    void run_generated(const options& options, std::vector<result>& results)
+    {
+        auto partitioners = make_partitioners<D>(options);
+
+        for (size_t size : options.sizes)
+        {
+            for (uint32_t seed : options.seeds)
+                run_partitioners<D>(partitioners, generate_points<D>(size, seed), seed, options, results);
+        }
+    }
+
+    // Two dimensions additionally support dataset files, CSV input and the spatial index.
+    bool run_planar(options options, std::vector<result>& results)
+    {
+        auto partitioners = make_partitioners<2>(options);
+
+        // The mapped dataset is shared by every seed; generated datasets only live for their own.
+        mapped_dataset<int32_t> dataset;
+        std::vector<v2d<int32_t>> loaded;
+
+        if (!options.dataset_path.empty())
+        {
+            if (!dataset.open(options.dataset_path))
+            {
+                std::cerr << "Cannot open dataset " << options.dataset_path << '\n';
+                return false;
+            }
+
+            options.sizes = { dataset.observations().size() };
+        }
+
+        else if (!options.csv_path.empty())
+        {
+            csv_loader<int32_t> loader;
+            loader.overlapped = true;
+
+            if (!loader.load(options.csv_path, loaded))
+            {
+                std::cerr << "Cannot read " << options.csv_path << '\n';
+                return false;
+            }
+
+            std::cerr << "Loaded " << loaded.size() << " observations, skipped " << loader.statistics.skipped_lines << " lines\n";
+            options.sizes = { loaded.size() };
+        }
+
+        bool external = dataset.is_open() || !options.csv_path.empty();
+
+        for (size_t size : options.sizes)
+        {
+            for (uint32_t seed : options.seeds)
+            {
+                std::vector<v2d<int32_t>> generated;
+
+                if (!external)
+                    generated = generate_observations(size, seed, options.distribution, options.threads);
+
+                observation_span<int32_t> observations = dataset.is_open() ? dataset.observations() : external ? loaded : generated;
+
+                if (!options.save_dataset_prefix.empty() && !external)
+                    write_dataset(options.save_dataset_prefix + "-" + std::to_string(size) + "-" + std::to_string(seed) + ".ntfo", observations);
+
+                // One index per dataset, shared by every partitioner and K.
+                auto index = options.use_index
+                    ? std::make_shared<grid_index<int32_t>>(grid_index<int32_t>::from_observations(observations))
+                    : nullptr;
+
+                for (auto& partitioner : partitioners)
+                    partitioner->index = index;
+
+                run_partitioners<2>(partitioners, observations, seed, options, results);
+            }
+        }
+
+        return true;
+    }
+
+    std::string run_name(const result& result)
+    {
+        return result.partitioner
+            + " n=" + std::to_string(result.observations)
+            + " k=" + std::to_string(result.k)
+            + " seed=" + std::to_string(result.seed);
+    }
+
+    void write_trace(const std::vector<result>& results, const std::string& path)
+    {
+        std::vector<named_profile> runs;
+
+        for (auto& result : results)
+            runs.push_back({ run_name(result), &result.profile });
+
+        std::ofstream out(path);
+        write_chrome_trace(out, runs);
+    }
+
+    void write_history(const std::vector<result>& results, const std::string& path)
+    {
+        std::ofstream out(path);
+        write_profile_csv_header(out);
+
+        for (auto& result : results)
+            write_profile_csv(out, result.profile, run_name(result));
+    }
+}
+
+int main(int argc, char** argv)
+{
+    using namespace ntf::cluster;
+
+    benchmark::options options;
+
+    if (!benchmark::parse_options(argc, argv, options))
+    {
+        benchmark::print_usage(argv[0]);
+        return 1;
+    }
+
+#ifndef _WIN32
+    // Before any thread starts, since the workers are forked from this process.
+    local_shard_processes shard_processes;
+
+    if (options.shards > 0 && !benchmark::spawn_shards(options, shard_processes))
+    {
+        std::cerr << "Cannot start " << options.shards << " shard workers\n";
+        return 1;
+    }
+#endif
+
+    std::vector<benchmark::result> results;
+
+    switch (options.dimensions)
+    {
+    case 3:
+        benchmark::run_generated<3>(options, results);
+        break;
+
+    case 4:
+        benchmark::run_generated<4>(options, results);
+        break;
+
+    case 8:
+        benchmark::run_generated<8>(options, results);
+        break;
+
+    case 16:
+        benchmark::run_generated<16>(options, results);
+        break;
+
+    case 32:
+        benchmark::run_generated<32>(options, results);
+        break;
+
+    default:
+        if (!benchmark::run_planar(options, results))
+            return 1;
+    }
+
+    benchmark::print_results(results, options.format);
+
+    if (!options.trace_path.empty())
+        benchmark::write_trace(results, options.trace_path);
+
+    if (!options.history_path.empty())
+        benchmark::write_history(results, options.history_path);
+
+    return 0;
+}
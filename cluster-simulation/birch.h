@@ -0,0 +1,697 @@
+#pragma once
+#include <cfloat>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <vector>
+#include "cluster.h"
+#include "nearest_mean.h"
+#include "thread_pool.h"
+
+namespace ntf::cluster
+{
+    // Count, coordinate sums and sum of squared norms of a group of observations. Summaries merge
+    // by adding their fields, and the centroid, radius and squared distances to any point follow
+    // from them exactly, so the observations themselves are not needed.
+    template <size_t D = 2>
+    struct clustering_feature
+    {
+        size_t count = 0;
+        point<double, D> linear_sum{};
+        double squared_sum = 0;
+
+        template <typename P>
+        static clustering_feature of(const P& observation)
+        {
+            clustering_feature result;
+
+            result.count = 1;
+            result.linear_sum = point_cast<double, D>(observation);
+            result.squared_sum = dot<D>(result.linear_sum, result.linear_sum);
+
+            return result;
+        }
+
+        void merge(const clustering_feature& rhs)
+        {
+            this->count += rhs.count;
+            this->squared_sum += rhs.squared_sum;
+
+            accumulate<D>(this->linear_sum, rhs.linear_sum);
+        }
+
+        point<double, D> centroid() const
+        {
+            point<double, D> result{};
+
+            if (this->count == 0)
+                return result;
+
+            for_each_dimension<D>([&](size_t d) {
+                coordinate(result, d) = coordinate(this->linear_sum, d) / static_cast<double>(this->count);
+            });
+
+            return result;
+        }
+
+        // Sum of squared distances from the summarized observations to point.
+        template <typename P>
+        double squared_distance_sum(const P& point) const
+        {
+            double result = this->squared_sum - 2 * dot<D>(this->linear_sum, point) + this->count * dot<D>(point, point);
+
+            return std::max(result, 0.0);
+        }
+
+        // Root mean squared distance of the summarized observations to their centroid.
+        double radius() const
+        {
+            return this->count == 0 ? 0 : std::sqrt(this->squared_distance_sum(this->centroid()) / static_cast<double>(this->count));
+        }
+
+        double merged_radius(const clustering_feature& rhs) const
+        {
+            clustering_feature merged = *this;
+            merged.merge(rhs);
+
+            return merged.radius();
+        }
+    };
+
+    // Height-balanced tree of clustering features. Leaves hold summaries no wider than threshold;
+    // inner nodes hold the sum of each child. Once the nodes outgrow the memory budget the
+    // threshold is raised and the leaf summaries are reinserted, so memory stays bounded no
+    // matter how many observations are inserted.
+    template <size_t D = 2>
+    class cf_tree
+    {
+    private:
+        static constexpr size_t NO_NODE = std::numeric_limits<size_t>::max();
+
+        struct node
+        {
+            bool leaf = true;
+
+            std::vector<clustering_feature<D>> entries;
+
+            // Parallel to entries in inner nodes, empty in leaves.
+            std::vector<size_t> children;
+        };
+
+        struct path_step
+        {
+            size_t node = 0;
+            size_t entry = 0;
+        };
+
+        std::vector<node> nodes;
+        size_t root = 0;
+
+        std::vector<path_step> path;
+        std::vector<clustering_feature<D>> reinserted;
+
+        size_t observations_amount = 0;
+
+        size_t add_node(bool leaf)
+        {
+            this->nodes.emplace_back();
+
+            auto& added = this->nodes.back();
+
+            added.leaf = leaf;
+            added.entries.reserve(std::max(this->leaf_capacity, this->branching_factor) + 1);
+
+            if (!leaf)
+                added.children.reserve(this->branching_factor + 1);
+
+            return this->nodes.size() - 1;
+        }
+
+        size_t closest_entry(const node& node, const point<double, D>& centroid) const
+        {
+            size_t closest = 0;
+            double closest_distance = DBL_MAX;
+
+            for (size_t i = 0; i < node.entries.size(); i++)
+            {
+                double distance = squared_distance<D>(node.entries[i].centroid(), centroid);
+
+                if (distance < closest_distance)
+                {
+                    closest_distance = distance;
+                    closest = i;
+                }
+            }
+
+            return closest;
+        }
+
+        clustering_feature<D> summarize(size_t index) const
+        {
+            clustering_feature<D> result;
+
+            for (auto& entry : this->nodes[index].entries)
+                result.merge(entry);
+
+            return result;
+        }
+
+        // Moves about half of an overflowing node's entries to a new sibling: the two entries
+        // farthest apart seed the halves and every other entry joins the closer one.
+        size_t split(size_t index)
+        {
+            size_t sibling = this->add_node(this->nodes[index].leaf);
+
+            auto& splitting = this->nodes[index];
+            auto& created = this->nodes[sibling];
+
+            std::vector<point<double, D>> centroids(splitting.entries.size());
+
+            for (size_t i = 0; i < centroids.size(); i++)
+                centroids[i] = splitting.entries[i].centroid();
+
+            size_t first = 0;
+            size_t second = 1;
+            double farthest = -1;
+
+            for (size_t i = 0; i < centroids.size(); i++)
+            {
+                for (size_t j = i + 1; j < centroids.size(); j++)
+                {
+                    double distance = squared_distance<D>(centroids[i], centroids[j]);
+
+                    if (distance > farthest)
+                    {
+                        farthest = distance;
+                        first = i;
+                        second = j;
+                    }
+                }
+            }
+
+            size_t kept = 0;
+
+            for (size_t i = 0; i < centroids.size(); i++)
+            {
+                bool moved = i == second
+                    || (i != first && squared_distance<D>(centroids[i], centroids[second]) < squared_distance<D>(centroids[i], centroids[first]));
+
+                if (moved)
+                {
+                    created.entries.push_back(splitting.entries[i]);
+
+                    if (!splitting.leaf)
+                        created.children.push_back(splitting.children[i]);
+
+                    continue;
+                }
+
+                splitting.entries[kept] = splitting.entries[i];
+
+                if (!splitting.leaf)
+                    splitting.children[kept] = splitting.children[i];
+
+                kept++;
+            }
+
+            splitting.entries.resize(kept);
+
+            if (!splitting.leaf)
+                splitting.children.resize(kept);
+
+            return sibling;
+        }
+
+        void insert_entry(const clustering_feature<D>& entry)
+        {
+            point<double, D> centroid = entry.centroid();
+            size_t current = this->root;
+
+            this->path.clear();
+
+            while (!this->nodes[current].leaf)
+            {
+                size_t closest = this->closest_entry(this->nodes[current], centroid);
+
+                this->path.push_back({ current, closest });
+                current = this->nodes[current].children[closest];
+            }
+
+            auto& leaf = this->nodes[current];
+            size_t closest = this->closest_entry(leaf, centroid);
+
+            if (!leaf.entries.empty() && leaf.entries[closest].merged_radius(entry) <= this->threshold)
+                leaf.entries[closest].merge(entry);
+            else
+                leaf.entries.push_back(entry);
+
+            size_t sibling = leaf.entries.size() > this->leaf_capacity ? this->split(current) : NO_NODE;
+
+            // Parents above the first node that did not split only grow by the entry.
+            while (!this->path.empty())
+            {
+                path_step step = this->path.back();
+                this->path.pop_back();
+
+                if (sibling == NO_NODE)
+                {
+                    this->nodes[step.node].entries[step.entry].merge(entry);
+                    continue;
+                }
+
+                clustering_feature<D> current_summary = this->summarize(current);
+                clustering_feature<D> sibling_summary = this->summarize(sibling);
+
+                auto& parent = this->nodes[step.node];
+
+                parent.entries[step.entry] = current_summary;
+                parent.entries.push_back(sibling_summary);
+                parent.children.push_back(sibling);
+
+                current = step.node;
+                sibling = parent.entries.size() > this->branching_factor ? this->split(current) : NO_NODE;
+            }
+
+            if (sibling != NO_NODE)
+            {
+                size_t new_root = this->add_node(false);
+
+                this->nodes[new_root].entries = { this->summarize(this->root), this->summarize(sibling) };
+                this->nodes[new_root].children = { this->root, sibling };
+
+                this->root = new_root;
+            }
+        }
+
+        // The mean over leaves of the smallest radius any two of their entries would merge into,
+        // so about half of the closest pairs merge, but at least double the current threshold.
+        double next_threshold() const
+        {
+            double total = 0;
+            size_t leaves = 0;
+
+            for (auto& node : this->nodes)
+            {
+                if (!node.leaf || node.entries.size() < 2)
+                    continue;
+
+                double smallest = DBL_MAX;
+
+                for (size_t i = 0; i < node.entries.size(); i++)
+                {
+                    for (size_t j = i + 1; j < node.entries.size(); j++)
+                        smallest = std::min(smallest, node.entries[i].merged_radius(node.entries[j]));
+                }
+
+                total += smallest;
+                leaves++;
+            }
+
+            double heuristic = leaves == 0 ? 0 : total / leaves;
+
+            return std::max({ heuristic, this->threshold * 2, DBL_MIN });
+        }
+
+        void rebuild()
+        {
+            while (this->nodes.size() > this->max_nodes())
+            {
+                this->threshold = this->next_threshold();
+
+                this->reinserted.clear();
+
+                for (auto& node : this->nodes)
+                {
+                    if (node.leaf)
+                        this->reinserted.insert(this->reinserted.end(), node.entries.begin(), node.entries.end());
+                }
+
+                this->nodes.clear();
+                this->root = this->add_node(true);
+
+                for (auto& entry : this->reinserted)
+                    this->insert_entry(entry);
+
+                this->rebuilds++;
+            }
+        }
+
+    public:
+        // Most entries of an inner node and of a leaf.
+        size_t branching_factor = 8;
+        size_t leaf_capacity = 8;
+
+        // Largest radius a leaf entry may reach by absorbing an observation. Starts at zero, so
+        // only equal observations merge until the budget forces coarser summaries.
+        double threshold = 0;
+
+        size_t memory_budget = 0;
+        size_t rebuilds = 0;
+
+        cf_tree(size_t memory_budget = 1 << 20, size_t branching_factor = 8, size_t leaf_capacity = 8)
+            : branching_factor(std::max<size_t>(branching_factor, 2)), leaf_capacity(std::max<size_t>(leaf_capacity, 2)), memory_budget(memory_budget)
+        {
+            this->clear();
+        }
+
+        void clear()
+        {
+            this->nodes.clear();
+            this->nodes.reserve(this->max_nodes() + 1);
+            this->root = this->add_node(true);
+
+            this->threshold = 0;
+            this->rebuilds = 0;
+            this->observations_amount = 0;
+        }
+
+        // Every node reserves room for a full set of entries plus the one that overflows it.
+        static size_t node_size(size_t entries)
+        {
+            return sizeof(node) + (entries + 1) * (sizeof(clustering_feature<D>) + sizeof(size_t));
+        }
+
+        size_t max_nodes() const
+        {
+            return std::max<size_t>(this->memory_budget / node_size(std::max(this->leaf_capacity, this->branching_factor)), 1);
+        }
+
+        size_t memory_usage() const
+        {
+            return this->nodes.size() * node_size(std::max(this->leaf_capacity, this->branching_factor));
+        }
+
+        size_t size() const
+        {
+            return this->observations_amount;
+        }
+
+        template <typename P>
+        void insert(const P& observation)
+        {
+            this->insert(clustering_feature<D>::of(observation));
+        }
+
+        void insert(const clustering_feature<D>& entry)
+        {
+            this->insert_entry(entry);
+            this->observations_amount += entry.count;
+
+            if (this->nodes.size() > this->max_nodes())
+                this->rebuild();
+        }
+
+        std::vector<clustering_feature<D>> leaf_entries() const
+        {
+            std::vector<clustering_feature<D>> result;
+
+            for (auto& node : this->nodes)
+            {
+                if (node.leaf)
+                    result.insert(result.end(), node.entries.begin(), node.entries.end());
+            }
+
+            return result;
+        }
+    };
+
+    // BIRCH: observations are summarized by a CF tree within a fixed memory budget, and the K
+    // clusters come from a weighted K means over the leaf summaries. Observations can be streamed
+    // in with insert and clustered at any time with streamed_clusters; partition streams the
+    // whole span, then assigns it to the means in a single pass.
+    template <typename T = int32_t, size_t D = 2>
+    struct birch : public partitioner<T, D>
+    {
+        // Bounds the iterations of the K means over the summaries.
+        size_t max_iterations = 300;
+
+        cf_tree<D> tree;
+
+        birch(size_t threads = 1, size_t memory_budget = 1 << 20) : tree(memory_budget)
+        {
+            this->name = "BIRCH";
+            this->param_name = "K";
+
+            if (threads > 1)
+                this->pool = std::make_unique<thread_pool>(threads);
+        }
+
+        void reset_stream()
+        {
+            this->tree.clear();
+        }
+
+        void insert(const point<T, D>& observation)
+        {
+            this->tree.insert(observation);
+        }
+
+        void insert(observation_span<T, D> batch)
+        {
+            for (auto& observation : batch)
+                this->tree.insert(observation);
+        }
+
+        // Clusters at the means of the summaries streamed so far. They have no observations bound,
+        // since none are kept.
+        std::vector<cluster<T, D>> streamed_clusters()
+        {
+            partitioning_profile profile;
+            return this->streamed_clusters(profile);
+        }
+
+        std::vector<cluster<T, D>> streamed_clusters(partitioning_profile& profile)
+        {
+            std::vector<point<double, D>> means = this->cluster_summaries(profile);
+            std::vector<cluster<T, D>> clusters(means.size());
+
+            for (size_t i = 0; i < clusters.size(); i++)
+            {
+                clusters[i].mean = point_cast<T, D>(means[i]);
+                clusters[i].color = cluster_color(i);
+            }
+
+            return clusters;
+        }
+
+        std::vector<cluster<T, D>> partition(observation_span<T, D> observations, partitioning_profile& profile = {}) override
+        {
+            profile.reset();
+            timer t(profile.elapsed_time);
+            allocation_counter a(profile.heap_allocations);
+
+            this->reset_stream();
+
+            {
+                phase_timer t(profile, partitioning_phase::seeding);
+
+                for (size_t i = 0; i < observations.size() && !this->cancelled; i++)
+                    this->tree.insert(observations[i]);
+            }
+
+            std::vector<cluster<T, D>> clusters = this->streamed_clusters(profile);
+
+            if (clusters.empty())
+                return clusters;
+
+            auto assignment = std::make_shared<labeling<T, D>>(observations, clusters.size());
+
+            {
+                phase_timer t(profile, partitioning_phase::assignment);
+
+                this->means_table.load(this->means);
+
+                this->for_each_chunk(observations.size(), [&](size_t begin, size_t end) {
+                    this->means_table.nearest(observations.data() + begin, end - begin, assignment->labels.data() + begin);
+                });
+
+                assignment->group(clusters.size());
+            }
+
+            profile.distance_evaluations += observations.size() * clusters.size();
+            bind_clusters(clusters, std::shared_ptr<const labeling<T, D>>(assignment));
+
+            return clusters;
+        }
+
+    private:
+        static constexpr size_t CHUNK_SIZE = 16384;
+
+        std::unique_ptr<thread_pool> pool;
+        mean_table<D> means_table;
+
+        std::vector<clustering_feature<D>> summaries;
+        std::vector<point<double, D>> centroids;
+        std::vector<point<double, D>> means;
+        std::vector<label_t> labels;
+        std::vector<label_t> previous_labels;
+
+        template <typename F>
+        void for_each_chunk(size_t size, F&& function)
+        {
+            size_t chunks_amount = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+
+            auto task = [&](size_t chunk) {
+                function(chunk * CHUNK_SIZE, std::min(size, (chunk + 1) * CHUNK_SIZE));
+            };
+
+            if (this->pool)
+                this->pool->run(chunks_amount, task);
+
+            else for (size_t chunk = 0; chunk < chunks_amount; chunk++)
+                task(chunk);
+        }
+
+        size_t sample_weighted(const std::vector<double>& weights, double total)
+        {
+            double target = std::uniform_real_distribution<double>(0, total)(this->random_engine);
+            size_t last_positive = 0;
+
+            for (size_t i = 0; i < weights.size(); i++)
+            {
+                if (weights[i] <= 0)
+                    continue;
+
+                if (target < weights[i])
+                    return i;
+
+                target -= weights[i];
+                last_positive = i;
+            }
+
+            return last_positive;
+        }
+
+        // D^2 sampling over the summary centroids, each weighted by the observations it holds.
+        void seed_means(partitioning_profile& profile)
+        {
+            phase_timer t(profile, partitioning_phase::seeding);
+
+            std::vector<double> weights(this->summaries.size());
+            std::vector<double> min_distances(this->summaries.size(), DBL_MAX);
+
+            for (size_t i = 0; i < weights.size(); i++)
+                weights[i] = static_cast<double>(this->summaries[i].count);
+
+            this->means.assign(1, this->centroids[this->sample_weighted(weights, static_cast<double>(this->tree.size()))]);
+
+            while (this->means.size() < this->param)
+            {
+                double total = 0;
+
+                for (size_t i = 0; i < this->centroids.size(); i++)
+                {
+                    min_distances[i] = std::min(min_distances[i], squared_distance<D>(this->centroids[i], this->means.back()));
+                    weights[i] = this->summaries[i].count * min_distances[i];
+
+                    total += weights[i];
+                }
+
+                profile.distance_evaluations += this->centroids.size();
+
+                // Fewer distinct summaries than K, the remaining means can only be duplicates.
+                this->means.push_back(total > 0 ? this->centroids[this->sample_weighted(weights, total)] : this->means.back());
+            }
+        }
+
+        // Weighted Lloyd iterations over the leaf summaries. Every summary moves as a whole, and
+        // its inertia against a mean is exact, so the reported inertia is that of the observations.
+        std::vector<point<double, D>> cluster_summaries(partitioning_profile& profile)
+        {
+            this->summaries = this->tree.leaf_entries();
+
+            if (this->summaries.empty())
+            {
+                this->means.clear();
+                return this->means;
+            }
+
+            this->centroids.resize(this->summaries.size());
+
+            for (size_t i = 0; i < this->summaries.size(); i++)
+                this->centroids[i] = this->summaries[i].centroid();
+
+            this->seed_means(profile);
+
+            this->labels.assign(this->summaries.size(), 0);
+            this->previous_labels.assign(this->summaries.size(), std::numeric_limits<label_t>::max());
+
+            std::vector<clustering_feature<D>> groups(this->means.size());
+            std::vector<cluster<T, D>> reported;
+
+            profile.stopped_by = stop_reason::max_iterations;
+
+            for (size_t iteration = 0; this->max_iterations == 0 || iteration < this->max_iterations; iteration++)
+            {
+                size_t reassigned = 0;
+                double inertia = 0;
+
+                {
+                    phase_timer t(profile, partitioning_phase::assignment);
+
+                    this->means_table.load(this->means);
+                    this->means_table.nearest(this->centroids.data(), this->centroids.size(), this->labels.data());
+
+                    for (size_t i = 0; i < this->summaries.size(); i++)
+                    {
+                        inertia += this->summaries[i].squared_distance_sum(this->means[this->labels[i]]);
+
+                        if (this->labels[i] != this->previous_labels[i])
+                            reassigned += this->summaries[i].count;
+                    }
+                }
+
+                size_t evaluations = this->summaries.size() * this->means.size();
+
+                profile.distance_evaluations += evaluations;
+                profile.record_iteration(evaluations, reassigned, inertia);
+
+                if (reassigned == 0)
+                {
+                    profile.stopped_by = stop_reason::converged;
+                    break;
+                }
+
+                {
+                    phase_timer t(profile, partitioning_phase::update);
+
+                    std::fill(groups.begin(), groups.end(), clustering_feature<D>{});
+
+                    for (size_t i = 0; i < this->summaries.size(); i++)
+                        groups[this->labels[i]].merge(this->summaries[i]);
+
+                    // Means left without summaries stay where they are.
+                    for (size_t j = 0; j < this->means.size(); j++)
+                    {
+                        if (groups[j].count > 0)
+                            this->means[j] = groups[j].centroid();
+                    }
+                }
+
+                std::swap(this->labels, this->previous_labels);
+                profile.iterations++;
+
+                if (this->on_iteration)
+                {
+                    reported.resize(this->means.size());
+
+                    for (size_t j = 0; j < this->means.size(); j++)
+                    {
+                        reported[j].mean = point_cast<T, D>(this->means[j]);
+                        reported[j].color = cluster_color(j);
+                    }
+
+                    this->report_iteration(reported, {});
+                }
+
+                if (this->cancelled)
+                {
+                    profile.stopped_by = stop_reason::cancelled;
+                    break;
+                }
+            }
+
+            return this->means;
+        }
+    };
+}
@@ -1,93 +1,351 @@
 #pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <iterator>
+#include <memory>
 #include <random>
 #include <queue>
 #include "colors.h"
 #include "constrained.h"
+#include "partitioning_profile.h"
+#include "point.h"
 #include "timer.h"
-#include "vector2d.h"
 
 namespace ntf::cluster
 {
-    template <typename T = int>
-    struct cluster
+    using label_t = uint32_t;
+
+    // Non-owning view of contiguously stored observations, either a std::vector or a mapped
+    // dataset file, so partitioners never need their own copy.
+    template <typename T = int32_t, size_t D = 2>
+    class observation_span
     {
-        std::vector<v2d_shared_ptr<T>> observations;
-        v2d<T> mean;
+    private:
+        const point<T, D>* pointer = nullptr;
+        size_t length = 0;
 
-        color color{ 255, 255, 255 };
+    public:
+        observation_span() = default;
 
-        double variability() const
+        observation_span(const point<T, D>* data, size_t size)
+            : pointer(data), length(size)
+        {}
+
+        observation_span(const std::vector<point<T, D>>& observations)
+            : pointer(observations.data()), length(observations.size())
+        {}
+
+        const point<T, D>* data() const
         {
-            double result = 0;
+            return this->pointer;
+        }
 
-            for (auto& observation : this->observations)
-                result += this->mean.euclidean_distance_squared(*observation);
+        size_t size() const
+        {
+            return this->length;
+        }
 
-            return result;
+        bool empty() const
+        {
+            return this->length == 0;
+        }
+
+        const point<T, D>* begin() const
+        {
+            return this->pointer;
+        }
+
+        const point<T, D>* end() const
+        {
+            return this->pointer + this->length;
+        }
+
+        const point<T, D>& operator[] (size_t index) const
+        {
+            return this->pointer[index];
         }
     };
 
-    struct partitioning_profile
+    // Cluster label of every observation plus the observation indices grouped by label,
+    // so clusters can walk their members without owning copies of them.
+    template <typename T = int32_t, size_t D = 2>
+    struct labeling
     {
-        size_t iterations = 0;
-        microseconds elapsed_time = microseconds::zero();
+        const point<T, D>* observations = nullptr;
+
+        std::vector<label_t> labels;
+        std::vector<size_t> offsets;
+        std::vector<size_t> indices;
+
+        labeling() = default;
+
+        labeling(observation_span<T, D> observations, size_t clusters_amount = 1)
+            : observations(observations.data()), labels(observations.size(), 0)
+        {
+            this->group(clusters_amount);
+        }
+
+        void group(size_t clusters_amount)
+        {
+            this->offsets.assign(clusters_amount + 1, 0);
+            this->indices.resize(this->labels.size());
+
+            for (label_t label : this->labels)
+                this->offsets[label + 1]++;
+
+            for (size_t i = 1; i <= clusters_amount; i++)
+                this->offsets[i] += this->offsets[i - 1];
+
+            for (size_t i = 0; i < this->labels.size(); i++)
+                this->indices[this->offsets[this->labels[i]]++] = i;
+
+            for (size_t i = clusters_amount; i > 0; i--)
+                this->offsets[i] = this->offsets[i - 1];
+
+            this->offsets[0] = 0;
+        }
+    };
+
+    template <typename T = int32_t, size_t D = 2>
+    class observation_range
+    {
+    public:
+        class iterator
+        {
+        private:
+            const point<T, D>* observations = nullptr;
+            const size_t* index = nullptr;
+
+        public:
+            using iterator_category = std::random_access_iterator_tag;
+            using value_type = point<T, D>;
+            using difference_type = std::ptrdiff_t;
+            using pointer = const point<T, D>*;
+            using reference = const point<T, D>&;
+
+            iterator() = default;
+            iterator(const point<T, D>* observations, const size_t* index) : observations(observations), index(index) {}
+
+            reference operator* () const { return this->observations[*this->index]; }
+            pointer operator-> () const { return &this->observations[*this->index]; }
+            reference operator[] (difference_type n) const { return this->observations[this->index[n]]; }
+
+            iterator& operator++ () { ++this->index; return *this; }
+            iterator& operator-- () { --this->index; return *this; }
+            iterator operator++ (int) { iterator copy = *this; ++this->index; return copy; }
+            iterator operator-- (int) { iterator copy = *this; --this->index; return copy; }
+
+            iterator& operator+= (difference_type n) { this->index += n; return *this; }
+            iterator& operator-= (difference_type n) { this->index -= n; return *this; }
+            iterator operator+ (difference_type n) const { return { this->observations, this->index + n }; }
+            iterator operator- (difference_type n) const { return { this->observations, this->index - n }; }
+            difference_type operator- (const iterator& rhs) const { return this->index - rhs.index; }
+
+            bool operator== (const iterator& rhs) const { return this->index == rhs.index; }
+            bool operator!= (const iterator& rhs) const { return this->index != rhs.index; }
+            bool operator< (const iterator& rhs) const { return this->index < rhs.index; }
+        };
+
+    private:
+        std::shared_ptr<const labeling<T, D>> source;
+        label_t label = 0;
+
+        const size_t* index_at(size_t position) const
+        {
+            return this->source->indices.data() + this->source->offsets[this->label] + position;
+        }
+
+    public:
+        observation_range() = default;
+
+        observation_range(std::shared_ptr<const labeling<T, D>> source, label_t label)
+            : source(std::move(source)), label(label)
+        {}
+
+        size_t size() const
+        {
+            if (!this->source || this->label + 1 >= this->source->offsets.size())
+                return 0;
+
+            return this->source->offsets[this->label + 1] - this->source->offsets[this->label];
+        }
 
-        void reset()
+        bool empty() const
         {
-            this->iterations = 0;
-            this->elapsed_time = microseconds::zero();
+            return this->size() == 0;
         }
 
-        partitioning_profile& operator+= (const partitioning_profile& rhs)
+        iterator begin() const
         {
-            this->iterations += rhs.iterations;
-            this->elapsed_time += rhs.elapsed_time;
+            return this->empty() ? iterator{} : iterator{ this->source->observations, this->index_at(0) };
+        }
 
-            return *this;
+        iterator end() const
+        {
+            return this->empty() ? iterator{} : iterator{ this->source->observations, this->index_at(this->size()) };
         }
 
-        partitioning_profile& operator-= (const partitioning_profile& rhs)
+        const point<T, D>& operator[] (size_t position) const
         {
-            this->iterations -= rhs.iterations;
-            this->elapsed_time -= rhs.elapsed_time;
+            return this->source->observations[*this->index_at(position)];
+        }
 
-            return *this;
+        // Index of the member in the observation vector the clustering was computed on.
+        size_t index(size_t position) const
+        {
+            return *this->index_at(position);
         }
 
-        partitioning_profile operator+ (const partitioning_profile& rhs) const
+        const std::shared_ptr<const labeling<T, D>>& get_source() const
         {
-            return { this->iterations + rhs.iterations, this->elapsed_time + rhs.elapsed_time };
+            return this->source;
         }
+    };
+
+    template <typename T = int32_t, size_t D = 2>
+    struct cluster
+    {
+        observation_range<T, D> observations;
+        point<T, D> mean;
 
-        partitioning_profile operator- (const partitioning_profile& rhs) const
+        ntf::color color{ 255, 255, 255 };
+
+        double variability() const
         {
-            return { this->iterations - rhs.iterations, this->elapsed_time - rhs.elapsed_time };
+            double result = 0;
+
+            for (auto& observation : this->observations)
+                result += this->mean.euclidean_distance_squared(observation);
+
+            return result;
         }
     };
 
+    // The palette's colors first, then hues a golden angle apart at alternating brightness, so
+    // any number of clusters gets a color and neighbouring indices stay distinguishable.
+    inline ntf::color cluster_color(size_t index)
+    {
+        if (index < VISUALLY_DISTINCT_COLORS.size())
+            return VISUALLY_DISTINCT_COLORS[index];
+
+        size_t extra = index - VISUALLY_DISTINCT_COLORS.size();
+
+        double hue = std::fmod(extra * 137.50776405, 360.0) / 60.0;
+        double value = extra % 2 == 0 ? 0.95 : 0.7;
+        double chroma = value * 0.75;
+        double secondary = chroma * (1 - std::abs(std::fmod(hue, 2.0) - 1));
+        double base = value - chroma;
+
+        double rgb[6][3] = {
+            { chroma, secondary, 0 },
+            { secondary, chroma, 0 },
+            { 0, chroma, secondary },
+            { 0, secondary, chroma },
+            { secondary, 0, chroma },
+            { chroma, 0, secondary },
+        };
+
+        auto& sector = rgb[static_cast<size_t>(hue) % 6];
+
+        auto channel = [&](double component) {
+            return static_cast<uint8_t>(std::lround((component + base) * 255));
+        };
+
+        return { channel(sector[0]), channel(sector[1]), channel(sector[2]) };
+    }
+
+    inline void seed_default_random_engine(std::default_random_engine& random_engine)
+    {
+        std::random_device device;
+        auto now = std::chrono::high_resolution_clock::now().time_since_epoch().count();
+
+        random_engine.seed(device() ^ static_cast<std::default_random_engine::result_type>(now));
+    }
+
     template <typename T>
+    class grid_index;
+
+    template <typename T = int32_t, size_t D = 2>
     struct partitioner
     {
         std::string name;
         std::string param_name;
         constrained<uint8_t, 1, UINT8_MAX, 15> param;
 
-        virtual std::vector<cluster<T>> partition(std::vector<v2d<T>>& observations, partitioning_profile& profile = {}) = 0;
+        std::default_random_engine random_engine;
+
+        // Optional spatial index over the observations being partitioned, shared between
+        // partitioners. It is only used while it covers exactly the observations passed in,
+        // and only in two dimensions.
+        std::shared_ptr<grid_index<T>> index;
+
+        // Called from the partitioning thread after every iteration with the current means and
+        // labels. Partitioners that have no labels for every observation mid-run pass none.
+        std::function<void(const std::vector<cluster<T, D>>&, const std::vector<label_t>&)> on_iteration;
+
+        // Set from another thread to stop a running partition after the current iteration. What was
+        // reached so far is returned, so callers that cancel should discard the result.
+        std::atomic<bool> cancelled{ false };
+
+        partitioner()
+        {
+            seed_default_random_engine(this->random_engine);
+        }
+
+        virtual ~partitioner() = default;
+
+        void seed(std::default_random_engine::result_type value)
+        {
+            this->random_engine.seed(value);
+        }
+
+        void report_iteration(const std::vector<cluster<T, D>>& clusters, const std::vector<label_t>& labels) const
+        {
+            if (this->on_iteration)
+                this->on_iteration(clusters, labels);
+        }
+
+        virtual std::vector<cluster<T, D>> partition(observation_span<T, D> observations, partitioning_profile& profile = {}) = 0;
+
+        // Warm start from a previous result over the same observations, possibly with more
+        // observations appended since. Partitioners that cannot reuse it start from scratch.
+        virtual std::vector<cluster<T, D>> repartition(
+            observation_span<T, D> observations,
+            const std::vector<cluster<T, D>>&,
+            partitioning_profile& profile = {}
+        )
+        {
+            return this->partition(observations, profile);
+        }
+
+        // Partitions observations that each stand for weights[i] observations, such as a coreset.
+        // Partitioners that cannot weigh observations ignore the weights.
+        virtual std::vector<cluster<T, D>> partition_weighted(
+            observation_span<T, D> observations,
+            const std::vector<double>&,
+            partitioning_profile& profile
+        )
+        {
+            return this->partition(observations, profile);
+        }
     };
 
-    template <typename T = int32_t>
-    double variability(const v2d<T>& mean, const cluster<T>& cluster)
+    template <typename T = int32_t, size_t D = 2>
+    double variability(const point<T, D>& mean, const cluster<T, D>& cluster)
     {
         double result = 0;
 
         for (auto& observation : cluster.observations)
-            result += mean.euclidean_distance_squared(*observation);
+            result += mean.euclidean_distance_squared(observation);
 
         return result;
     }
 
-    template <typename T = int32_t>
-    double dissimilarity(const std::vector<cluster<T>>& clusters)
+    template <typename T = int32_t, size_t D = 2>
+    double dissimilarity(const std::vector<cluster<T, D>>& clusters)
     {
         double result = 0;
 
@@ -97,20 +355,27 @@ namespace ntf::cluster
         return result;
     }
 
-    template <typename T = int32_t>
-    void clear_clusters(std::vector<cluster<T>>& clusters)
+    template <typename T = int32_t, size_t D = 2>
+    void clear_clusters(std::vector<cluster<T, D>>& clusters)
     {
         for (auto& cluster : clusters)
-            cluster.observations.clear();
+            cluster.observations = {};
+    }
+
+    template <typename T = int32_t, size_t D = 2>
+    void bind_clusters(std::vector<cluster<T, D>>& clusters, const std::shared_ptr<const labeling<T, D>>& source)
+    {
+        for (size_t i = 0; i < clusters.size(); i++)
+            clusters[i].observations = { source, static_cast<label_t>(i) };
     }
 
-    template <typename T = int32_t>
-    typename std::vector<cluster<T>>::const_iterator find_empty_cluster(const std::vector<cluster<T>>& clusters)
+    template <typename T = int32_t, size_t D = 2>
+    typename std::vector<cluster<T, D>>::const_iterator find_empty_cluster(const std::vector<cluster<T, D>>& clusters)
     {
         return std::find_if(
             clusters.begin(),
             clusters.end(),
-            [&](const cluster<T>& c) { return c.observations.empty(); }
+            [&](const cluster<T, D>& c) { return c.observations.empty(); }
         );
     }
 }
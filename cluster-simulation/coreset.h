@@ -0,0 +1,360 @@
+#pragma once
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <random>
+#include <vector>
+#include "k_means.h"
+
+namespace ntf::cluster
+{
+    // Partitions a weighted sample of the observations instead of all of them. The sample is a
+    // lightweight coreset: each observation is kept with probability proportional to half a
+    // uniform share plus half its share of the squared distances to the overall mean, and weighs
+    // the inverse of that probability, so weighted sums over the coreset estimate sums over every
+    // observation. Any partitioner clusters the coreset, through partition_weighted so those that
+    // can weigh observations, such as K means, respect the weights from seeding on. Its clusters
+    // are turned into weighted means, refined by weighted Lloyd iterations over the coreset for
+    // partitioners that could not weigh it, and every observation is assigned to them once.
+    template <typename T = int32_t, size_t D = 2>
+    struct coreset_partitioner : public partitioner<T, D>
+    {
+        // Expected amount of observations kept; fewer are when some would be kept for certain.
+        size_t coreset_size = 16384;
+
+        // Bounds the weighted Lloyd iterations over the coreset; zero keeps the inner partitioner's
+        // clusters and only moves their means to the weighted centroids.
+        size_t refine_iterations = 100;
+
+        // After each partition, also runs the inner partitioner over every observation, with the
+        // same seed, to report the inertia gap. Its time is not part of the profile.
+        bool measure_gap = false;
+
+        // Outcome of the last partition.
+        std::vector<point<T, D>> coreset;
+        std::vector<double> weights;
+
+        coreset_partitioner(std::shared_ptr<partitioner<T, D>> inner, size_t coreset_size = 16384, size_t threads = 1)
+            : coreset_size(coreset_size), inner(std::move(inner))
+        {
+            this->name = this->inner->name + " (coreset)";
+            this->param_name = this->inner->param_name;
+
+            if (threads > 1)
+                this->pool = std::make_unique<thread_pool>(threads);
+        }
+
+        std::vector<cluster<T, D>> partition(observation_span<T, D> observations, partitioning_profile& profile = {}) override
+        {
+            profile.reset();
+
+            std::vector<cluster<T, D>> clusters;
+
+            {
+                timer t(profile.elapsed_time);
+                allocation_counter a(profile.heap_allocations);
+
+                clusters = this->partition_coreset(observations, profile);
+            }
+
+            if (this->measure_gap && !clusters.empty() && !this->cancelled)
+                profile.inertia_gap = this->inertia_gap(observations, clusters);
+
+            return clusters;
+        }
+
+    private:
+        static constexpr size_t CHUNK_SIZE = 16384;
+
+        std::shared_ptr<partitioner<T, D>> inner;
+        std::default_random_engine::result_type inner_seed = 0;
+
+        std::unique_ptr<thread_pool> pool;
+        mean_table<D> means_table;
+
+        std::vector<point<double, D>> means;
+        std::vector<label_t> labels;
+        std::vector<label_t> previous_labels;
+
+        template <typename F>
+        void for_each_chunk(size_t size, F&& function)
+        {
+            size_t chunks_amount = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+
+            auto task = [&](size_t chunk) {
+                function(chunk, chunk * CHUNK_SIZE, std::min(size, (chunk + 1) * CHUNK_SIZE));
+            };
+
+            if (this->pool)
+                this->pool->run(chunks_amount, task);
+
+            else for (size_t chunk = 0; chunk < chunks_amount; chunk++)
+                task(chunk);
+        }
+
+        // Two passes: the first sums the observations relative to the first one, which keeps the
+        // variance free of cancellation far from the origin, the second samples.
+        void build_coreset(observation_span<T, D> observations)
+        {
+            size_t chunks_amount = (observations.size() + CHUNK_SIZE - 1) / CHUNK_SIZE;
+            auto origin = point_cast<double, D>(observations[0]);
+
+            std::vector<point<double, D>> chunk_sums(chunks_amount);
+            std::vector<double> chunk_norms(chunks_amount, 0);
+
+            this->for_each_chunk(observations.size(), [&](size_t chunk, size_t begin, size_t end) {
+                for (size_t i = begin; i < end; i++)
+                {
+                    for_each_dimension<D>([&](size_t d) {
+                        coordinate(chunk_sums[chunk], d) += static_cast<double>(coordinate(observations[i], d)) - coordinate(origin, d);
+                    });
+
+                    chunk_norms[chunk] += squared_distance<D>(observations[i], origin);
+                }
+            });
+
+            point<double, D> offset{};
+            double norms = 0;
+
+            for (size_t chunk = 0; chunk < chunks_amount; chunk++)
+            {
+                accumulate<D>(offset, chunk_sums[chunk]);
+                norms += chunk_norms[chunk];
+            }
+
+            double amount = static_cast<double>(observations.size());
+            point<double, D> mean{};
+
+            for_each_dimension<D>([&](size_t d) {
+                coordinate(offset, d) /= amount;
+                coordinate(mean, d) = coordinate(origin, d) + coordinate(offset, d);
+            });
+
+            double total = std::max(norms - amount * dot<D>(offset, offset), 0.0);
+            double size = static_cast<double>(this->coreset_size);
+
+            // Chunks draw from their own engines seeded from the partitioner's, so the coreset does
+            // not depend on the number of threads.
+            auto sample_seed = this->random_engine();
+
+            std::vector<std::vector<size_t>> chunk_picks(chunks_amount);
+            std::vector<std::vector<double>> chunk_weights(chunks_amount);
+
+            this->for_each_chunk(observations.size(), [&](size_t chunk, size_t begin, size_t end) {
+                std::default_random_engine chunk_engine(sample_seed + static_cast<std::default_random_engine::result_type>(chunk));
+                std::uniform_real_distribution<double> probability(0, 1);
+
+                for (size_t i = begin; i < end; i++)
+                {
+                    double share = total > 0 ? 0.5 / amount + 0.5 * squared_distance<D>(observations[i], mean) / total : 1 / amount;
+                    double kept = std::min(size * share, 1.0);
+
+                    if (probability(chunk_engine) < kept)
+                    {
+                        chunk_picks[chunk].push_back(i);
+                        chunk_weights[chunk].push_back(1 / kept);
+                    }
+                }
+            });
+
+            this->coreset.clear();
+            this->weights.clear();
+
+            for (size_t chunk = 0; chunk < chunks_amount; chunk++)
+            {
+                for (size_t index : chunk_picks[chunk])
+                    this->coreset.push_back(observations[index]);
+
+                this->weights.insert(this->weights.end(), chunk_weights[chunk].begin(), chunk_weights[chunk].end());
+            }
+        }
+
+        // Counters and phase times of the inner partition are added to the profile; iterations,
+        // history and the stop reason are the refinement's.
+        std::vector<cluster<T, D>> partition_inner(partitioning_profile& profile)
+        {
+            this->inner_seed = this->random_engine();
+
+            this->inner->param = this->param;
+            this->inner->index = nullptr;
+            this->inner->cancelled = false;
+            this->inner->seed(this->inner_seed);
+
+            this->inner->on_iteration = [this](const std::vector<cluster<T, D>>& clusters, const std::vector<label_t>&) {
+                if (this->cancelled)
+                    this->inner->cancelled = true;
+
+                this->report_iteration(clusters, {});
+            };
+
+            partitioning_profile inner_profile;
+            std::vector<cluster<T, D>> clusters = this->inner->partition_weighted(this->coreset, this->weights, inner_profile);
+
+            this->inner->on_iteration = nullptr;
+
+            for (size_t i = 0; i < PARTITIONING_PHASES_AMOUNT; i++)
+                profile.phase_times[i] += inner_profile.phase_times[i];
+
+            profile.distance_evaluations += inner_profile.distance_evaluations;
+            profile.skipped_distance_evaluations += inner_profile.skipped_distance_evaluations;
+            profile.reassigned_observations += inner_profile.reassigned_observations;
+            profile.repaired_clusters += inner_profile.repaired_clusters;
+            profile.stopped_by = inner_profile.stopped_by;
+
+            return clusters;
+        }
+
+        // Weighted Lloyd iterations over the coreset; the inertia they report estimates the
+        // inertia over every observation.
+        void refine(std::vector<cluster<T, D>>& clusters, partitioning_profile& profile)
+        {
+            std::vector<point<double, D>> sums(this->means.size());
+            std::vector<double> totals(this->means.size());
+
+            this->labels.assign(this->coreset.size(), 0);
+            this->previous_labels.assign(this->coreset.size(), std::numeric_limits<label_t>::max());
+
+            for (size_t iteration = 0; iteration < this->refine_iterations; iteration++)
+            {
+                size_t reassigned = 0;
+                double inertia = 0;
+
+                {
+                    phase_timer t(profile, partitioning_phase::assignment);
+
+                    this->means_table.load(this->means);
+
+                    this->for_each_chunk(this->coreset.size(), [&](size_t, size_t begin, size_t end) {
+                        this->means_table.nearest(this->coreset.data() + begin, end - begin, this->labels.data() + begin);
+                    });
+
+                    for (size_t i = 0; i < this->coreset.size(); i++)
+                    {
+                        inertia += this->weights[i] * squared_distance<D>(this->coreset[i], this->means[this->labels[i]]);
+                        reassigned += this->labels[i] != this->previous_labels[i];
+                    }
+                }
+
+                size_t evaluations = this->coreset.size() * this->means.size();
+
+                profile.distance_evaluations += evaluations;
+                profile.record_iteration(evaluations, reassigned, inertia);
+
+                if (reassigned == 0)
+                {
+                    profile.stopped_by = stop_reason::converged;
+                    return;
+                }
+
+                {
+                    phase_timer t(profile, partitioning_phase::update);
+
+                    std::fill(sums.begin(), sums.end(), point<double, D>{});
+                    std::fill(totals.begin(), totals.end(), 0);
+
+                    for (size_t i = 0; i < this->coreset.size(); i++)
+                    {
+                        double weight = this->weights[i];
+
+                        for_each_dimension<D>([&](size_t d) {
+                            coordinate(sums[this->labels[i]], d) += weight * static_cast<double>(coordinate(this->coreset[i], d));
+                        });
+
+                        totals[this->labels[i]] += weight;
+                    }
+
+                    // Means left without coreset observations stay where they are.
+                    for (size_t j = 0; j < this->means.size(); j++)
+                    {
+                        if (totals[j] <= 0)
+                            continue;
+
+                        for_each_dimension<D>([&](size_t d) {
+                            coordinate(this->means[j], d) = coordinate(sums[j], d) / totals[j];
+                        });
+
+                        clusters[j].mean = point_cast<T, D>(this->means[j]);
+                    }
+                }
+
+                std::swap(this->labels, this->previous_labels);
+                profile.iterations++;
+
+                this->report_iteration(clusters, {});
+
+                if (this->cancelled)
+                {
+                    profile.stopped_by = stop_reason::cancelled;
+                    return;
+                }
+            }
+
+            profile.stopped_by = stop_reason::max_iterations;
+        }
+
+        std::vector<cluster<T, D>> partition_coreset(observation_span<T, D> observations, partitioning_profile& profile)
+        {
+            if (observations.empty())
+                return {};
+
+            {
+                phase_timer t(profile, partitioning_phase::seeding);
+                timer c(profile.coreset_time);
+
+                this->build_coreset(observations);
+            }
+
+            std::vector<cluster<T, D>> clusters = this->partition_inner(profile);
+
+            if (clusters.empty())
+                return clusters;
+
+            this->means.resize(clusters.size());
+
+            {
+                phase_timer t(profile, partitioning_phase::update);
+
+                for (size_t j = 0; j < clusters.size(); j++)
+                {
+                    clusters[j].mean = k_means<T, D>::compute_centroid(clusters[j], this->weights);
+                    this->means[j] = point_cast<double, D>(clusters[j].mean);
+                }
+            }
+
+            if (this->refine_iterations > 0 && !this->cancelled)
+                this->refine(clusters, profile);
+
+            auto assignment = std::make_shared<labeling<T, D>>(observations, clusters.size());
+
+            {
+                phase_timer t(profile, partitioning_phase::assignment);
+
+                this->means_table.load(this->means);
+
+                this->for_each_chunk(observations.size(), [&](size_t, size_t begin, size_t end) {
+                    this->means_table.nearest(observations.data() + begin, end - begin, assignment->labels.data() + begin);
+                });
+
+                assignment->group(clusters.size());
+            }
+
+            profile.distance_evaluations += observations.size() * clusters.size();
+            bind_clusters(clusters, std::shared_ptr<const labeling<T, D>>(assignment));
+
+            return clusters;
+        }
+
+        // Relative excess of the dissimilarity over the inner partitioner's own on every
+        // observation; negative when the coreset partition came out better.
+        double inertia_gap(observation_span<T, D> observations, const std::vector<cluster<T, D>>& clusters)
+        {
+            this->inner->param = this->param;
+            this->inner->seed(this->inner_seed);
+
+            partitioning_profile full_profile;
+            double full = dissimilarity(this->inner->partition(observations, full_profile));
+
+            return full > 0 ? (dissimilarity(clusters) - full) / full : 0;
+        }
+    };
+}
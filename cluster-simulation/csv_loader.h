@@ -0,0 +1,219 @@
+#pragma once
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <string>
+#include <vector>
+#include "cluster.h"
+
+namespace ntf::cluster
+{
+    struct csv_statistics
+    {
+        size_t lines = 0;
+        size_t skipped_lines = 0;
+        size_t bytes = 0;
+    };
+
+    // Reads x,y observations from delimited text in fixed-size chunks. Only whole lines are parsed;
+    // the partial line at the end of a chunk is carried into the next one, so memory stays at one
+    // chunk of text plus two batches of observations whatever the size of the file. Lines whose
+    // columns are not numbers, such as headers, are counted and skipped.
+    template <typename T = int32_t>
+    class csv_loader
+    {
+    public:
+        static constexpr size_t DEFAULT_CHUNK_SIZE = 1 << 20;
+
+        size_t x_column = 0;
+        size_t y_column = 1;
+        char delimiter = ',';
+        size_t chunk_size = DEFAULT_CHUNK_SIZE;
+
+        // Parses the next chunk on another thread while the current batch is consumed.
+        bool overlapped = false;
+
+        csv_statistics statistics;
+
+    private:
+        std::ifstream in;
+        std::vector<char> buffer;
+        size_t carried = 0;
+        bool failed = false;
+
+        static const char* skip_blanks(const char* first, const char* last)
+        {
+            while (first != last && (*first == ' ' || *first == '\t'))
+                first++;
+
+            return first;
+        }
+
+        static bool parse_number(const char* first, const char* last, double& value)
+        {
+            first = skip_blanks(first, last);
+
+            if (first != last && *first == '+')
+                first++;
+
+            auto [end, error] = std::from_chars(first, last, value);
+
+            return error == std::errc() && skip_blanks(end, last) == last;
+        }
+
+        bool parse_line(const char* first, const char* last, v2d<T>& observation) const
+        {
+            if (first != last && last[-1] == '\r')
+                last--;
+
+            double x = 0.0;
+            double y = 0.0;
+            size_t found = 0;
+
+            for (size_t column = 0; first <= last && found < 2; column++)
+            {
+                const char* end = static_cast<const char*>(std::memchr(first, this->delimiter, last - first));
+
+                if (!end)
+                    end = last;
+
+                if (column == this->x_column && parse_number(first, end, x))
+                    found++;
+
+                else if (column == this->y_column && parse_number(first, end, y))
+                    found++;
+
+                else if (column == this->x_column || column == this->y_column)
+                    return false;
+
+                first = end + 1;
+            }
+
+            if (found < 2)
+                return false;
+
+            observation = { to_coordinate<T>(x), to_coordinate<T>(y) };
+            return true;
+        }
+
+        // Reads the next chunk and parses its whole lines into batch. Returns false at the end of
+        // the file, or on a read error or a line longer than a chunk, which also sets failed.
+        bool parse_chunk(std::vector<v2d<T>>& batch)
+        {
+            batch.clear();
+
+            if (this->failed || (!this->in && this->carried == 0))
+                return false;
+
+            this->in.read(this->buffer.data() + this->carried, static_cast<std::streamsize>(this->buffer.size() - this->carried));
+
+            size_t read = static_cast<size_t>(this->in.gcount());
+            size_t filled = this->carried + read;
+            bool last_chunk = !this->in;
+
+            if (this->in.bad())
+            {
+                this->failed = true;
+                return false;
+            }
+
+            if (filled == 0)
+                return false;
+
+            this->statistics.bytes += read;
+
+            const char* first = this->buffer.data();
+            const char* end = first + filled;
+
+            while (first < end)
+            {
+                const char* line_end = static_cast<const char*>(std::memchr(first, '\n', end - first));
+
+                if (!line_end)
+                {
+                    if (!last_chunk)
+                        break;
+
+                    line_end = end;
+                }
+
+                v2d<T> observation;
+
+                this->statistics.lines++;
+
+                if (this->parse_line(first, line_end, observation))
+                    batch.push_back(observation);
+                else
+                    this->statistics.skipped_lines++;
+
+                first = line_end + 1;
+            }
+
+            this->carried = first < end ? static_cast<size_t>(end - first) : 0;
+
+            if (this->carried == this->buffer.size())
+            {
+                this->failed = true;
+                return false;
+            }
+
+            std::memmove(this->buffer.data(), first, this->carried);
+            return true;
+        }
+
+    public:
+        // Calls consume with every batch of observations in file order. The batch is only valid
+        // during the call. Returns false when the file cannot be read or has a line longer than
+        // chunk_size; batches consumed until then are not undone.
+        bool stream(const std::string& path, const std::function<void(observation_span<T>)>& consume)
+        {
+            this->in = std::ifstream(path, std::ios::binary);
+            this->buffer.assign(std::max<size_t>(this->chunk_size, 2), 0);
+            this->carried = 0;
+            this->failed = !this->in;
+            this->statistics = {};
+
+            std::vector<v2d<T>> batches[2];
+            size_t current = 0;
+
+            bool parsed = this->parse_chunk(batches[current]);
+
+            while (parsed)
+            {
+                if (!this->overlapped)
+                {
+                    consume(batches[current]);
+                    parsed = this->parse_chunk(batches[current]);
+
+                    continue;
+                }
+
+                auto next = std::async(std::launch::async, [this, &batches, current] {
+                    return this->parse_chunk(batches[1 - current]);
+                });
+
+                consume(batches[current]);
+
+                parsed = next.get();
+                current = 1 - current;
+            }
+
+            this->in.close();
+            this->buffer.clear();
+            this->buffer.shrink_to_fit();
+
+            return !this->failed;
+        }
+
+        // Appends every observation of the file to observations.
+        bool load(const std::string& path, std::vector<v2d<T>>& observations)
+        {
+            return this->stream(path, [&](observation_span<T> batch) {
+                observations.insert(observations.end(), batch.begin(), batch.end());
+            });
+        }
+    };
+}
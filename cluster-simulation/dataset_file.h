@@ -0,0 +1,407 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include "cluster.h"
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace ntf::cluster
+{
+    // Binary files are little endian as written by the producing machine: a fixed header followed
+    // by the payload, 8-byte aligned. Readers reject other versions, byte orders and coordinate types.
+    // Version 2 added the repair, stop, communication and coreset fields to partition profiles.
+    constexpr uint32_t FILE_FORMAT_VERSION = 2;
+    constexpr uint32_t FILE_BYTE_ORDER = 0x01020304;
+
+    constexpr char DATASET_MAGIC[8] = { 'N', 'T', 'F', 'O', 'B', 'S', 0, 0 };
+    constexpr char PARTITION_MAGIC[8] = { 'N', 'T', 'F', 'P', 'A', 'R', 'T', 0 };
+
+    enum class coordinate_type : uint32_t
+    {
+        int32 = 1,
+        int64 = 2,
+        float32 = 3,
+        float64 = 4,
+    };
+
+    template <typename T>
+    constexpr coordinate_type coordinate_type_of()
+    {
+        static_assert(sizeof(v2d<T>) == 2 * sizeof(T), "v2d must be two packed coordinates");
+
+        if constexpr (std::is_same_v<T, int32_t>)
+            return coordinate_type::int32;
+        else if constexpr (std::is_same_v<T, int64_t>)
+            return coordinate_type::int64;
+        else if constexpr (std::is_same_v<T, float>)
+            return coordinate_type::float32;
+        else
+        {
+            static_assert(std::is_same_v<T, double>, "unsupported coordinate type");
+            return coordinate_type::float64;
+        }
+    }
+
+    struct file_header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t byte_order;
+        uint32_t coordinate_type;
+        uint32_t coordinate_size;
+        uint64_t observations_amount;
+    };
+
+    // Dataset: file_header, then observations_amount v2d<T>.
+    // Partition: file_header, clusters_amount, clusters_amount means, observations_amount labels,
+    // padding to 8 bytes, then the profile totals as PROFILE_FIELDS_AMOUNT uint64 values: iterations,
+    // elapsed, distance evaluations, skipped ones, reassigned observations, heap allocations, the
+    // phase times, repaired clusters, stop reason, communication time, coreset time and the bits of
+    // the inertia gap. Times are in microseconds.
+    constexpr size_t PROFILE_PHASES_FIELD = 6;
+    constexpr size_t PROFILE_EXTRA_FIELD = PROFILE_PHASES_FIELD + PARTITIONING_PHASES_AMOUNT;
+    constexpr size_t PROFILE_FIELDS_AMOUNT = PROFILE_EXTRA_FIELD + 5;
+
+    // Partitions come from a partitioner's param, so a file claiming more clusters is corrupt.
+    constexpr uint64_t MAX_PARTITION_CLUSTERS = UINT8_MAX;
+
+    template <typename T>
+    file_header make_file_header(const char (&magic)[8], size_t observations_amount)
+    {
+        file_header header{};
+
+        std::memcpy(header.magic, magic, sizeof(header.magic));
+        header.version = FILE_FORMAT_VERSION;
+        header.byte_order = FILE_BYTE_ORDER;
+        header.coordinate_type = static_cast<uint32_t>(coordinate_type_of<T>());
+        header.coordinate_size = sizeof(T);
+        header.observations_amount = observations_amount;
+
+        return header;
+    }
+
+    template <typename T>
+    bool valid_file_header(const file_header& header, const char (&magic)[8])
+    {
+        return std::memcmp(header.magic, magic, sizeof(header.magic)) == 0
+            && header.version == FILE_FORMAT_VERSION
+            && header.byte_order == FILE_BYTE_ORDER
+            && header.coordinate_type == static_cast<uint32_t>(coordinate_type_of<T>())
+            && header.coordinate_size == sizeof(T);
+    }
+
+    template <typename T = int32_t>
+    bool write_dataset(const std::string& path, observation_span<T> observations)
+    {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+
+        file_header header = make_file_header<T>(DATASET_MAGIC, observations.size());
+
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(observations.data()), static_cast<std::streamsize>(observations.size() * sizeof(v2d<T>)));
+
+        return static_cast<bool>(out);
+    }
+
+    // Read-only memory mapping of a dataset file. Partitioners run directly on observations(),
+    // which stays valid until the dataset is closed or destroyed.
+    template <typename T = int32_t>
+    class mapped_dataset
+    {
+    private:
+        const char* mapping = nullptr;
+        size_t mapped_size = 0;
+        observation_span<T> span;
+
+#ifdef _WIN32
+        HANDLE file = INVALID_HANDLE_VALUE;
+        HANDLE file_mapping = nullptr;
+#endif
+
+        bool map(const std::string& path)
+        {
+#ifdef _WIN32
+            this->file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+            LARGE_INTEGER size{};
+
+            if (this->file == INVALID_HANDLE_VALUE || !GetFileSizeEx(this->file, &size) || size.QuadPart == 0)
+                return false;
+
+            this->file_mapping = CreateFileMappingA(this->file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+
+            if (!this->file_mapping)
+                return false;
+
+            this->mapping = static_cast<const char*>(MapViewOfFile(this->file_mapping, FILE_MAP_READ, 0, 0, 0));
+            this->mapped_size = static_cast<size_t>(size.QuadPart);
+#else
+            int descriptor = ::open(path.c_str(), O_RDONLY);
+
+            if (descriptor < 0)
+                return false;
+
+            struct stat status{};
+
+            if (fstat(descriptor, &status) != 0 || status.st_size == 0)
+            {
+                ::close(descriptor);
+                return false;
+            }
+
+            void* memory = mmap(nullptr, static_cast<size_t>(status.st_size), PROT_READ, MAP_PRIVATE, descriptor, 0);
+            ::close(descriptor);
+
+            if (memory == MAP_FAILED)
+                return false;
+
+            madvise(memory, static_cast<size_t>(status.st_size), MADV_SEQUENTIAL);
+
+            this->mapping = static_cast<const char*>(memory);
+            this->mapped_size = static_cast<size_t>(status.st_size);
+#endif
+            return this->mapping != nullptr;
+        }
+
+    public:
+        mapped_dataset() = default;
+
+        mapped_dataset(const mapped_dataset&) = delete;
+        mapped_dataset& operator= (const mapped_dataset&) = delete;
+
+        ~mapped_dataset()
+        {
+            this->close();
+        }
+
+        // Returns false, leaving the dataset closed, when the file is missing or is not a dataset
+        // of this coordinate type.
+        bool open(const std::string& path)
+        {
+            this->close();
+
+            if (!this->map(path) || this->mapped_size < sizeof(file_header))
+            {
+                this->close();
+                return false;
+            }
+
+            file_header header;
+            std::memcpy(&header, this->mapping, sizeof(header));
+
+            if (!valid_file_header<T>(header, DATASET_MAGIC)
+                || (this->mapped_size - sizeof(header)) / sizeof(v2d<T>) < header.observations_amount)
+            {
+                this->close();
+                return false;
+            }
+
+            this->span = { reinterpret_cast<const v2d<T>*>(this->mapping + sizeof(header)), static_cast<size_t>(header.observations_amount) };
+            return true;
+        }
+
+        void close()
+        {
+#ifdef _WIN32
+            if (this->mapping)
+                UnmapViewOfFile(this->mapping);
+
+            if (this->file_mapping)
+                CloseHandle(this->file_mapping);
+
+            if (this->file != INVALID_HANDLE_VALUE)
+                CloseHandle(this->file);
+
+            this->file_mapping = nullptr;
+            this->file = INVALID_HANDLE_VALUE;
+#else
+            if (this->mapping)
+                munmap(const_cast<char*>(this->mapping), this->mapped_size);
+#endif
+            this->mapping = nullptr;
+            this->mapped_size = 0;
+            this->span = {};
+        }
+
+        bool is_open() const
+        {
+            return this->mapping != nullptr;
+        }
+
+        observation_span<T> observations() const
+        {
+            return this->span;
+        }
+    };
+
+    // Copies a dataset file into observations, for callers that need to grow or edit it.
+    template <typename T = int32_t>
+    bool read_dataset(const std::string& path, std::vector<v2d<T>>& observations)
+    {
+        mapped_dataset<T> dataset;
+
+        if (!dataset.open(path))
+            return false;
+
+        observations.assign(dataset.observations().begin(), dataset.observations().end());
+        return true;
+    }
+
+    template <typename T = int32_t>
+    bool write_partition(const std::string& path, const std::vector<cluster<T>>& clusters, size_t observations_amount, const partitioning_profile& profile)
+    {
+        std::vector<label_t> labels(observations_amount, 0);
+
+        for (size_t label = 0; label < clusters.size(); label++)
+        {
+            auto& members = clusters[label].observations;
+
+            for (size_t i = 0; i < members.size(); i++)
+            {
+                if (members.index(i) < labels.size())
+                    labels[members.index(i)] = static_cast<label_t>(label);
+            }
+        }
+
+        std::vector<v2d<T>> means(clusters.size());
+
+        for (size_t i = 0; i < clusters.size(); i++)
+            means[i] = clusters[i].mean;
+
+        uint64_t fields[PROFILE_FIELDS_AMOUNT] = {
+            profile.iterations,
+            static_cast<uint64_t>(profile.elapsed_time.count()),
+            profile.distance_evaluations,
+            profile.skipped_distance_evaluations,
+            profile.reassigned_observations,
+            profile.heap_allocations,
+        };
+
+        for (size_t i = 0; i < PARTITIONING_PHASES_AMOUNT; i++)
+            fields[PROFILE_PHASES_FIELD + i] = static_cast<uint64_t>(profile.phase_times[i].count());
+
+        fields[PROFILE_EXTRA_FIELD] = profile.repaired_clusters;
+        fields[PROFILE_EXTRA_FIELD + 1] = static_cast<uint64_t>(profile.stopped_by);
+        fields[PROFILE_EXTRA_FIELD + 2] = static_cast<uint64_t>(profile.communication_time.count());
+        fields[PROFILE_EXTRA_FIELD + 3] = static_cast<uint64_t>(profile.coreset_time.count());
+
+        std::memcpy(&fields[PROFILE_EXTRA_FIELD + 4], &profile.inertia_gap, sizeof(double));
+
+        file_header header = make_file_header<T>(PARTITION_MAGIC, observations_amount);
+        uint64_t clusters_amount = clusters.size();
+        uint64_t padding = 0;
+
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(&clusters_amount), sizeof(clusters_amount));
+        out.write(reinterpret_cast<const char*>(means.data()), static_cast<std::streamsize>(means.size() * sizeof(v2d<T>)));
+        out.write(reinterpret_cast<const char*>(labels.data()), static_cast<std::streamsize>(labels.size() * sizeof(label_t)));
+        out.write(reinterpret_cast<const char*>(&padding), static_cast<std::streamsize>((8 - out.tellp() % 8) % 8));
+        out.write(reinterpret_cast<const char*>(fields), sizeof(fields));
+
+        return static_cast<bool>(out);
+    }
+
+    // Rebuilds the clusters of a partition file over the observations it was computed on.
+    // Returns false when the file is invalid or was written for a different number of observations.
+    template <typename T = int32_t>
+    bool read_partition(const std::string& path, observation_span<T> observations, std::vector<cluster<T>>& clusters, partitioning_profile& profile)
+    {
+        std::ifstream in(path, std::ios::binary);
+
+        file_header header{};
+        uint64_t clusters_amount = 0;
+
+        in.read(reinterpret_cast<char*>(&header), sizeof(header));
+        in.read(reinterpret_cast<char*>(&clusters_amount), sizeof(clusters_amount));
+
+        if (!in || !valid_file_header<T>(header, PARTITION_MAGIC) || header.observations_amount != observations.size()
+            || clusters_amount == 0 || clusters_amount > MAX_PARTITION_CLUSTERS)
+            return false;
+
+        // A truncated file would otherwise only fail after its means and labels were allocated.
+        size_t payload_size = sizeof(header) + sizeof(clusters_amount) + clusters_amount * sizeof(v2d<T>) + observations.size() * sizeof(label_t);
+        size_t required_size = (payload_size + 7) / 8 * 8 + PROFILE_FIELDS_AMOUNT * sizeof(uint64_t);
+
+        auto data_start = in.tellg();
+        in.seekg(0, std::ios::end);
+
+        if (!in || static_cast<size_t>(in.tellg()) < required_size)
+            return false;
+
+        in.seekg(data_start);
+
+        std::vector<v2d<T>> means(static_cast<size_t>(clusters_amount));
+        auto assignment = std::make_shared<labeling<T>>();
+
+        assignment->observations = observations.data();
+        assignment->labels.resize(observations.size());
+
+        in.read(reinterpret_cast<char*>(means.data()), static_cast<std::streamsize>(means.size() * sizeof(v2d<T>)));
+        in.read(reinterpret_cast<char*>(assignment->labels.data()), static_cast<std::streamsize>(assignment->labels.size() * sizeof(label_t)));
+        in.seekg((8 - in.tellg() % 8) % 8, std::ios::cur);
+
+        uint64_t fields[PROFILE_FIELDS_AMOUNT] = {};
+        in.read(reinterpret_cast<char*>(fields), sizeof(fields));
+
+        if (!in)
+            return false;
+
+        for (label_t label : assignment->labels)
+        {
+            if (label >= clusters_amount)
+                return false;
+        }
+
+        assignment->group(means.size());
+
+        clusters.assign(means.size(), {});
+
+        for (size_t i = 0; i < means.size(); i++)
+        {
+            clusters[i].mean = means[i];
+            clusters[i].color = cluster_color(i);
+        }
+
+        bind_clusters(clusters, std::shared_ptr<const labeling<T>>(assignment));
+
+        profile.reset();
+        profile.iterations = fields[0];
+        profile.elapsed_time = microseconds(fields[1]);
+        profile.distance_evaluations = fields[2];
+        profile.skipped_distance_evaluations = fields[3];
+        profile.reassigned_observations = fields[4];
+        profile.heap_allocations = fields[5];
+
+        for (size_t i = 0; i < PARTITIONING_PHASES_AMOUNT; i++)
+            profile.phase_times[i] = microseconds(fields[PROFILE_PHASES_FIELD + i]);
+
+        profile.repaired_clusters = fields[PROFILE_EXTRA_FIELD];
+
+        if (fields[PROFILE_EXTRA_FIELD + 1] <= static_cast<uint64_t>(stop_reason::cancelled))
+            profile.stopped_by = static_cast<stop_reason>(fields[PROFILE_EXTRA_FIELD + 1]);
+
+        profile.communication_time = microseconds(fields[PROFILE_EXTRA_FIELD + 2]);
+        profile.coreset_time = microseconds(fields[PROFILE_EXTRA_FIELD + 3]);
+
+        std::memcpy(&profile.inertia_gap, &fields[PROFILE_EXTRA_FIELD + 4], sizeof(double));
+
+        return true;
+    }
+}
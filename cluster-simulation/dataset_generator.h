@@ -0,0 +1,248 @@
+#pragma once
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include "cluster.h"
+#include "thread_pool.h"
+
+namespace ntf::cluster
+{
+    // SplitMix64 finalizer; gives every (seed, stream) pair an independent engine seed.
+    inline uint64_t mix_seed(uint64_t seed, uint64_t stream)
+    {
+        uint64_t value = seed + 0x9E3779B97F4A7C15ull * (stream + 1);
+
+        value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ull;
+        value = (value ^ (value >> 27)) * 0x94D049BB133111EBull;
+
+        return value ^ (value >> 31);
+    }
+
+    // How observations are placed. generate() calls prepare once, generate_block concurrently for
+    // disjoint ranges, each with an engine of its own, and finish once all blocks are done.
+    template <typename T = int32_t>
+    struct observation_distribution
+    {
+        std::string name;
+
+        virtual ~observation_distribution() = default;
+
+        // observations is already resized to end; [0, begin) holds earlier observations.
+        virtual void prepare(uint64_t, size_t, size_t, std::vector<v2d<T>>&) {}
+
+        virtual void generate_block(std::mt19937_64& random_engine, size_t begin, size_t end, std::vector<v2d<T>>& observations) = 0;
+
+        virtual void finish(size_t, size_t, std::vector<v2d<T>>&) {}
+    };
+
+    // The simulator's model: uniform roots, then every observation is a uniform offset from a
+    // uniformly chosen earlier one. Parents and offsets are drawn in parallel; positions are then
+    // resolved in index order, which only needs an addition per observation.
+    template <typename T = int32_t>
+    struct root_offset_distribution : public observation_distribution<T>
+    {
+        v2d<T> plane_start;
+        v2d<T> plane_end;
+        size_t roots_amount;
+        v2d<T> offset;
+
+        size_t first_offset = 0;
+        std::vector<size_t> parents;
+
+        root_offset_distribution(const v2d<T>& plane_start, const v2d<T>& plane_end, size_t roots_amount, const v2d<T>& offset)
+            : plane_start(plane_start), plane_end(plane_end), roots_amount(std::max<size_t>(roots_amount, 1)), offset(offset)
+        {
+            this->name = "Root offset";
+        }
+
+        void prepare(uint64_t seed, size_t begin, size_t end, std::vector<v2d<T>>& observations) override
+        {
+            this->first_offset = std::min(std::max(begin, this->roots_amount), end);
+
+            std::mt19937_64 random_engine(mix_seed(seed, UINT64_MAX));
+            std::uniform_real_distribution<double> x_distribution(static_cast<double>(this->plane_start.x), static_cast<double>(this->plane_end.x));
+            std::uniform_real_distribution<double> y_distribution(static_cast<double>(this->plane_start.y), static_cast<double>(this->plane_end.y));
+
+            for (size_t i = begin; i < this->first_offset; i++)
+                observations[i] = { to_coordinate<T>(x_distribution(random_engine)), to_coordinate<T>(y_distribution(random_engine)) };
+
+            this->parents.resize(end - this->first_offset);
+        }
+
+        void generate_block(std::mt19937_64& random_engine, size_t begin, size_t end, std::vector<v2d<T>>& observations) override
+        {
+            using parent_distribution = std::uniform_int_distribution<size_t>;
+
+            parent_distribution parents_distribution;
+            std::uniform_real_distribution<double> x_distribution(-static_cast<double>(this->offset.x), static_cast<double>(this->offset.x));
+            std::uniform_real_distribution<double> y_distribution(-static_cast<double>(this->offset.y), static_cast<double>(this->offset.y));
+
+            for (size_t i = std::max(begin, this->first_offset); i < end; i++)
+            {
+                this->parents[i - this->first_offset] = parents_distribution(random_engine, parent_distribution::param_type(0, i - 1));
+                observations[i] = { to_coordinate<T>(x_distribution(random_engine)), to_coordinate<T>(y_distribution(random_engine)) };
+            }
+        }
+
+        void finish(size_t, size_t end, std::vector<v2d<T>>& observations) override
+        {
+            for (size_t i = this->first_offset; i < end; i++)
+                observations[i] += observations[this->parents[i - this->first_offset]];
+
+            this->parents.clear();
+            this->parents.shrink_to_fit();
+        }
+    };
+
+    // Gaussian blobs with uniformly placed centers, uniform weights and per-blob deviations.
+    template <typename T = int32_t>
+    struct gaussian_blobs_distribution : public observation_distribution<T>
+    {
+        v2d<T> plane_start;
+        v2d<T> plane_end;
+        size_t blobs_amount;
+        double min_deviation;
+        double max_deviation;
+
+        std::vector<v2d<double>> centers;
+        std::vector<double> deviations;
+
+        gaussian_blobs_distribution(const v2d<T>& plane_start, const v2d<T>& plane_end, size_t blobs_amount, double min_deviation, double max_deviation)
+            : plane_start(plane_start), plane_end(plane_end), blobs_amount(std::max<size_t>(blobs_amount, 1)), min_deviation(min_deviation), max_deviation(max_deviation)
+        {
+            this->name = "Gaussian blobs";
+        }
+
+        // Blobs depend on the seed only, so appended observations join the same blobs.
+        void prepare(uint64_t seed, size_t, size_t, std::vector<v2d<T>>&) override
+        {
+            std::mt19937_64 random_engine(mix_seed(seed, UINT64_MAX));
+            std::uniform_real_distribution<double> x_distribution(static_cast<double>(this->plane_start.x), static_cast<double>(this->plane_end.x));
+            std::uniform_real_distribution<double> y_distribution(static_cast<double>(this->plane_start.y), static_cast<double>(this->plane_end.y));
+            std::uniform_real_distribution<double> deviation_distribution(this->min_deviation, this->max_deviation);
+
+            this->centers.resize(this->blobs_amount);
+            this->deviations.resize(this->blobs_amount);
+
+            for (size_t i = 0; i < this->blobs_amount; i++)
+            {
+                this->centers[i] = { x_distribution(random_engine), y_distribution(random_engine) };
+                this->deviations[i] = deviation_distribution(random_engine);
+            }
+        }
+
+        void generate_block(std::mt19937_64& random_engine, size_t begin, size_t end, std::vector<v2d<T>>& observations) override
+        {
+            std::uniform_int_distribution<size_t> blob_distribution(0, this->blobs_amount - 1);
+            std::normal_distribution<double> normal_distribution;
+
+            for (size_t i = begin; i < end; i++)
+            {
+                size_t blob = blob_distribution(random_engine);
+
+                double x = this->centers[blob].x + normal_distribution(random_engine) * this->deviations[blob];
+                double y = this->centers[blob].y + normal_distribution(random_engine) * this->deviations[blob];
+
+                observations[i] = { to_coordinate<T>(x), to_coordinate<T>(y) };
+            }
+        }
+    };
+
+    // Density falling off from plane_start as a power law: coordinates are start + size * u^exponent
+    // for uniform u, so exponents above 1 crowd observations into the start corner.
+    template <typename T = int32_t>
+    struct skewed_distribution : public observation_distribution<T>
+    {
+        v2d<T> plane_start;
+        v2d<T> plane_end;
+        double exponent;
+
+        skewed_distribution(const v2d<T>& plane_start, const v2d<T>& plane_end, double exponent)
+            : plane_start(plane_start), plane_end(plane_end), exponent(exponent)
+        {
+            this->name = "Skewed";
+        }
+
+        void generate_block(std::mt19937_64& random_engine, size_t begin, size_t end, std::vector<v2d<T>>& observations) override
+        {
+            std::uniform_real_distribution<double> distribution(0.0, 1.0);
+
+            double width = static_cast<double>(this->plane_end.x) - static_cast<double>(this->plane_start.x);
+            double height = static_cast<double>(this->plane_end.y) - static_cast<double>(this->plane_start.y);
+
+            for (size_t i = begin; i < end; i++)
+            {
+                double x = static_cast<double>(this->plane_start.x) + width * std::pow(distribution(random_engine), this->exponent);
+                double y = static_cast<double>(this->plane_start.y) + height * std::pow(distribution(random_engine), this->exponent);
+
+                observations[i] = { to_coordinate<T>(x), to_coordinate<T>(y) };
+            }
+        }
+    };
+
+    // Appends observations drawn from a distribution. Observations are generated in fixed blocks,
+    // each with an engine seeded from (seed, first index of the block), so the output depends on
+    // the seed and the existing observations only, never on the number of threads.
+    template <typename T = int32_t>
+    class dataset_generator
+    {
+    public:
+        static constexpr size_t BLOCK_SIZE = 65536;
+
+        std::shared_ptr<observation_distribution<T>> distribution;
+        uint64_t seed = 0;
+
+    private:
+        std::unique_ptr<thread_pool> pool;
+
+    public:
+        dataset_generator(std::shared_ptr<observation_distribution<T>> distribution, uint64_t seed = 0, size_t threads = 1)
+            : distribution(std::move(distribution)), seed(seed)
+        {
+            this->set_threads(threads);
+        }
+
+        void set_threads(size_t threads)
+        {
+            this->pool = threads > 1 ? std::make_unique<thread_pool>(threads) : nullptr;
+        }
+
+        void generate(std::vector<v2d<T>>& observations, size_t amount)
+        {
+            size_t begin = observations.size();
+            size_t end = begin + amount;
+
+            observations.resize(end);
+            this->distribution->prepare(this->seed, begin, end, observations);
+
+            size_t blocks_amount = (amount + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+            auto task = [&](size_t block) {
+                size_t block_begin = begin + block * BLOCK_SIZE;
+                std::mt19937_64 random_engine(mix_seed(this->seed, block_begin));
+
+                this->distribution->generate_block(random_engine, block_begin, std::min(end, block_begin + BLOCK_SIZE), observations);
+            };
+
+            if (this->pool)
+                this->pool->run(blocks_amount, task);
+
+            else for (size_t block = 0; block < blocks_amount; block++)
+                task(block);
+
+            this->distribution->finish(begin, end, observations);
+        }
+
+        std::vector<v2d<T>> generate(size_t amount)
+        {
+            std::vector<v2d<T>> observations;
+            this->generate(observations, amount);
+
+            return observations;
+        }
+    };
+}
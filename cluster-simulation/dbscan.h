@@ -0,0 +1,683 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <vector>
+#include "cluster.h"
+#include "thread_pool.h"
+
+namespace ntf::cluster
+{
+    // Uniform grid of cells epsilon wide over observations of D coordinates. Only cells holding
+    // observations exist, found through an open-addressing table keyed by their integer
+    // coordinates, and every cell lists the cells at most one step away in each dimension, which
+    // hold every observation closer than epsilon to one of its own. The observations are copied
+    // in cell order, so scanning a neighbourhood reads contiguous memory.
+    template <typename T = int32_t, size_t D = 2>
+    class epsilon_grid
+    {
+    public:
+        using cell_key = std::array<int64_t, D>;
+
+        // Above this many offsets to probe around a cell (3^D), neighbouring cells are found by a
+        // sweep over the cells sorted by their first coordinate instead.
+        static constexpr size_t MAX_PROBED_OFFSETS = 729;
+
+    private:
+        static constexpr size_t EMPTY_SLOT = std::numeric_limits<size_t>::max();
+
+        std::vector<cell_key> keys;
+
+        // Cell of every slot, or EMPTY_SLOT; at most half of them are used.
+        std::vector<size_t> slots;
+
+        static size_t hash(const cell_key& key)
+        {
+            uint64_t result = 0;
+
+            for (int64_t coordinate : key)
+            {
+                result = (result ^ static_cast<uint64_t>(coordinate)) * 0x9E3779B97F4A7C15ull;
+                result ^= result >> 29;
+            }
+
+            return static_cast<size_t>(result ^ (result >> 32));
+        }
+
+        size_t find_slot(const cell_key& key) const
+        {
+            size_t mask = this->slots.size() - 1;
+
+            for (size_t slot = epsilon_grid::hash(key) & mask; ; slot = (slot + 1) & mask)
+            {
+                if (this->slots[slot] == EMPTY_SLOT || this->keys[this->slots[slot]] == key)
+                    return slot;
+            }
+        }
+
+        size_t find(const cell_key& key) const
+        {
+            return this->slots[this->find_slot(key)];
+        }
+
+        static size_t probed_offsets()
+        {
+            size_t result = 1;
+
+            for (size_t d = 0; d < D && result <= MAX_PROBED_OFFSETS; d++)
+                result *= 3;
+
+            return result;
+        }
+
+        static cell_key key_of(const point<T, D>& observation, double epsilon)
+        {
+            // Clamped so extreme coordinates or a tiny epsilon cannot overflow, or reach a
+            // neighbour's key by adding one.
+            constexpr double LIMIT = static_cast<double>(std::numeric_limits<int64_t>::max() / 2);
+
+            cell_key key{};
+
+            for_each_dimension<D>([&](size_t d) {
+                key[d] = static_cast<int64_t>(std::clamp(std::floor(static_cast<double>(coordinate(observation, d)) / epsilon), -LIMIT, LIMIT));
+            });
+
+            return key;
+        }
+
+        void probe_neighbours()
+        {
+            std::vector<cell_key> offsets(1, cell_key{});
+
+            for (size_t d = 0; d < D; d++)
+            {
+                size_t previous = offsets.size();
+
+                for (int64_t step : { -1, 1 })
+                {
+                    for (size_t i = 0; i < previous; i++)
+                    {
+                        offsets.push_back(offsets[i]);
+                        offsets.back()[d] = step;
+                    }
+                }
+            }
+
+            this->neighbour_offsets.assign(1, 0);
+
+            for (auto& key : this->keys)
+            {
+                for (auto& offset : offsets)
+                {
+                    cell_key neighbour = key;
+
+                    for (size_t d = 0; d < D; d++)
+                        neighbour[d] += offset[d];
+
+                    size_t found = this->find(neighbour);
+
+                    if (found != EMPTY_SLOT)
+                        this->neighbours.push_back(found);
+                }
+
+                this->neighbour_offsets.push_back(this->neighbours.size());
+            }
+        }
+
+        void sweep_neighbours()
+        {
+            std::vector<size_t> order(this->keys.size());
+            std::iota(order.begin(), order.end(), 0);
+
+            std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return this->keys[a][0] < this->keys[b][0]; });
+
+            std::vector<std::pair<size_t, size_t>> pairs;
+
+            for (size_t i = 0; i < order.size(); i++)
+            {
+                pairs.push_back({ order[i], order[i] });
+
+                for (size_t j = i + 1; j < order.size() && this->keys[order[j]][0] <= this->keys[order[i]][0] + 1; j++)
+                {
+                    bool adjacent = true;
+
+                    for (size_t d = 1; d < D && adjacent; d++)
+                        adjacent = std::abs(this->keys[order[i]][d] - this->keys[order[j]][d]) <= 1;
+
+                    if (adjacent)
+                    {
+                        pairs.push_back({ order[i], order[j] });
+                        pairs.push_back({ order[j], order[i] });
+                    }
+                }
+            }
+
+            std::sort(pairs.begin(), pairs.end());
+
+            this->neighbour_offsets.assign(this->keys.size() + 1, 0);
+
+            for (auto& pair : pairs)
+            {
+                this->neighbour_offsets[pair.first + 1]++;
+                this->neighbours.push_back(pair.second);
+            }
+
+            for (size_t c = 0; c < this->keys.size(); c++)
+                this->neighbour_offsets[c + 1] += this->neighbour_offsets[c];
+        }
+
+    public:
+        // Observations in cell order, their indices in the span, and the cell of each position.
+        std::vector<point<T, D>> points;
+        std::vector<size_t> indices;
+        std::vector<size_t> point_cells;
+
+        // Positions of each cell's points, which keep their order in the span.
+        std::vector<size_t> cell_offsets;
+
+        // Cells around each cell, itself included.
+        std::vector<size_t> neighbour_offsets;
+        std::vector<size_t> neighbours;
+
+        size_t size() const
+        {
+            return this->keys.size();
+        }
+
+        void build(observation_span<T, D> observations, double epsilon)
+        {
+            size_t capacity = 2;
+
+            while (capacity < observations.size() * 2)
+                capacity *= 2;
+
+            this->keys.clear();
+            this->slots.assign(capacity, EMPTY_SLOT);
+            this->neighbours.clear();
+
+            std::vector<size_t> observation_cells(observations.size());
+
+            for (size_t i = 0; i < observations.size(); i++)
+            {
+                cell_key key = epsilon_grid::key_of(observations[i], epsilon);
+                size_t slot = this->find_slot(key);
+
+                if (this->slots[slot] == EMPTY_SLOT)
+                {
+                    this->slots[slot] = this->keys.size();
+                    this->keys.push_back(key);
+                }
+
+                observation_cells[i] = this->slots[slot];
+            }
+
+            this->cell_offsets.assign(this->keys.size() + 1, 0);
+
+            for (size_t cell : observation_cells)
+                this->cell_offsets[cell + 1]++;
+
+            for (size_t c = 0; c < this->keys.size(); c++)
+                this->cell_offsets[c + 1] += this->cell_offsets[c];
+
+            std::vector<size_t> positions(this->cell_offsets.begin(), this->cell_offsets.end() - 1);
+
+            this->points.resize(observations.size());
+            this->indices.resize(observations.size());
+            this->point_cells.resize(observations.size());
+
+            for (size_t i = 0; i < observations.size(); i++)
+            {
+                size_t position = positions[observation_cells[i]]++;
+
+                this->points[position] = observations[i];
+                this->indices[position] = i;
+                this->point_cells[position] = observation_cells[i];
+            }
+
+            if (epsilon_grid::probed_offsets() <= MAX_PROBED_OFFSETS)
+                this->probe_neighbours();
+            else
+                this->sweep_neighbours();
+        }
+
+        // Calls function(q) for every position q in the cells around cell, until it returns false.
+        template <typename F>
+        bool for_each_candidate(size_t cell, F&& function) const
+        {
+            for (size_t n = this->neighbour_offsets[cell]; n < this->neighbour_offsets[cell + 1]; n++)
+            {
+                size_t neighbour = this->neighbours[n];
+
+                for (size_t q = this->cell_offsets[neighbour]; q < this->cell_offsets[neighbour + 1]; q++)
+                {
+                    if (!function(q))
+                        return false;
+                }
+            }
+
+            return true;
+        }
+    };
+
+    // DBSCAN over an epsilon grid, with param as the least observations, the observation itself
+    // included, within epsilon of a core observation. Clusters are the connected core observations
+    // plus the border observations within epsilon of them; the rest is noise, bound to no cluster.
+    // Single-threaded, clusters grow from a flat work queue; with threads, core observations are
+    // merged with a lock-free union-find. Both number clusters in grid order and give border
+    // observations to their nearest core neighbour, so the result does not depend on threads.
+    template <typename T = int32_t, size_t D = 2>
+    struct dbscan : public partitioner<T, D>
+    {
+        // Sampled observations whose distance to their param-th nearest neighbour among up to
+        // EPSILON_REFERENCES random observations estimates epsilon.
+        static constexpr size_t EPSILON_SAMPLES = 128;
+        static constexpr size_t EPSILON_REFERENCES = 32768;
+        static constexpr double EPSILON_QUANTILE = 0.9;
+
+        // Grid cells handed to one thread pool task.
+        static constexpr size_t CELLS_PER_TASK = 256;
+
+        // Neighbourhood radius. Zero estimates it on every partition as the EPSILON_QUANTILE of
+        // sampled distances to the param-th nearest neighbour, which takes a constant number of
+        // distance evaluations however many observations there are.
+        double epsilon = 0;
+
+        // Outcome of the last partition.
+        double used_epsilon = 0;
+        size_t core_observations = 0;
+        observation_range<T, D> noise;
+
+        dbscan(size_t threads = 1, double epsilon = 0) : epsilon(epsilon)
+        {
+            this->name = "DBSCAN";
+            this->param_name = "Min points";
+
+            if (threads > 1)
+                this->pool = std::make_unique<thread_pool>(threads);
+        }
+
+        std::vector<cluster<T, D>> partition(observation_span<T, D> observations, partitioning_profile& profile = {}) override
+        {
+            profile.reset();
+            timer t(profile.elapsed_time);
+            allocation_counter a(profile.heap_allocations);
+
+            this->noise = {};
+            this->core_observations = 0;
+
+            if (observations.empty())
+                return {};
+
+            {
+                phase_timer t(profile, partitioning_phase::seeding);
+
+                this->used_epsilon = this->epsilon > 0 ? this->epsilon : this->estimate_epsilon(observations, profile);
+                this->grid.build(observations, this->used_epsilon);
+            }
+
+            if (this->cancelled)
+            {
+                profile.stopped_by = stop_reason::cancelled;
+                return {};
+            }
+
+            size_t clusters_amount = 0;
+
+            {
+                phase_timer t(profile, partitioning_phase::assignment);
+
+                this->find_cores(profile);
+
+                clusters_amount = this->pool ? this->merge_cores(profile) : this->expand_cores(profile);
+
+                this->label_borders(profile);
+            }
+
+            std::vector<cluster<T, D>> clusters(clusters_amount);
+            auto assignment = std::make_shared<labeling<T, D>>(observations);
+
+            {
+                phase_timer t(profile, partitioning_phase::update);
+
+                std::vector<point<accumulator_t<T>, D>> sums(clusters_amount);
+                std::vector<size_t> counts(clusters_amount, 0);
+
+                for (size_t p = 0; p < this->grid.points.size(); p++)
+                {
+                    label_t label = this->labels[p];
+
+                    if (label == UNLABELED)
+                    {
+                        assignment->labels[this->grid.indices[p]] = static_cast<label_t>(clusters_amount);
+                        continue;
+                    }
+
+                    assignment->labels[this->grid.indices[p]] = label;
+
+                    accumulate<D>(sums[label], this->grid.points[p]);
+                    counts[label]++;
+                }
+
+                for (size_t j = 0; j < clusters_amount; j++)
+                {
+                    for_each_dimension<D>([&](size_t d) {
+                        coordinate(clusters[j].mean, d) = to_coordinate<T>(static_cast<double>(coordinate(sums[j], d)) / counts[j]);
+                    });
+
+                    clusters[j].color = cluster_color(j);
+                }
+
+                assignment->group(clusters_amount + 1);
+            }
+
+            std::shared_ptr<const labeling<T, D>> source(assignment);
+
+            bind_clusters(clusters, source);
+            this->noise = { source, static_cast<label_t>(clusters_amount) };
+
+            profile.iterations = 1;
+            profile.stopped_by = stop_reason::converged;
+
+            return clusters;
+        }
+
+    private:
+        static constexpr label_t UNLABELED = std::numeric_limits<label_t>::max();
+
+        std::unique_ptr<thread_pool> pool;
+        epsilon_grid<T, D> grid;
+
+        // Per grid position.
+        std::vector<char> core;
+        std::vector<label_t> labels;
+        std::unique_ptr<std::atomic<size_t>[]> parents;
+
+        std::vector<size_t> task_evaluations;
+
+        double squared_epsilon() const
+        {
+            return this->used_epsilon * this->used_epsilon;
+        }
+
+        // Runs function(cell, evaluations) over every cell, spread over the pool, and adds the
+        // distance evaluations each task counted to the profile.
+        template <typename F>
+        void for_each_cell(partitioning_profile& profile, F&& function)
+        {
+            size_t tasks_amount = (this->grid.size() + CELLS_PER_TASK - 1) / CELLS_PER_TASK;
+
+            this->task_evaluations.assign(tasks_amount, 0);
+
+            auto task = [&](size_t index) {
+                size_t end = std::min(this->grid.size(), (index + 1) * CELLS_PER_TASK);
+
+                for (size_t cell = index * CELLS_PER_TASK; cell < end; cell++)
+                    function(cell, this->task_evaluations[index]);
+            };
+
+            if (this->pool)
+                this->pool->run(tasks_amount, task);
+
+            else for (size_t index = 0; index < tasks_amount; index++)
+                task(index);
+
+            for (size_t evaluations : this->task_evaluations)
+                profile.distance_evaluations += evaluations;
+        }
+
+        // Over a random subset a fraction f of the observations, neighbours are 1/f times
+        // sparser, so its distances are scaled by f^(1/D) as if the density were uniform locally.
+        double estimate_epsilon(observation_span<T, D> observations, partitioning_profile& profile)
+        {
+            size_t samples_amount = std::min(EPSILON_SAMPLES, observations.size());
+            size_t references_amount = std::min(EPSILON_REFERENCES, observations.size());
+            size_t rank = std::min<size_t>(this->param, references_amount) - 1;
+
+            std::uniform_int_distribution<size_t> indices_distribution(0, observations.size() - 1);
+            std::vector<size_t> samples(samples_amount);
+            std::vector<point<T, D>> references(references_amount);
+            std::vector<double> neighbour_distances(samples_amount);
+
+            for (auto& sample : samples)
+                sample = indices_distribution(this->random_engine);
+
+            if (references_amount == observations.size())
+                references.assign(observations.begin(), observations.end());
+
+            else for (auto& reference : references)
+                reference = observations[indices_distribution(this->random_engine)];
+
+            auto measure = [&](size_t s) {
+                std::vector<double> distances(references_amount);
+
+                for (size_t i = 0; i < references_amount; i++)
+                    distances[i] = squared_distance<D>(observations[samples[s]], references[i]);
+
+                std::nth_element(distances.begin(), distances.begin() + rank, distances.end());
+                neighbour_distances[s] = distances[rank];
+            };
+
+            if (this->pool)
+                this->pool->run(samples_amount, measure);
+
+            else for (size_t s = 0; s < samples_amount; s++)
+                measure(s);
+
+            profile.distance_evaluations += samples_amount * references_amount;
+
+            size_t quantile = std::min(static_cast<size_t>(EPSILON_QUANTILE * samples_amount), samples_amount - 1);
+            std::nth_element(neighbour_distances.begin(), neighbour_distances.begin() + quantile, neighbour_distances.end());
+
+            double fraction = static_cast<double>(references_amount) / observations.size();
+            double estimate = std::sqrt(neighbour_distances[quantile]) * std::pow(fraction, 1.0 / D);
+
+            // Mostly duplicate observations; any positive radius then groups them.
+            return estimate > 0 ? estimate : 1.0;
+        }
+
+        void find_cores(partitioning_profile& profile)
+        {
+            auto& points = this->grid.points;
+            size_t min_points = this->param;
+            double squared_epsilon = this->squared_epsilon();
+
+            this->core.assign(points.size(), false);
+
+            this->for_each_cell(profile, [&](size_t cell, size_t& evaluations) {
+                for (size_t p = this->grid.cell_offsets[cell]; p < this->grid.cell_offsets[cell + 1]; p++)
+                {
+                    size_t neighbours = 0;
+
+                    this->grid.for_each_candidate(cell, [&](size_t q) {
+                        evaluations++;
+                        neighbours += squared_distance<D>(points[p], points[q]) <= squared_epsilon;
+
+                        return neighbours < min_points;
+                    });
+
+                    this->core[p] = neighbours >= min_points;
+                }
+            });
+
+            this->core_observations = std::count(this->core.begin(), this->core.end(), 1);
+        }
+
+        // Single-threaded: each unlabeled core position, in order, starts a cluster that grows over
+        // the core positions within epsilon through a flat work queue.
+        size_t expand_cores(partitioning_profile& profile)
+        {
+            auto& points = this->grid.points;
+            double squared_epsilon = this->squared_epsilon();
+
+            std::vector<size_t> queue;
+
+            this->labels.assign(points.size(), UNLABELED);
+
+            label_t clusters_amount = 0;
+
+            for (size_t start = 0; start < points.size(); start++)
+            {
+                if (!this->core[start] || this->labels[start] != UNLABELED)
+                    continue;
+
+                this->labels[start] = clusters_amount;
+                queue.assign(1, start);
+
+                while (!queue.empty())
+                {
+                    size_t p = queue.back();
+                    queue.pop_back();
+
+                    this->grid.for_each_candidate(this->grid.point_cells[p], [&](size_t q) {
+                        if (!this->core[q] || this->labels[q] != UNLABELED)
+                            return true;
+
+                        profile.distance_evaluations++;
+
+                        if (squared_distance<D>(points[p], points[q]) <= squared_epsilon)
+                        {
+                            this->labels[q] = clusters_amount;
+                            queue.push_back(q);
+                        }
+
+                        return true;
+                    });
+                }
+
+                clusters_amount++;
+            }
+
+            return clusters_amount;
+        }
+
+        // Roots only ever link to lower positions, so every root is the lowest position of its set.
+        size_t find(size_t p)
+        {
+            while (true)
+            {
+                size_t parent = this->parents[p].load(std::memory_order_relaxed);
+
+                if (parent == p)
+                    return p;
+
+                size_t grandparent = this->parents[parent].load(std::memory_order_relaxed);
+
+                this->parents[p].compare_exchange_weak(parent, grandparent, std::memory_order_relaxed);
+                p = grandparent;
+            }
+        }
+
+        void unite(size_t a, size_t b)
+        {
+            while (true)
+            {
+                a = this->find(a);
+                b = this->find(b);
+
+                if (a == b)
+                    return;
+
+                if (a < b)
+                    std::swap(a, b);
+
+                size_t expected = a;
+
+                if (this->parents[a].compare_exchange_strong(expected, b, std::memory_order_relaxed))
+                    return;
+            }
+        }
+
+        // Threaded: core positions within epsilon of each other are united cell by cell, then sets
+        // are numbered in the order of their lowest position, as expand_cores numbers clusters.
+        size_t merge_cores(partitioning_profile& profile)
+        {
+            auto& points = this->grid.points;
+            double squared_epsilon = this->squared_epsilon();
+
+            this->parents = std::make_unique<std::atomic<size_t>[]>(points.size());
+
+            for (size_t p = 0; p < points.size(); p++)
+                this->parents[p].store(p, std::memory_order_relaxed);
+
+            this->for_each_cell(profile, [&](size_t cell, size_t& evaluations) {
+                for (size_t p = this->grid.cell_offsets[cell]; p < this->grid.cell_offsets[cell + 1]; p++)
+                {
+                    if (!this->core[p])
+                        continue;
+
+                    // Each pair once, from its higher position, unless already in one set.
+                    this->grid.for_each_candidate(cell, [&](size_t q) {
+                        if (q >= p || !this->core[q] || this->find(p) == this->find(q))
+                            return true;
+
+                        evaluations++;
+
+                        if (squared_distance<D>(points[p], points[q]) <= squared_epsilon)
+                            this->unite(p, q);
+
+                        return true;
+                    });
+                }
+            });
+
+            this->labels.assign(points.size(), UNLABELED);
+
+            label_t clusters_amount = 0;
+
+            for (size_t p = 0; p < points.size(); p++)
+            {
+                if (!this->core[p])
+                    continue;
+
+                size_t root = this->find(p);
+
+                this->labels[p] = root == p ? clusters_amount++ : this->labels[root];
+            }
+
+            this->parents.reset();
+
+            return clusters_amount;
+        }
+
+        // Positions that are not core join the cluster of their nearest core neighbour within
+        // epsilon, or stay unlabeled as noise.
+        void label_borders(partitioning_profile& profile)
+        {
+            auto& points = this->grid.points;
+            double squared_epsilon = this->squared_epsilon();
+
+            this->for_each_cell(profile, [&](size_t cell, size_t& evaluations) {
+                for (size_t p = this->grid.cell_offsets[cell]; p < this->grid.cell_offsets[cell + 1]; p++)
+                {
+                    if (this->core[p])
+                        continue;
+
+                    double nearest_distance = squared_epsilon;
+                    label_t nearest = UNLABELED;
+
+                    this->grid.for_each_candidate(cell, [&](size_t q) {
+                        if (!this->core[q])
+                            return true;
+
+                        evaluations++;
+
+                        double distance = squared_distance<D>(points[p], points[q]);
+
+                        if (distance < nearest_distance || (distance == nearest_distance && nearest == UNLABELED))
+                        {
+                            nearest_distance = distance;
+                            nearest = this->labels[q];
+                        }
+
+                        return true;
+                    });
+
+                    this->labels[p] = nearest;
+                }
+            });
+        }
+    };
+}
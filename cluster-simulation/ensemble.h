@@ -0,0 +1,175 @@
+#pragma once
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "cluster.h"
+#include "thread_pool.h"
+
+namespace ntf::cluster
+{
+    // Best of several independently seeded partitions, run concurrently. Restarts are made by a
+    // factory and seeded from the ensemble's random engine. Restarts whose inertia is still clearly
+    // above the lowest one after a few iterations are cancelled; of the rest, the partition with the
+    // lowest dissimilarity is returned. A seeded ensemble is reproducible on one thread or with
+    // pruning disabled; otherwise which restarts get pruned depends on how far the others got.
+    template <typename T = int32_t, size_t D = 2>
+    struct ensemble_partitioner : public partitioner<T, D>
+    {
+        using restart_factory = std::function<std::shared_ptr<partitioner<T, D>>()>;
+
+        // A restart is pruned once it ran warmup_iterations and its inertia exceeds the lowest
+        // inertia reached by any restart by more than prune_margin of it. Zero disables pruning,
+        // which makes the result independent of thread timing.
+        size_t warmup_iterations = 5;
+        double prune_margin = 0.25;
+
+        // Outcome of the last partition.
+        size_t best_restart = 0;
+        size_t pruned_restarts = 0;
+
+    private:
+        restart_factory make_restart;
+        std::vector<std::shared_ptr<partitioner<T, D>>> restarts;
+        std::unique_ptr<thread_pool> pool;
+
+        // Guards the progress of the running restarts and reports to on_iteration, which is only
+        // called for the restart leading at the time.
+        std::mutex progress_mutex;
+        std::vector<double> latest_inertias;
+        std::vector<char> pruned;
+
+        void prepare_restarts(std::vector<partitioning_profile>& profiles)
+        {
+            this->latest_inertias.assign(this->restarts.size(), std::numeric_limits<double>::infinity());
+            this->pruned.assign(this->restarts.size(), false);
+
+            for (size_t r = 0; r < this->restarts.size(); r++)
+            {
+                auto& restart = *this->restarts[r];
+
+                restart.param = this->param;
+                restart.index = this->index;
+                restart.cancelled = false;
+                restart.seed(this->random_engine());
+
+                restart.on_iteration = [this, r, &profiles](const std::vector<cluster<T, D>>& clusters, const std::vector<label_t>& labels) {
+                    this->track_progress(r, profiles[r], clusters, labels);
+                };
+            }
+        }
+
+        // Runs on the thread of restart r after each of its iterations.
+        void track_progress(
+            size_t r,
+            const partitioning_profile& profile,
+            const std::vector<cluster<T, D>>& clusters,
+            const std::vector<label_t>& labels
+        )
+        {
+            if (this->cancelled)
+                this->restarts[r]->cancelled = true;
+
+            if (profile.iteration_history.empty())
+                return;
+
+            double inertia = profile.iteration_history.back().inertia;
+
+            std::lock_guard<std::mutex> lock(this->progress_mutex);
+
+            this->latest_inertias[r] = inertia;
+
+            double lowest = *std::min_element(this->latest_inertias.begin(), this->latest_inertias.end());
+
+            if (this->prune_margin > 0 && profile.iterations >= this->warmup_iterations && inertia > lowest * (1 + this->prune_margin))
+            {
+                this->pruned[r] = true;
+                this->restarts[r]->cancelled = true;
+            }
+
+            else if (inertia == lowest)
+                this->report_iteration(clusters, labels);
+        }
+
+        // Counters and phase times add up over every restart, so phase times are CPU time rather
+        // than wall time. Iterations, history and the stop reason are the returned restart's.
+        void aggregate_profiles(std::vector<partitioning_profile>& profiles, partitioning_profile& profile) const
+        {
+            for (auto& restart_profile : profiles)
+            {
+                for (size_t i = 0; i < PARTITIONING_PHASES_AMOUNT; i++)
+                    profile.phase_times[i] += restart_profile.phase_times[i];
+
+                profile.distance_evaluations += restart_profile.distance_evaluations;
+                profile.skipped_distance_evaluations += restart_profile.skipped_distance_evaluations;
+                profile.reassigned_observations += restart_profile.reassigned_observations;
+                profile.repaired_clusters += restart_profile.repaired_clusters;
+            }
+
+            auto& best = profiles[this->best_restart];
+
+            profile.iterations = best.iterations;
+            profile.iteration_history = std::move(best.iteration_history);
+            profile.spans = std::move(best.spans);
+            profile.stopped_by = this->cancelled ? stop_reason::cancelled : best.stopped_by;
+        }
+
+    public:
+        ensemble_partitioner(restart_factory make_restart, size_t restarts_amount = 8, size_t threads = 1)
+            : make_restart(std::move(make_restart))
+        {
+            for (size_t r = 0; r < std::max<size_t>(restarts_amount, 1); r++)
+                this->restarts.push_back(this->make_restart());
+
+            if (threads > 1)
+                this->pool = std::make_unique<thread_pool>(std::min(threads, this->restarts.size()));
+
+            this->name = "Best of " + std::to_string(this->restarts.size()) + " " + this->restarts.front()->name;
+            this->param_name = this->restarts.front()->param_name;
+        }
+
+        size_t restarts_amount() const
+        {
+            return this->restarts.size();
+        }
+
+        std::vector<cluster<T, D>> partition(observation_span<T, D> observations, partitioning_profile& profile = {}) override
+        {
+            profile.reset();
+            timer t(profile.elapsed_time);
+            allocation_counter a(profile.heap_allocations);
+
+            std::vector<partitioning_profile> profiles(this->restarts.size());
+            std::vector<std::vector<cluster<T, D>>> results(this->restarts.size());
+            std::vector<double> dissimilarities(this->restarts.size(), std::numeric_limits<double>::infinity());
+
+            this->prepare_restarts(profiles);
+
+            auto run_restart = [&](size_t r) {
+                results[r] = this->restarts[r]->partition(observations, profiles[r]);
+
+                if (!this->pruned[r])
+                    dissimilarities[r] = dissimilarity(results[r]);
+            };
+
+            if (this->pool)
+                this->pool->run(this->restarts.size(), run_restart);
+
+            else for (size_t r = 0; r < this->restarts.size(); r++)
+                run_restart(r);
+
+            this->best_restart = std::min_element(dissimilarities.begin(), dissimilarities.end()) - dissimilarities.begin();
+            this->pruned_restarts = std::count(this->pruned.begin(), this->pruned.end(), 1);
+
+            for (auto& restart : this->restarts)
+                restart->on_iteration = nullptr;
+
+            this->aggregate_profiles(profiles, profile);
+
+            return std::move(results[this->best_restart]);
+        }
+    };
+}
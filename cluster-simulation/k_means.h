@@ -1,66 +1,158 @@
 #pragma once
+#include <cfloat>
+#include <cmath>
+#include <limits>
+#include <numeric>
+#include <type_traits>
 #include "cluster.h"
-#include "window.h"
+#include "nearest_mean.h"
+#include "spatial_index.h"
+#include "thread_pool.h"
 
 namespace ntf::cluster
 {
-    template <typename T = int32_t>
-    struct k_means : public partitioner<T>
+    enum class seeding_strategy
     {
-        std::default_random_engine random_engine;
+        random,
+        k_means_plus_plus,
+        k_means_parallel,
+    };
+
+    // When iterations stop besides reaching a fixed point. Zero disables a criterion.
+    struct convergence_criteria
+    {
+        // Stops once no mean moves farther than this.
+        double mean_shift = 0;
+
+        // Stops once inertia improves by less than this fraction of the previous iteration's.
+        double relative_inertia_change = 0;
+
+        size_t max_iterations = 300;
+    };
+
+    // How a cluster left without observations by an assignment gets some back within the same
+    // iteration.
+    enum class empty_cluster_repair
+    {
+        // Moves the observation farthest from its mean into the empty cluster.
+        farthest_point,
+
+        // Halves the cluster with the highest variability across its principal axis.
+        split_largest,
+
+        // Moves the member of the most populated cluster farthest from its mean.
+        steal_largest,
+    };
+
+    template <typename T = int32_t, size_t D = 2>
+    struct k_means : public partitioner<T, D>
+    {
+        // Observations are split into fixed-size chunks whose partial sums are reduced in chunk
+        // order, so the result does not depend on how many threads processed the chunks.
+        static constexpr size_t CHUNK_SIZE = 16384;
+
+        // Power iterations spent on the principal axis of a cluster above two dimensions.
+        static constexpr size_t POWER_ITERATIONS = 64;
+
+        struct partial_sums
+        {
+            std::vector<point<accumulator_t<T>, D>> sums;
+            std::vector<size_t> counts;
+        };
+
+        std::unique_ptr<thread_pool> pool;
+        mean_table<D> means_table;
+
+        // Labels before the current assignment and per-chunk counts of the ones that changed.
+        std::vector<label_t> previous_labels;
+        std::vector<size_t> chunk_reassignments;
+
+        seeding_strategy seeding = seeding_strategy::random;
+        convergence_criteria convergence;
+        empty_cluster_repair repair = empty_cluster_repair::farthest_point;
 
-        k_means()
+        // Exact means the iterations assign to; cluster means are these rounded to T.
+        std::vector<point<double, D>> centroids;
+
+        // k-means|| samples about oversampling_factor * K candidates in each of seeding_rounds rounds.
+        size_t seeding_rounds = 5;
+        double oversampling_factor = 2.0;
+
+        k_means(size_t threads = 1)
         {
             this->name = "K means";
             this->param_name = "K";
 
-            window::seed_default_random_engine(this->random_engine);
+            this->set_threads(threads);
+        }
+
+        void set_threads(size_t threads)
+        {
+            this->pool = threads > 1 ? std::make_unique<thread_pool>(threads) : nullptr;
+        }
+
+        size_t threads() const
+        {
+            return this->pool ? this->pool->size() : 1;
+        }
+
+        template <typename F>
+        void for_each_chunk(size_t size, F&& function)
+        {
+            size_t chunks_amount = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+
+            auto task = [&](size_t chunk) {
+                function(chunk, chunk * CHUNK_SIZE, std::min(size, (chunk + 1) * CHUNK_SIZE));
+            };
+
+            if (this->pool)
+                this->pool->run(chunks_amount, task);
+
+            else for (size_t chunk = 0; chunk < chunks_amount; chunk++)
+                task(chunk);
         }
 
-        std::vector<v2d<T>> find_optimal_means(std::vector<v2d<T>>& observations)
+        std::vector<point<T, D>> find_optimal_means(observation_span<T, D> unsorted_observations)
         {
-            std::vector<v2d<T>> means(this->param);
+            std::vector<point<T, D>> means(this->param);
+            std::vector<point<T, D>> observations(unsorted_observations.begin(), unsorted_observations.end());
 
-            v2d<T> plane_start{};
-            v2d<T> plane_end{};
+            point<T, D> plane_start{};
+            point<T, D> plane_end{};
 
             for (auto& observation : observations)
             {
-                if (observation.x < plane_start.x) plane_start.x = observation.x;
-                if (observation.y < plane_start.y) plane_start.y = observation.y;
-                if (observation.x > plane_end.x)   plane_end.x   = observation.x;
-                if (observation.y > plane_end.y)   plane_end.y   = observation.y;
+                for_each_dimension<D>([&](size_t d) {
+                    coordinate(plane_start, d) = std::min(coordinate(plane_start, d), coordinate(observation, d));
+                    coordinate(plane_end, d) = std::max(coordinate(plane_end, d), coordinate(observation, d));
+                });
             }
 
-            v2d<T> plane_size{ plane_end - plane_start };
-            v2d<T> plane_centroid{ (plane_start + plane_end) / 2 };
+            point<T, D> plane_size{ plane_end - plane_start };
 
+            // Only the first coordinate is searched on, so the plane is split into sections along it.
             std::sort(
                 observations.begin(),
                 observations.end(),
-                [](const v2d<T>& a, const v2d<T>& b) { return a.x < b.x; }
+                [](const point<T, D>& a, const point<T, D>& b) { return coordinate(a, 0) < coordinate(b, 0); }
             );
 
-            int32_t plane_sections_width = plane_size.x / static_cast<int32_t>(this->param);
+            int32_t plane_sections_width = static_cast<int32_t>(coordinate(plane_size, 0)) / static_cast<int32_t>(this->param);
 
-            std::uniform_int_distribution<int32_t> x_offset_distr(0, plane_sections_width);
-            std::uniform_int_distribution<int32_t> y_offset_distr(plane_size.y / 2 * -1, plane_size.y / 2);
+            std::uniform_int_distribution<int32_t> offset_distr(0, plane_sections_width);
 
             for (size_t i = 0; i < this->param; i++)
             {
-                v2d<T> target_centroid{
-                    plane_sections_width * static_cast<int32_t>(i) + x_offset_distr(this->random_engine),
-                    plane_centroid.y + y_offset_distr(this->random_engine)
-                };
+                T target = static_cast<T>(plane_sections_width * static_cast<int32_t>(i) + offset_distr(this->random_engine));
 
                 auto mean_iter = std::lower_bound(
                     observations.begin(),
                     observations.end(),
-                    target_centroid,
-                    [](const v2d<T>& obs, const v2d<T>& target) { return obs.x < target.x; }
+                    target,
+                    [](const point<T, D>& obs, T target) { return coordinate(obs, 0) < target; }
                 );
 
-                v2d<T> mean{};
+                point<T, D> mean{};
 
                 if (mean_iter == observations.end())
                     mean = observations.back();
@@ -73,22 +165,24 @@ namespace ntf::cluster
             return means;
         }
 
-        std::vector<v2d<T>> get_random_means(std::vector<v2d<T>>& observations)
+        // Distinct observations while there are enough, duplicates for the remaining means after.
+        std::vector<point<T, D>> get_random_means(observation_span<T, D> observations)
         {
             std::uniform_int_distribution<size_t> indices_distribution(0, observations.size() - 1);
-            std::unordered_map<size_t, bool> visited_indices;
+            std::vector<char> visited(observations.size(), 0);
 
-            std::vector<v2d<T>> means(this->param);
+            std::vector<point<T, D>> means(this->param);
+            size_t distinct = std::min<size_t>(this->param, observations.size());
 
             for (size_t i = 0; i < this->param;)
             {
                 size_t random_index = indices_distribution(this->random_engine);
 
-                if (visited_indices.find(random_index) != visited_indices.end())
+                if (i < distinct && visited[random_index])
                     continue;
 
                 means[i] = observations[random_index];
-                visited_indices.insert({ random_index, true });
+                visited[random_index] = 1;
 
                 i++;
             }
@@ -96,183 +190,1938 @@ namespace ntf::cluster
             return means;
         }
 
-        std::vector<cluster<T>> init_clusters(const std::vector<v2d<T>>& means)
+        // Lowers every observation's squared distance to its closest mean so far by the new means
+        // and returns the total, summed per chunk and reduced in chunk order.
+        double update_min_distances(
+            observation_span<T, D> observations,
+            const std::vector<point<T, D>>& new_means,
+            std::vector<double>& min_distances,
+            partitioning_profile& profile
+        )
         {
-            std::vector<cluster<T>> clusters(this->param);
+            std::vector<double> chunk_totals((observations.size() + CHUNK_SIZE - 1) / CHUNK_SIZE, 0);
 
-            for (size_t i = 0; i < this->param; i++)
+            this->for_each_chunk(observations.size(), [&](size_t chunk, size_t begin, size_t end) {
+                double total = 0;
+
+                for (size_t i = begin; i < end; i++)
+                {
+                    for (auto& mean : new_means)
+                        min_distances[i] = std::min(min_distances[i], observations[i].euclidean_distance_squared(mean));
+
+                    total += min_distances[i];
+                }
+
+                chunk_totals[chunk] = total;
+            });
+
+            profile.distance_evaluations += observations.size() * new_means.size();
+
+            double total = 0;
+
+            for (double chunk_total : chunk_totals)
+                total += chunk_total;
+
+            return total;
+        }
+
+        // Picks an index with probability proportional to its weight.
+        size_t sample_weighted(const std::vector<double>& weights, double total)
+        {
+            double target = std::uniform_real_distribution<double>(0, total)(this->random_engine);
+            size_t last_positive = 0;
+
+            for (size_t i = 0; i < weights.size(); i++)
             {
-                auto& cluster = clusters[i];
+                if (weights[i] <= 0)
+                    continue;
 
-                cluster.mean = means[i];
-                cluster.color = VISUALLY_DISTINCT_COLORS[i];
+                if (target < weights[i])
+                    return i;
+
+                target -= weights[i];
+                last_positive = i;
             }
 
-            return clusters;
+            return last_positive;
         }
 
-        std::vector<cluster<T>> partition(std::vector<v2d<T>>& observations, partitioning_profile& profile = {}) override
+        // D^2 sampling: every next mean is drawn with probability proportional to the squared
+        // distance to the closest mean chosen so far.
+        std::vector<point<T, D>> get_k_means_plus_plus_means(observation_span<T, D> observations, partitioning_profile& profile)
         {
-            profile.reset();
-            timer t(profile.elapsed_time);
+            std::uniform_int_distribution<size_t> indices_distribution(0, observations.size() - 1);
 
-            std::vector<v2d<T>> random_means = std::move(this->get_random_means(observations));
-            std::vector<v2d<T>> previous_means(this->param);
+            std::vector<point<T, D>> means{ observations[indices_distribution(this->random_engine)] };
+            std::vector<double> min_distances(observations.size(), DBL_MAX);
 
-            std::vector<cluster<T>> clusters = std::move(this->init_clusters(random_means));
+            double total = this->update_min_distances(observations, means, min_distances, profile);
 
-            while (!k_means::converged(clusters, previous_means))
+            while (means.size() < this->param)
             {
-                clear_clusters(clusters);
+                // Fewer distinct observations than K, the remaining means can only be duplicates.
+                if (total <= 0)
+                {
+                    means.push_back(observations[indices_distribution(this->random_engine)]);
+                    continue;
+                }
 
-                k_means::assign_observations(clusters, observations);
+                means.push_back(observations[this->sample_weighted(min_distances, total)]);
+                total = this->update_min_distances(observations, { means.back() }, min_distances, profile);
+            }
 
-                if (find_empty_cluster(clusters) != clusters.end())
-                    return partition(observations, profile);
+            return means;
+        }
 
-                for (size_t i = 0; i < clusters.size(); i++)
-                {
-                    auto& cluster = clusters[i];
+        // k-means||: a few rounds sample many candidates at once in parallel, then the candidates,
+        // weighted by how many observations they attract, are reclustered with weighted D^2 sampling.
+        std::vector<point<T, D>> get_k_means_parallel_means(observation_span<T, D> observations, partitioning_profile& profile)
+        {
+            std::uniform_int_distribution<size_t> indices_distribution(0, observations.size() - 1);
+
+            std::vector<point<T, D>> candidates{ observations[indices_distribution(this->random_engine)] };
+            std::vector<double> min_distances(observations.size(), DBL_MAX);
+
+            double total = this->update_min_distances(observations, candidates, min_distances, profile);
+            double oversampling = this->oversampling_factor * static_cast<double>(this->param);
+
+            size_t chunks_amount = (observations.size() + CHUNK_SIZE - 1) / CHUNK_SIZE;
+            std::vector<std::vector<size_t>> chunk_picks(chunks_amount);
+
+            for (size_t round = 0; round < this->seeding_rounds && total > 0; round++)
+            {
+                // Chunks draw from their own engines seeded from the partitioner's, so the picks do
+                // not depend on the number of threads.
+                auto round_seed = this->random_engine();
+
+                this->for_each_chunk(observations.size(), [&](size_t chunk, size_t begin, size_t end) {
+                    std::default_random_engine chunk_engine(round_seed + static_cast<std::default_random_engine::result_type>(chunk));
+                    std::uniform_real_distribution<double> probability(0, 1);
+
+                    chunk_picks[chunk].clear();
 
-                    previous_means[i] = cluster.mean;
-                    cluster.mean = std::move(k_means::compute_centroid(clusters[i]));
+                    for (size_t i = begin; i < end; i++)
+                    {
+                        if (probability(chunk_engine) < oversampling * min_distances[i] / total)
+                            chunk_picks[chunk].push_back(i);
+                    }
+                });
+
+                std::vector<point<T, D>> picked;
+
+                for (auto& picks : chunk_picks)
+                {
+                    for (size_t index : picks)
+                        picked.push_back(observations[index]);
                 }
 
-                profile.iterations++;
+                candidates.insert(candidates.end(), picked.begin(), picked.end());
+                total = this->update_min_distances(observations, picked, min_distances, profile);
             }
 
-            return clusters;
+            std::vector<label_t> labels(observations.size());
+            std::vector<std::vector<double>> chunk_weights(chunks_amount);
+
+            this->means_table.load(candidates);
+
+            this->for_each_chunk(observations.size(), [&](size_t chunk, size_t begin, size_t end) {
+                this->means_table.nearest(observations.data() + begin, end - begin, labels.data() + begin);
+                chunk_weights[chunk].assign(candidates.size(), 0);
+
+                for (size_t i = begin; i < end; i++)
+                    chunk_weights[chunk][labels[i]]++;
+            });
+
+            profile.distance_evaluations += observations.size() * candidates.size();
+
+            std::vector<double> weights(candidates.size(), 0);
+
+            for (auto& chunk_weight : chunk_weights)
+            {
+                for (size_t i = 0; i < weights.size(); i++)
+                    weights[i] += chunk_weight[i];
+            }
+
+            return this->recluster_weighted(candidates, weights, observations, profile);
         }
 
-        static void assign_observations(std::vector<cluster<T>>& clusters, const std::vector<v2d<T>>& observations)
+        std::vector<point<T, D>> recluster_weighted(
+            const std::vector<point<T, D>>& candidates,
+            const std::vector<double>& weights,
+            observation_span<T, D> observations,
+            partitioning_profile& profile
+        )
         {
-            for (size_t i = 0; i < observations.size(); i++)
-            {
-                auto& observation = observations[i];
+            std::uniform_int_distribution<size_t> indices_distribution(0, observations.size() - 1);
 
-                double closest_distance = DBL_MAX;
-                size_t closest_cluster_index = 0;
+            std::vector<point<T, D>> means{ candidates[this->sample_weighted(weights, std::accumulate(weights.begin(), weights.end(), 0.0))] };
+            std::vector<double> min_distances(candidates.size(), DBL_MAX);
+            std::vector<double> weighted_distances(candidates.size(), 0);
 
-                for (size_t j = 0; j < clusters.size(); j++)
+            while (means.size() < this->param)
+            {
+                double total = 0;
+
+                for (size_t i = 0; i < candidates.size(); i++)
                 {
-                    auto& cluster = clusters[j];
-                    double distance = observation.euclidean_distance_squared(cluster.mean);
+                    min_distances[i] = std::min(min_distances[i], candidates[i].euclidean_distance_squared(means.back()));
+                    weighted_distances[i] = weights[i] * min_distances[i];
 
-                    if (distance < closest_distance)
-                    {
-                        closest_distance = distance;
-                        closest_cluster_index = j;
-                    }
+                    total += weighted_distances[i];
                 }
 
-                clusters[closest_cluster_index].observations.push_back(
-                    std::make_shared<v2d<T>>(observation)
-                );
+                profile.distance_evaluations += candidates.size();
+
+                if (total <= 0)
+                    means.push_back(observations[indices_distribution(this->random_engine)]);
+                else
+                    means.push_back(candidates[this->sample_weighted(weighted_distances, total)]);
             }
+
+            return means;
         }
 
-        static v2d<T> compute_centroid(const cluster<T>& cluster)
+        std::vector<point<T, D>> seed_means(observation_span<T, D> observations, partitioning_profile& profile)
         {
-            v2d<T> coords_sum{};
+            phase_timer t(profile, partitioning_phase::seeding);
 
-            for (auto& observation : cluster.observations)
-                coords_sum += *observation;
+            switch (this->seeding)
+            {
+            case seeding_strategy::k_means_plus_plus:
+                return this->get_k_means_plus_plus_means(observations, profile);
 
-            return coords_sum / static_cast<T>(cluster.observations.size());
-        };
+            case seeding_strategy::k_means_parallel:
+                return this->get_k_means_parallel_means(observations, profile);
+
+            default:
+                return this->get_random_means(observations);
+            }
+        }
 
-        static bool converged(const std::vector<cluster<T>>& clusters, const std::vector<v2d<T>>& previous_means)
+        std::vector<cluster<T, D>> init_clusters(const std::vector<point<T, D>>& means)
         {
-            for (size_t i = 0; i < clusters.size(); i++)
+            std::vector<cluster<T, D>> clusters(this->param);
+
+            for (size_t i = 0; i < this->param; i++)
             {
-                if (clusters[i].mean != previous_means[i])
-                    return false;
+                auto& cluster = clusters[i];
+
+                cluster.mean = means[i];
+                cluster.color = cluster_color(i);
             }
 
-            return true;
-        };
-    };
+            return clusters;
+        }
 
-    template <typename T = int32_t>
-    struct k_medoids : public k_means<T>
-    {
-        k_medoids()
+        std::vector<cluster<T, D>> partition(observation_span<T, D> observations, partitioning_profile& profile = {}) override
         {
-            this->name = "K medoids";
-            this->param_name = "K";
+            profile.reset();
+            timer t(profile.elapsed_time);
+            allocation_counter a(profile.heap_allocations);
+
+            std::vector<point<T, D>> initial_means = std::move(this->seed_means(observations, profile));
+            std::vector<cluster<T, D>> clusters = std::move(this->init_clusters(initial_means));
+
+            return this->iterate(observations, clusters, profile);
         }
 
-        v2d<T> compute_medoid_from_centroid(const cluster<T>& cluster)
+        // Starts from the previous clustering instead of fresh seeds. Its labels must describe a
+        // prefix of observations, i.e. the same dataset, possibly with observations appended since.
+        // Missing means are added by splitting the clusters with the highest variability, extra ones
+        // are removed by merging the closest pair, and appended observations are assigned to the
+        // previous means before iterating.
+        std::vector<cluster<T, D>> repartition(
+            observation_span<T, D> observations,
+            const std::vector<cluster<T, D>>& previous,
+            partitioning_profile& profile = {}
+        ) override
         {
-            auto centroid = std::move(k_means<T>::compute_centroid(cluster));
-            
-            auto medoid_iter = std::lower_bound(
-                cluster.observations.begin(),
-                cluster.observations.end(),
-                centroid,
-                [](const v2d_shared_ptr<T> obs, const v2d<T>& centroid) { return obs->x < centroid.x; }
-            );
+            if (observations.empty() || previous.empty() || !previous.front().observations.get_source())
+                return this->partition(observations, profile);
 
-            v2d<T> medoid{};
+            profile.reset();
+            timer t(profile.elapsed_time);
+            allocation_counter a(profile.heap_allocations);
+
+            const std::vector<label_t>& previous_labels = previous.front().observations.get_source()->labels;
+
+            if (previous_labels.size() > observations.size())
+                return this->partition(observations, profile);
+
+            std::vector<point<T, D>> means;
 
-            if (medoid_iter == cluster.observations.end())
             {
-                std::uniform_int_distribution<size_t> indices_distribution(0, cluster.observations.size() - 1);
-                size_t index = indices_distribution(this->random_engine);
-                
-                medoid = *(cluster.observations.at(index));
+                phase_timer t(profile, partitioning_phase::seeding);
+                means = std::move(this->adjust_means(observations, previous, previous_labels));
             }
 
-            else medoid = **medoid_iter;
+            std::vector<cluster<T, D>> clusters = std::move(this->init_clusters(means));
 
-            return medoid;
-        };
+            if (previous.size() == clusters.size() && previous_labels.size() < observations.size())
+            {
+                phase_timer t(profile, partitioning_phase::assignment);
+                this->absorb_appended(observations, previous_labels, clusters, profile);
+            }
 
-        std::vector<cluster<T>> partition(std::vector<v2d<T>>& observations, partitioning_profile& profile = {}) override
+            return this->iterate(observations, clusters, profile);
+        }
+
+        // Weighted D^2 seeding, whatever the seeding strategy, then Lloyd iterations over weighted
+        // sums. Clusters left without observations keep their means. Subclasses that change how
+        // iterations run get these plain weighted Lloyd iterations instead.
+        std::vector<cluster<T, D>> partition_weighted(
+            observation_span<T, D> observations,
+            const std::vector<double>& weights,
+            partitioning_profile& profile
+        ) override
         {
             profile.reset();
             timer t(profile.elapsed_time);
+            allocation_counter a(profile.heap_allocations);
+
+            if (observations.empty())
+                return {};
+
+            std::vector<point<T, D>> initial_means;
+
+            {
+                phase_timer t(profile, partitioning_phase::seeding);
+
+                std::vector<point<T, D>> candidates(observations.begin(), observations.end());
+                initial_means = std::move(this->recluster_weighted(candidates, weights, observations, profile));
+            }
 
-            std::vector<v2d<T>> optimal_means = std::move(k_means<T>::find_optimal_means(observations));
-            std::vector<cluster<T>> clusters = std::move(k_means<T>::init_clusters(optimal_means));
+            std::vector<cluster<T, D>> clusters = std::move(this->init_clusters(initial_means));
 
-            double current_dissimilarity = DBL_MAX;
-            double previous_dissimilarity = DBL_MAX;
+            return this->iterate_weighted(observations, weights, clusters, profile);
+        }
+
+        std::vector<cluster<T, D>> iterate_weighted(
+            observation_span<T, D> observations,
+            const std::vector<double>& weights,
+            std::vector<cluster<T, D>>& clusters,
+            partitioning_profile& profile
+        )
+        {
+            std::vector<point<double, D>> previous_centroids;
+            this->load_centroids(clusters);
+
+            auto assignment = std::make_shared<labeling<T, D>>(observations, clusters.size());
+            bind_clusters(clusters, std::shared_ptr<const labeling<T, D>>(assignment));
+
+            std::vector<point<double, D>> sums(clusters.size());
+            std::vector<double> totals(clusters.size());
 
             while (true)
             {
-                clear_clusters(clusters);
-                k_means<T>::assign_observations(clusters, observations);
+                {
+                    phase_timer t(profile, partitioning_phase::convergence);
+
+                    profile.stopped_by = this->check_convergence(previous_centroids, profile);
+
+                    if (profile.stopped_by != stop_reason::none)
+                        break;
+                }
 
-                auto empty_cluster_iter = find_empty_cluster(clusters);
+                size_t reassigned = 0;
+                double inertia = 0;
 
-                if (empty_cluster_iter != clusters.end())
                 {
-                    auto& empty_cluster = clusters[empty_cluster_iter - clusters.begin()];
+                    phase_timer t(profile, partitioning_phase::assignment);
 
-                    std::uniform_int_distribution<size_t> indices_distribution(0, observations.size() - 1);
-                    size_t index = indices_distribution(this->random_engine);
+                    this->previous_labels = assignment->labels;
+                    this->means_table.load(this->centroids);
 
-                    empty_cluster.mean = observations.at(indices_distribution(this->random_engine));
-                    continue;
+                    this->for_each_chunk(observations.size(), [&](size_t, size_t begin, size_t end) {
+                        this->means_table.nearest(observations.data() + begin, end - begin, assignment->labels.data() + begin);
+                    });
+
+                    reassigned = this->count_reassigned(assignment->labels);
+
+                    std::fill(sums.begin(), sums.end(), point<double, D>{});
+                    std::fill(totals.begin(), totals.end(), 0);
+
+                    for (size_t i = 0; i < observations.size(); i++)
+                    {
+                        label_t label = assignment->labels[i];
+
+                        for_each_dimension<D>([&](size_t d) {
+                            coordinate(sums[label], d) += weights[i] * static_cast<double>(coordinate(observations[i], d));
+                        });
+
+                        totals[label] += weights[i];
+                        inertia += weights[i] * squared_distance<D>(observations[i], this->centroids[label]);
+                    }
                 }
 
-                for (size_t i = 0; i < clusters.size(); i++)
+                size_t evaluations = observations.size() * clusters.size();
+
+                profile.distance_evaluations += evaluations;
+                profile.record_iteration(evaluations, reassigned, inertia);
+
                 {
-                    auto& cluster = clusters[i];
-                    cluster.mean = std::move(compute_medoid_from_centroid(clusters[i]));
+                    phase_timer t(profile, partitioning_phase::update);
+
+                    previous_centroids = this->centroids;
+
+                    for (size_t j = 0; j < clusters.size(); j++)
+                    {
+                        if (totals[j] <= 0)
+                            continue;
+
+                        for_each_dimension<D>([&](size_t d) {
+                            coordinate(this->centroids[j], d) = coordinate(sums[j], d) / totals[j];
+                        });
+
+                        clusters[j].mean = point_cast<T, D>(this->centroids[j]);
+                    }
                 }
 
                 profile.iterations++;
+                this->report_iteration(clusters, assignment->labels);
+            }
+
+            assignment->group(clusters.size());
+            return clusters;
+        }
+
+        std::vector<point<T, D>> adjust_means(
+            observation_span<T, D> observations,
+            const std::vector<cluster<T, D>>& previous,
+            const std::vector<label_t>& previous_labels
+        )
+        {
+            std::vector<point<T, D>> means(previous.size());
+            std::vector<double> counts(previous.size(), 0);
 
-                previous_dissimilarity = current_dissimilarity;
-                current_dissimilarity = dissimilarity(clusters);
+            for (size_t i = 0; i < previous.size(); i++)
+                means[i] = previous[i].mean;
 
-                if (current_dissimilarity >= previous_dissimilarity)
-                    break;
+            for (label_t label : previous_labels)
+                counts[label]++;
+
+            if (means.size() < this->param)
+                this->split_clusters(observations, previous_labels, means, counts);
+
+            while (means.size() > this->param)
+                k_means::merge_closest_means(means, counts);
+
+            return means;
+        }
+
+        // Largest eigenvalue of a D x D covariance matrix and its unit eigenvector, in closed form
+        // for two dimensions and by power iteration otherwise.
+        static double principal_axis(const double* covariance, double* axis)
+        {
+            if constexpr (D == 2)
+            {
+                double var_x = covariance[0];
+                double var_y = covariance[3];
+                double cov = covariance[1];
+
+                double trace_half = (var_x + var_y) / 2;
+                double eigenvalue = trace_half + std::sqrt(std::max(trace_half * trace_half - (var_x * var_y - cov * cov), 0.0));
+
+                axis[0] = cov;
+                axis[1] = eigenvalue - var_x;
+
+                if (std::abs(axis[0]) + std::abs(axis[1]) == 0)
+                {
+                    axis[0] = var_x >= var_y ? 1 : 0;
+                    axis[1] = var_x >= var_y ? 0 : 1;
+                }
+
+                double length = std::sqrt(axis[0] * axis[0] + axis[1] * axis[1]);
+
+                axis[0] /= length;
+                axis[1] /= length;
+
+                return eigenvalue;
             }
 
+            else
+            {
+                size_t widest = 0;
+
+                for (size_t d = 0; d < D; d++)
+                {
+                    axis[d] = 0;
+
+                    if (covariance[d * D + d] > covariance[widest * D + widest])
+                        widest = d;
+                }
+
+                axis[widest] = 1;
+
+                double eigenvalue = covariance[widest * D + widest];
+
+                for (size_t iteration = 0; iteration < POWER_ITERATIONS; iteration++)
+                {
+                    double product[D] = {};
+                    double length = 0;
+
+                    for (size_t a = 0; a < D; a++)
+                    {
+                        for (size_t b = 0; b < D; b++)
+                            product[a] += covariance[a * D + b] * axis[b];
+
+                        length += product[a] * product[a];
+                    }
+
+                    if (length == 0)
+                        break;
+
+                    length = std::sqrt(length);
+                    eigenvalue = length;
+
+                    for (size_t d = 0; d < D; d++)
+                        axis[d] = product[d] / length;
+                }
+
+                return eigenvalue;
+            }
+        }
+
+        // Splits clusters, highest variability first, along their principal axis into two means one
+        // standard deviation either side of the old one.
+        void split_clusters(
+            observation_span<T, D> observations,
+            const std::vector<label_t>& labels,
+            std::vector<point<T, D>>& means,
+            std::vector<double>& counts
+        )
+        {
+            size_t clusters_amount = means.size();
+
+            std::vector<double> variabilities(clusters_amount, 0);
+            std::vector<double> covariances(clusters_amount * D * D, 0);
+
+            for (size_t i = 0; i < labels.size(); i++)
+            {
+                label_t label = labels[i];
+
+                double* covariance = covariances.data() + label * D * D;
+                double difference[D];
+
+                for_each_dimension<D>([&](size_t d) {
+                    difference[d] = static_cast<double>(coordinate(observations[i], d)) - static_cast<double>(coordinate(means[label], d));
+                    variabilities[label] += difference[d] * difference[d];
+                });
+
+                for (size_t a = 0; a < D; a++)
+                {
+                    for (size_t b = 0; b < D; b++)
+                        covariance[a * D + b] += difference[a] * difference[b];
+                }
+            }
+
+            std::vector<size_t> order(clusters_amount);
+            std::iota(order.begin(), order.end(), 0);
+
+            std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return variabilities[a] > variabilities[b]; });
+
+            std::uniform_int_distribution<size_t> indices_distribution(0, observations.size() - 1);
+
+            for (size_t next = 0; means.size() < this->param; next++)
+            {
+                if (next >= order.size() || counts[order[next]] < 2)
+                {
+                    means.push_back(observations[indices_distribution(this->random_engine)]);
+                    counts.push_back(0);
+                    continue;
+                }
+
+                size_t j = order[next];
+
+                double covariance[D * D];
+
+                for (size_t c = 0; c < D * D; c++)
+                    covariance[c] = covariances[j * D * D + c] / counts[j];
+
+                double axis[D];
+                double deviation = std::sqrt(k_means::principal_axis(covariance, axis));
+
+                point<T, D> mean = means[j];
+                point<T, D> lower = mean;
+                point<T, D> upper = mean;
+
+                for_each_dimension<D>([&](size_t d) {
+                    coordinate(lower, d) = static_cast<T>(static_cast<double>(coordinate(mean, d)) - axis[d] * deviation);
+                    coordinate(upper, d) = static_cast<T>(static_cast<double>(coordinate(mean, d)) + axis[d] * deviation);
+                });
+
+                means[j] = lower;
+                means.push_back(upper);
+
+                counts[j] /= 2;
+                counts.push_back(counts[j]);
+            }
+        }
+
+        static void merge_closest_means(std::vector<point<T, D>>& means, std::vector<double>& counts)
+        {
+            size_t closest_a = 0;
+            size_t closest_b = 1;
+            double closest_distance = DBL_MAX;
+
+            for (size_t a = 0; a < means.size(); a++)
+            {
+                for (size_t b = a + 1; b < means.size(); b++)
+                {
+                    double distance = means[a].euclidean_distance_squared(means[b]);
+
+                    if (distance < closest_distance)
+                    {
+                        closest_distance = distance;
+                        closest_a = a;
+                        closest_b = b;
+                    }
+                }
+            }
+
+            double weight_a = std::max(counts[closest_a], 1.0);
+            double weight_b = std::max(counts[closest_b], 1.0);
+            double total = weight_a + weight_b;
+
+            for_each_dimension<D>([&](size_t d) {
+                coordinate(means[closest_a], d) = static_cast<T>(
+                    (static_cast<double>(coordinate(means[closest_a], d)) * weight_a + static_cast<double>(coordinate(means[closest_b], d)) * weight_b) / total
+                );
+            });
+
+            counts[closest_a] += counts[closest_b];
+
+            means.erase(means.begin() + closest_b);
+            counts.erase(counts.begin() + closest_b);
+        }
+
+        // Keeps the previous labels, assigns only the appended observations and moves the means
+        // to the centroids of the combined assignment.
+        void absorb_appended(
+            observation_span<T, D> observations,
+            const std::vector<label_t>& previous_labels,
+            std::vector<cluster<T, D>>& clusters,
+            partitioning_profile& profile
+        )
+        {
+            size_t appended_begin = previous_labels.size();
+
+            std::vector<label_t> labels = previous_labels;
+            labels.resize(observations.size());
+
+            this->means_table.load(clusters);
+            this->means_table.nearest(observations.data() + appended_begin, observations.size() - appended_begin, labels.data() + appended_begin);
+
+            profile.distance_evaluations += (observations.size() - appended_begin) * clusters.size();
+
+            std::vector<point<accumulator_t<T>, D>> sums(clusters.size());
+            std::vector<size_t> counts(clusters.size(), 0);
+
+            for (size_t i = 0; i < observations.size(); i++)
+            {
+                accumulate<D>(sums[labels[i]], observations[i]);
+                counts[labels[i]]++;
+            }
+
+            this->load_centroids(clusters);
+            this->update_centroids(sums, counts, clusters);
+        }
+
+        // Lloyd iterations from the means the clusters start with.
+        virtual std::vector<cluster<T, D>> iterate(observation_span<T, D> observations, std::vector<cluster<T, D>>& clusters, partitioning_profile& profile)
+        {
+            std::vector<point<double, D>> previous_centroids;
+            this->load_centroids(clusters);
+
+            auto assignment = std::make_shared<labeling<T, D>>(observations, clusters.size());
+            bind_clusters(clusters, std::shared_ptr<const labeling<T, D>>(assignment));
+
+            std::vector<partial_sums> partials;
+            std::vector<point<accumulator_t<T>, D>> sums(clusters.size());
+            std::vector<size_t> counts(clusters.size());
+
+            double squared_norms = this->sum_squared_norms(observations);
+
+            while (true)
+            {
+                {
+                    phase_timer t(profile, partitioning_phase::convergence);
+
+                    profile.stopped_by = this->check_convergence(previous_centroids, profile);
+
+                    if (profile.stopped_by != stop_reason::none)
+                        break;
+                }
+
+                size_t evaluations = 0;
+                size_t reassigned = 0;
+
+                {
+                    phase_timer t(profile, partitioning_phase::assignment);
+
+                    this->previous_labels = assignment->labels;
+
+                    evaluations = this->assign_and_accumulate(clusters, observations, assignment->labels, partials);
+                    k_means::reduce_partials(partials, sums, counts);
+
+                    reassigned = this->count_reassigned(assignment->labels);
+                }
+
+                k_means::count_evaluations(profile, evaluations, observations.size() * clusters.size());
+                profile.record_iteration(evaluations, reassigned, k_means::inertia(this->centroids, sums, counts, squared_norms));
+
+                {
+                    phase_timer t(profile, partitioning_phase::empty_clusters);
+                    this->repair_empty_clusters(observations, assignment->labels, sums, counts, profile);
+                }
+
+                {
+                    phase_timer t(profile, partitioning_phase::update);
+
+                    previous_centroids = this->centroids;
+                    this->update_centroids(sums, counts, clusters);
+                }
+
+                profile.iterations++;
+                this->report_iteration(clusters, assignment->labels);
+            }
+
+            assignment->group(clusters.size());
+            return clusters;
+        }
+
+        void load_centroids(const std::vector<cluster<T, D>>& clusters)
+        {
+            this->centroids.resize(clusters.size());
+
+            for (size_t i = 0; i < clusters.size(); i++)
+                this->centroids[i] = point_cast<double, D>(clusters[i].mean);
+        }
+
+        // Moves every centroid with observations to the mean of its sums and rounds it into the
+        // cluster; clusters without observations keep their centroid.
+        void update_centroids(const std::vector<point<accumulator_t<T>, D>>& sums, const std::vector<size_t>& counts, std::vector<cluster<T, D>>& clusters)
+        {
+            for (size_t i = 0; i < clusters.size(); i++)
+            {
+                if (counts[i] == 0)
+                    continue;
+
+                for_each_dimension<D>([&](size_t d) {
+                    coordinate(this->centroids[i], d) = static_cast<double>(coordinate(sums[i], d)) / static_cast<double>(counts[i]);
+                });
+
+                clusters[i].mean = point_cast<T, D>(this->centroids[i]);
+            }
+        }
+
+        void move_observation(
+            observation_span<T, D> observations,
+            size_t index,
+            label_t to,
+            std::vector<label_t>& labels,
+            std::vector<point<accumulator_t<T>, D>>& sums,
+            std::vector<size_t>& counts
+        ) const
+        {
+            label_t from = labels[index];
+
+            for_each_dimension<D>([&](size_t d) {
+                auto value = static_cast<accumulator_t<T>>(coordinate(observations[index], d));
+
+                coordinate(sums[from], d) -= value;
+                coordinate(sums[to], d) += value;
+            });
+
+            counts[from]--;
+            counts[to]++;
+            labels[index] = to;
+        }
+
+        // The observation farthest from the centroid it was assigned to, among clusters that keep
+        // at least one observation without it, and only in cluster within when that is a label.
+        // Returns observations.size() when every cluster has a single observation.
+        size_t farthest_observation(
+            observation_span<T, D> observations,
+            const std::vector<label_t>& labels,
+            const std::vector<size_t>& counts,
+            size_t within
+        ) const
+        {
+            size_t farthest = observations.size();
+            double farthest_distance = -1;
+
+            for (size_t i = 0; i < observations.size(); i++)
+            {
+                label_t label = labels[i];
+
+                if (counts[label] < 2 || (within < counts.size() && label != within))
+                    continue;
+
+                double distance = squared_distance<D>(observations[i], this->centroids[label]);
+
+                if (distance > farthest_distance)
+                {
+                    farthest_distance = distance;
+                    farthest = i;
+                }
+            }
+
+            return farthest;
+        }
+
+        // Moves the observations of the cluster with the highest variability that lie past its
+        // mean along its principal axis into the empty cluster. Returns false when no cluster has
+        // observations on both sides.
+        bool split_largest(
+            observation_span<T, D> observations,
+            std::vector<label_t>& labels,
+            std::vector<point<accumulator_t<T>, D>>& sums,
+            std::vector<size_t>& counts,
+            label_t empty
+        ) const
+        {
+            std::vector<point<double, D>> means(counts.size());
+            std::vector<double> variabilities(counts.size(), 0);
+
+            for (size_t j = 0; j < counts.size(); j++)
+            {
+                if (counts[j] > 0)
+                {
+                    for_each_dimension<D>([&](size_t d) {
+                        coordinate(means[j], d) = static_cast<double>(coordinate(sums[j], d)) / static_cast<double>(counts[j]);
+                    });
+                }
+            }
+
+            for (size_t i = 0; i < observations.size(); i++)
+                variabilities[labels[i]] += squared_distance<D>(observations[i], means[labels[i]]);
+
+            size_t largest = std::max_element(variabilities.begin(), variabilities.end()) - variabilities.begin();
+
+            if (variabilities[largest] == 0)
+                return false;
+
+            double covariance[D * D] = {};
+
+            for (size_t i = 0; i < observations.size(); i++)
+            {
+                if (labels[i] != largest)
+                    continue;
+
+                double difference[D];
+
+                for_each_dimension<D>([&](size_t d) {
+                    difference[d] = static_cast<double>(coordinate(observations[i], d)) - coordinate(means[largest], d);
+                });
+
+                for (size_t a = 0; a < D; a++)
+                {
+                    for (size_t b = 0; b < D; b++)
+                        covariance[a * D + b] += difference[a] * difference[b] / counts[largest];
+                }
+            }
+
+            double axis[D];
+            k_means::principal_axis(covariance, axis);
+
+            auto beyond_mean = [&](size_t i) {
+                double projection = 0;
+
+                for_each_dimension<D>([&](size_t d) {
+                    projection += (static_cast<double>(coordinate(observations[i], d)) - coordinate(means[largest], d)) * axis[d];
+                });
+
+                return projection > 0;
+            };
+
+            size_t moved = 0;
+
+            for (size_t i = 0; i < observations.size(); i++)
+                moved += labels[i] == largest && beyond_mean(i);
+
+            if (moved == 0 || moved == counts[largest])
+                return false;
+
+            for (size_t i = 0; i < observations.size(); i++)
+            {
+                if (labels[i] == largest && beyond_mean(i))
+                    this->move_observation(observations, i, empty, labels, sums, counts);
+            }
+
+            return true;
+        }
+
+        // Gives every empty cluster observations again as repair says, adjusting labels, sums and
+        // counts in place so the iteration carries on. A cluster stays empty only when every other
+        // one has a single observation. Returns whether any cluster was repaired.
+        bool repair_empty_clusters(
+            observation_span<T, D> observations,
+            std::vector<label_t>& labels,
+            std::vector<point<accumulator_t<T>, D>>& sums,
+            std::vector<size_t>& counts,
+            partitioning_profile& profile
+        ) const
+        {
+            bool repaired = false;
+
+            for (size_t j = 0; j < counts.size(); j++)
+            {
+                if (counts[j] > 0)
+                    continue;
+
+                label_t empty = static_cast<label_t>(j);
+
+                if (this->repair != empty_cluster_repair::split_largest || !this->split_largest(observations, labels, sums, counts, empty))
+                {
+                    size_t within = this->repair == empty_cluster_repair::steal_largest
+                        ? std::max_element(counts.begin(), counts.end()) - counts.begin()
+                        : counts.size();
+
+                    size_t farthest = this->farthest_observation(observations, labels, counts, within);
+
+                    if (farthest == observations.size())
+                        continue;
+
+                    this->move_observation(observations, farthest, empty, labels, sums, counts);
+                }
+
+                profile.repaired_clusters++;
+                repaired = true;
+            }
+
+            return repaired;
+        }
+
+        // Checked before every assignment. A run whose centroids did not move at all has reached
+        // a fixed point; the other reasons come from the convergence criteria.
+        stop_reason check_convergence(const std::vector<point<double, D>>& previous_centroids, const partitioning_profile& profile) const
+        {
+            if (this->cancelled)
+                return stop_reason::cancelled;
+
+            if (profile.iterations > 0 && previous_centroids.size() == this->centroids.size())
+            {
+                double largest_shift = 0;
+
+                for (size_t i = 0; i < this->centroids.size(); i++)
+                    largest_shift = std::max(largest_shift, squared_distance<D>(previous_centroids[i], this->centroids[i]));
+
+                if (largest_shift == 0)
+                    return stop_reason::converged;
+
+                if (largest_shift <= this->convergence.mean_shift * this->convergence.mean_shift)
+                    return stop_reason::mean_shift;
+            }
+
+            auto& history = profile.iteration_history;
+
+            if (this->convergence.relative_inertia_change > 0 && history.size() >= 2)
+            {
+                double previous = history[history.size() - 2].inertia;
+
+                if (previous - history.back().inertia <= this->convergence.relative_inertia_change * previous)
+                    return stop_reason::inertia_change;
+            }
+
+            if (this->convergence.max_iterations > 0 && profile.iterations >= this->convergence.max_iterations)
+                return stop_reason::max_iterations;
+
+            return stop_reason::none;
+        }
+
+        double sum_squared_norms(observation_span<T, D> observations)
+        {
+            std::vector<double> chunk_norms((observations.size() + CHUNK_SIZE - 1) / CHUNK_SIZE, 0);
+
+            this->for_each_chunk(observations.size(), [&](size_t chunk, size_t begin, size_t end) {
+                double norms = 0;
+
+                for (size_t i = begin; i < end; i++)
+                    norms += dot<D>(observations[i], observations[i]);
+
+                chunk_norms[chunk] = norms;
+            });
+
+            return std::accumulate(chunk_norms.begin(), chunk_norms.end(), 0.0);
+        }
+
+        // Inertia of an assignment from its per-cluster sums, before the means are moved:
+        // sum |x - m|^2 = sum |x|^2 - 2 m . sum x + n |m|^2.
+        static double inertia(
+            const std::vector<point<double, D>>& centroids,
+            const std::vector<point<accumulator_t<T>, D>>& sums,
+            const std::vector<size_t>& counts,
+            double squared_norms
+        )
+        {
+            double result = squared_norms;
+
+            for (size_t i = 0; i < centroids.size(); i++)
+            {
+                result -= 2 * dot<D>(centroids[i], sums[i]);
+                result += counts[i] * dot<D>(centroids[i], centroids[i]);
+            }
+
+            return std::max(result, 0.0);
+        }
+
+        // Compares labels against previous_labels.
+        size_t count_reassigned(const std::vector<label_t>& labels)
+        {
+            this->chunk_reassignments.assign((labels.size() + CHUNK_SIZE - 1) / CHUNK_SIZE, 0);
+
+            this->for_each_chunk(labels.size(), [&](size_t chunk, size_t begin, size_t end) {
+                size_t reassigned = 0;
+
+                for (size_t i = begin; i < end; i++)
+                    reassigned += labels[i] != this->previous_labels[i];
+
+                this->chunk_reassignments[chunk] = reassigned;
+            });
+
+            return std::accumulate(this->chunk_reassignments.begin(), this->chunk_reassignments.end(), size_t{ 0 });
+        }
+
+        static void count_evaluations(partitioning_profile& profile, size_t performed, size_t brute_force)
+        {
+            profile.distance_evaluations += performed;
+            profile.skipped_distance_evaluations += brute_force - std::min(performed, brute_force);
+        }
+
+        bool indexed(observation_span<T, D> observations) const
+        {
+            if constexpr (D == 2)
+                return this->index && this->index->covers(observations);
+            else
+                return false;
+        }
+
+        // Labels through the spatial index, which indexed() must have allowed. Returns the number
+        // of distance evaluations performed.
+        size_t assign_indexed(std::vector<label_t>& labels)
+        {
+            if constexpr (D == 2)
+                return this->index->assign(this->means_table, labels.data(), this->pool.get());
+            else
+                return 0;
+        }
+
+        // Returns the number of distance evaluations performed.
+        size_t assign_observations(const std::vector<cluster<T, D>>& clusters, observation_span<T, D> observations, std::vector<label_t>& labels)
+        {
+            labels.resize(observations.size());
+            this->means_table.load(clusters);
+
+            if (this->indexed(observations))
+                return this->assign_indexed(labels);
+
+            this->for_each_chunk(observations.size(), [&](size_t, size_t begin, size_t end) {
+                this->means_table.nearest(observations.data() + begin, end - begin, labels.data() + begin);
+            });
+
+            return observations.size() * clusters.size();
+        }
+
+        // Returns the number of distance evaluations performed.
+        size_t assign_and_accumulate(
+            const std::vector<cluster<T, D>>& clusters,
+            observation_span<T, D> observations,
+            std::vector<label_t>& labels,
+            std::vector<partial_sums>& partials
+        )
+        {
+            labels.resize(observations.size());
+            partials.resize((observations.size() + CHUNK_SIZE - 1) / CHUNK_SIZE);
+
+            this->means_table.load(this->centroids);
+
+            bool indexed = this->indexed(observations);
+            size_t evaluations = indexed
+                ? this->assign_indexed(labels)
+                : observations.size() * clusters.size();
+
+            this->for_each_chunk(observations.size(), [&](size_t chunk, size_t begin, size_t end) {
+                auto& partial = partials[chunk];
+
+                partial.sums.assign(clusters.size(), point<accumulator_t<T>, D>{});
+                partial.counts.assign(clusters.size(), 0);
+
+                if (!indexed)
+                    this->means_table.nearest(observations.data() + begin, end - begin, labels.data() + begin);
+
+                for (size_t i = begin; i < end; i++)
+                {
+                    accumulate<D>(partial.sums[labels[i]], observations[i]);
+                    partial.counts[labels[i]]++;
+                }
+            });
+
+            return evaluations;
+        }
+
+        static void reduce_partials(const std::vector<partial_sums>& partials, std::vector<point<accumulator_t<T>, D>>& sums, std::vector<size_t>& counts)
+        {
+            std::fill(sums.begin(), sums.end(), point<accumulator_t<T>, D>{});
+            std::fill(counts.begin(), counts.end(), 0);
+
+            for (auto& partial : partials)
+            {
+                for (size_t i = 0; i < sums.size(); i++)
+                {
+                    sums[i] += partial.sums[i];
+                    counts[i] += partial.counts[i];
+                }
+            }
+        }
+
+        static point<T, D> compute_centroid(const cluster<T, D>& cluster)
+        {
+            point<accumulator_t<T>, D> coords_sum{};
+
+            for (auto& observation : cluster.observations)
+                accumulate<D>(coords_sum, observation);
+
+            point<double, D> centroid{};
+
+            for_each_dimension<D>([&](size_t d) {
+                coordinate(centroid, d) = static_cast<double>(coordinate(coords_sum, d)) / static_cast<double>(cluster.observations.size());
+            });
+
+            return point_cast<T, D>(centroid);
+        };
+
+        // Weighted mean of the members, weights indexed like the observations the cluster was
+        // computed on. A cluster without weight keeps its mean.
+        static point<T, D> compute_centroid(const cluster<T, D>& cluster, const std::vector<double>& weights)
+        {
+            point<double, D> coords_sum{};
+            double total = 0;
+
+            for (size_t i = 0; i < cluster.observations.size(); i++)
+            {
+                double weight = weights[cluster.observations.index(i)];
+
+                for_each_dimension<D>([&](size_t d) {
+                    coordinate(coords_sum, d) += weight * static_cast<double>(coordinate(cluster.observations[i], d));
+                });
+
+                total += weight;
+            }
+
+            if (total <= 0)
+                return cluster.mean;
+
+            for_each_dimension<D>([&](size_t d) {
+                coordinate(coords_sum, d) /= total;
+            });
+
+            return point_cast<T, D>(coords_sum);
+        }
+    };
+
+    // K means with Hamerly's bounds: every observation keeps an upper bound on the distance to its
+    // mean and a lower bound on the distance to any other mean, and only rescans the means when
+    // the bounds overlap. Assignments, and therefore the clustering, match k_means exactly.
+    template <typename T = int32_t, size_t D = 2>
+    struct hamerly_k_means : public k_means<T, D>
+    {
+        // Bounds drift by floating point error as they are shifted, so a point is only skipped
+        // when its bounds are separated by more than this relative margin.
+        static constexpr double BOUNDS_TOLERANCE = 1e-9;
+
+        std::vector<double> upper_bounds;
+        std::vector<double> lower_bounds;
+
+        std::vector<double> half_separations;
+        std::vector<double> mean_shifts;
+        std::vector<size_t> chunk_evaluations;
+
+        hamerly_k_means(size_t threads = 1) : k_means<T, D>(threads)
+        {
+            this->name = "K means (Hamerly)";
+            this->param_name = "K";
+        }
+
+        template <typename P, typename Q>
+        static double squared_distance(const P& a, const Q& b)
+        {
+            return ntf::cluster::squared_distance<D>(a, b);
+        }
+
+        static bool separated(double upper_bound, double lower_bound)
+        {
+            return upper_bound * (1 + BOUNDS_TOLERANCE) < lower_bound;
+        }
+
+        void scan_means(const point<T, D>& observation, size_t index, label_t& label)
+        {
+            double closest_distance = std::numeric_limits<double>::infinity();
+            double second_distance = std::numeric_limits<double>::infinity();
+
+            for (size_t j = 0; j < this->centroids.size(); j++)
+            {
+                double distance = hamerly_k_means::squared_distance(observation, this->centroids[j]);
+
+                if (distance < closest_distance)
+                {
+                    second_distance = closest_distance;
+                    closest_distance = distance;
+                    label = static_cast<label_t>(j);
+                }
+
+                else if (distance < second_distance)
+                    second_distance = distance;
+            }
+
+            this->upper_bounds[index] = std::sqrt(closest_distance);
+            this->lower_bounds[index] = std::sqrt(second_distance);
+        }
+
+        void compute_half_separations(partitioning_profile& profile)
+        {
+            auto& centroids = this->centroids;
+
+            this->half_separations.assign(centroids.size(), std::numeric_limits<double>::infinity());
+
+            for (size_t i = 0; i < centroids.size(); i++)
+            {
+                for (size_t j = i + 1; j < centroids.size(); j++)
+                {
+                    double half_distance = std::sqrt(hamerly_k_means::squared_distance(centroids[i], centroids[j])) / 2;
+
+                    this->half_separations[i] = std::min(this->half_separations[i], half_distance);
+                    this->half_separations[j] = std::min(this->half_separations[j], half_distance);
+                }
+            }
+
+            profile.distance_evaluations += centroids.size() * (centroids.size() - 1) / 2;
+        }
+
+        void assign_with_bounds(
+            const std::vector<cluster<T, D>>& clusters,
+            observation_span<T, D> observations,
+            std::vector<label_t>& labels,
+            std::vector<typename k_means<T, D>::partial_sums>& partials,
+            bool first_pass,
+            partitioning_profile& profile
+        )
+        {
+            size_t chunks_amount = (observations.size() + k_means<T, D>::CHUNK_SIZE - 1) / k_means<T, D>::CHUNK_SIZE;
+
+            partials.resize(chunks_amount);
+            this->chunk_evaluations.assign(chunks_amount, 0);
+
+            this->for_each_chunk(observations.size(), [&](size_t chunk, size_t begin, size_t end) {
+                auto& partial = partials[chunk];
+                size_t evaluations = 0;
+
+                partial.sums.assign(clusters.size(), point<accumulator_t<T>, D>{});
+                partial.counts.assign(clusters.size(), 0);
+
+                for (size_t i = begin; i < end; i++)
+                {
+                    auto& observation = observations[i];
+                    label_t& label = labels[i];
+
+                    if (first_pass)
+                    {
+                        this->scan_means(observation, i, label);
+                        evaluations += clusters.size();
+                    }
+
+                    else
+                    {
+                        double bound = std::max(this->half_separations[label], this->lower_bounds[i]);
+
+                        if (!hamerly_k_means::separated(this->upper_bounds[i], bound))
+                        {
+                            this->upper_bounds[i] = std::sqrt(hamerly_k_means::squared_distance(observation, this->centroids[label]));
+                            evaluations++;
+
+                            if (!hamerly_k_means::separated(this->upper_bounds[i], bound))
+                            {
+                                this->scan_means(observation, i, label);
+                                evaluations += clusters.size();
+                            }
+                        }
+                    }
+
+                    accumulate<D>(partial.sums[label], observation);
+                    partial.counts[label]++;
+                }
+
+                this->chunk_evaluations[chunk] = evaluations;
+            });
+
+            size_t evaluations = 0;
+
+            for (size_t chunk_evaluation : this->chunk_evaluations)
+                evaluations += chunk_evaluation;
+
+            profile.distance_evaluations += evaluations;
+            profile.skipped_distance_evaluations += observations.size() * clusters.size() - std::min(evaluations, observations.size() * clusters.size());
+        }
+
+        void shift_bounds(const std::vector<point<double, D>>& previous_centroids, const std::vector<label_t>& labels)
+        {
+            this->mean_shifts.resize(this->centroids.size());
+
+            size_t largest_shift_index = 0;
+            double largest_shift = 0;
+            double second_largest_shift = 0;
+
+            for (size_t j = 0; j < this->centroids.size(); j++)
+            {
+                this->mean_shifts[j] = std::sqrt(hamerly_k_means::squared_distance(previous_centroids[j], this->centroids[j]));
+
+                if (this->mean_shifts[j] > largest_shift)
+                {
+                    second_largest_shift = largest_shift;
+                    largest_shift = this->mean_shifts[j];
+                    largest_shift_index = j;
+                }
+
+                else if (this->mean_shifts[j] > second_largest_shift)
+                    second_largest_shift = this->mean_shifts[j];
+            }
+
+            this->for_each_chunk(labels.size(), [&](size_t, size_t begin, size_t end) {
+                for (size_t i = begin; i < end; i++)
+                {
+                    label_t label = labels[i];
+
+                    this->upper_bounds[i] += this->mean_shifts[label];
+                    this->lower_bounds[i] -= label == largest_shift_index ? second_largest_shift : largest_shift;
+                }
+            });
+        }
+
+        std::vector<cluster<T, D>> iterate(observation_span<T, D> observations, std::vector<cluster<T, D>>& clusters, partitioning_profile& profile) override
+        {
+            std::vector<point<double, D>> previous_centroids;
+            this->load_centroids(clusters);
+
+            auto assignment = std::make_shared<labeling<T, D>>(observations, clusters.size());
+            bind_clusters(clusters, std::shared_ptr<const labeling<T, D>>(assignment));
+
+            std::vector<typename k_means<T, D>::partial_sums> partials;
+            std::vector<point<accumulator_t<T>, D>> sums(clusters.size());
+            std::vector<size_t> counts(clusters.size());
+
+            this->upper_bounds.assign(observations.size(), 0);
+            this->lower_bounds.assign(observations.size(), 0);
+
+            bool first_pass = true;
+            double squared_norms = this->sum_squared_norms(observations);
+
+            while (true)
+            {
+                {
+                    phase_timer t(profile, partitioning_phase::convergence);
+
+                    profile.stopped_by = this->check_convergence(previous_centroids, profile);
+
+                    if (profile.stopped_by != stop_reason::none)
+                        break;
+                }
+
+                size_t evaluations = profile.distance_evaluations;
+                size_t reassigned = 0;
+
+                {
+                    phase_timer t(profile, partitioning_phase::assignment);
+
+                    this->previous_labels = assignment->labels;
+
+                    if (!first_pass)
+                        this->compute_half_separations(profile);
+
+                    this->assign_with_bounds(clusters, observations, assignment->labels, partials, first_pass, profile);
+                    k_means<T, D>::reduce_partials(partials, sums, counts);
+
+                    reassigned = this->count_reassigned(assignment->labels);
+                }
+
+                profile.record_iteration(profile.distance_evaluations - evaluations, reassigned, k_means<T, D>::inertia(this->centroids, sums, counts, squared_norms));
+
+                bool repaired = false;
+
+                {
+                    phase_timer t(profile, partitioning_phase::empty_clusters);
+                    repaired = this->repair_empty_clusters(observations, assignment->labels, sums, counts, profile);
+                }
+
+                {
+                    phase_timer t(profile, partitioning_phase::update);
+
+                    previous_centroids = this->centroids;
+                    this->update_centroids(sums, counts, clusters);
+
+                    this->shift_bounds(previous_centroids, assignment->labels);
+                }
+
+                // Repaired observations broke their bounds, so the next assignment scans every mean.
+                first_pass = repaired;
+                profile.iterations++;
+
+                this->report_iteration(clusters, assignment->labels);
+            }
+
+            assignment->group(clusters.size());
+            return clusters;
+        }
+    };
+
+    // Mini-batch K means: means are moved by small random batches with a per-mean learning rate
+    // of 1 / (observations seen by that mean), and stop once the smoothed batch inertia no longer
+    // improves. Only the final pass looks at every observation.
+    template <typename T = int32_t, size_t D = 2>
+    struct mini_batch_k_means : public k_means<T, D>
+    {
+        size_t batch_size = 1024;
+        size_t max_no_improvement = 10;
+
+        mini_batch_k_means(size_t threads = 1, size_t batch_size = 1024) : k_means<T, D>(threads), batch_size(batch_size)
+        {
+            this->name = "Mini-batch K means";
+            this->param_name = "K";
+        }
+
+        // Online state for observations streamed in batches, for datasets that are never held in
+        // memory at once. The first param observations seed the means, every later one moves its
+        // nearest mean by 1 / count as the mini-batch update does. Lowering param between batches
+        // merges the closest means until param are left.
+        std::vector<point<double, D>> streamed_means;
+        std::vector<size_t> streamed_counts;
+        std::vector<label_t> streamed_labels;
+
+        void reset_stream()
+        {
+            this->streamed_means.clear();
+            this->streamed_counts.clear();
+        }
+
+        void consume(observation_span<T, D> batch)
+        {
+            while (this->streamed_means.size() > this->param)
+                this->merge_closest_streamed_means();
+
+            size_t seeded = this->streamed_means.size() < this->param
+                ? std::min<size_t>(this->param - this->streamed_means.size(), batch.size())
+                : 0;
+
+            for (size_t i = 0; i < seeded; i++)
+            {
+                this->streamed_means.push_back(point_cast<double, D>(batch[i]));
+                this->streamed_counts.push_back(1);
+            }
+
+            if (seeded == batch.size())
+                return;
+
+            this->streamed_labels.resize(batch.size() - seeded);
+            this->means_table.load(this->streamed_means);
+            this->means_table.nearest(batch.data() + seeded, batch.size() - seeded, this->streamed_labels.data());
+
+            for (size_t i = seeded; i < batch.size(); i++)
+            {
+                label_t label = this->streamed_labels[i - seeded];
+                auto& mean = this->streamed_means[label];
+                double learning_rate = 1.0 / ++this->streamed_counts[label];
+
+                for_each_dimension<D>([&](size_t d) {
+                    coordinate(mean, d) += learning_rate * (static_cast<double>(coordinate(batch[i], d)) - coordinate(mean, d));
+                });
+            }
+        }
+
+        // Replaces the closest pair of streamed means by their count-weighted average.
+        void merge_closest_streamed_means()
+        {
+            size_t closest_a = 0;
+            size_t closest_b = 1;
+            double closest_distance = DBL_MAX;
+
+            for (size_t a = 0; a < this->streamed_means.size(); a++)
+            {
+                for (size_t b = a + 1; b < this->streamed_means.size(); b++)
+                {
+                    double distance = squared_distance<D>(this->streamed_means[a], this->streamed_means[b]);
+
+                    if (distance < closest_distance)
+                    {
+                        closest_distance = distance;
+                        closest_a = a;
+                        closest_b = b;
+                    }
+                }
+            }
+
+            double weight_a = static_cast<double>(this->streamed_counts[closest_a]);
+            double weight_b = static_cast<double>(this->streamed_counts[closest_b]);
+            auto& mean = this->streamed_means[closest_a];
+
+            for_each_dimension<D>([&](size_t d) {
+                coordinate(mean, d) = (coordinate(mean, d) * weight_a + coordinate(this->streamed_means[closest_b], d) * weight_b) / (weight_a + weight_b);
+            });
+
+            this->streamed_counts[closest_a] += this->streamed_counts[closest_b];
+
+            this->streamed_means.erase(this->streamed_means.begin() + closest_b);
+            this->streamed_counts.erase(this->streamed_counts.begin() + closest_b);
+        }
+
+        // Clusters at the streamed means. They have no observations bound, since none are kept.
+        std::vector<cluster<T, D>> streamed_clusters() const
+        {
+            std::vector<cluster<T, D>> clusters(this->streamed_means.size());
+
+            for (size_t i = 0; i < clusters.size(); i++)
+            {
+                clusters[i].mean = point_cast<T, D>(this->streamed_means[i]);
+                clusters[i].color = cluster_color(i);
+            }
+
+            return clusters;
+        }
+
+        std::vector<cluster<T, D>> iterate(observation_span<T, D> observations, std::vector<cluster<T, D>>& clusters, partitioning_profile& profile) override
+        {
+            std::vector<point<double, D>> means(clusters.size());
+
+            for (size_t i = 0; i < means.size(); i++)
+                means[i] = point_cast<double, D>(clusters[i].mean);
+
+            size_t batch_size = std::min(this->batch_size, observations.size());
+            double smoothing = std::min(1.0, 2.0 * batch_size / (observations.size() + 1));
+
+            std::uniform_int_distribution<size_t> indices_distribution(0, observations.size() - 1);
+            std::vector<point<T, D>> batch(batch_size);
+            std::vector<label_t> batch_labels(batch_size);
+            std::vector<size_t> counts(means.size(), 0);
+
+            double smoothed_inertia = 0;
+            double best_inertia = DBL_MAX;
+            size_t no_improvement = 0;
+
+            profile.stopped_by = stop_reason::max_iterations;
+
+            for (size_t iteration = 0; this->convergence.max_iterations == 0 || iteration < this->convergence.max_iterations; iteration++)
+            {
+                {
+                    phase_timer t(profile, partitioning_phase::assignment);
+
+                    for (auto& observation : batch)
+                        observation = observations[indices_distribution(this->random_engine)];
+
+                    this->means_table.load(means);
+                    this->means_table.nearest(batch.data(), batch.size(), batch_labels.data());
+                }
+
+                double batch_inertia = 0;
+
+                {
+                    phase_timer t(profile, partitioning_phase::update);
+
+                    for (size_t i = 0; i < batch.size(); i++)
+                    {
+                        auto& mean = means[batch_labels[i]];
+
+                        double learning_rate = 1.0 / ++counts[batch_labels[i]];
+
+                        batch_inertia += squared_distance<D>(batch[i], mean);
+
+                        for_each_dimension<D>([&](size_t d) {
+                            coordinate(mean, d) += learning_rate * (static_cast<double>(coordinate(batch[i], d)) - coordinate(mean, d));
+                        });
+                    }
+                }
+
+                profile.distance_evaluations += batch.size() * means.size();
+                profile.record_iteration(batch.size() * means.size(), 0, batch_inertia);
+
+                {
+                    phase_timer t(profile, partitioning_phase::convergence);
+
+                    double mean_inertia = batch_inertia / batch.size();
+                    smoothed_inertia = iteration == 0 ? mean_inertia : smoothed_inertia * (1 - smoothing) + mean_inertia * smoothing;
+
+                    if (smoothed_inertia < best_inertia)
+                    {
+                        best_inertia = smoothed_inertia;
+                        no_improvement = 0;
+                    }
+
+                    else if (++no_improvement >= this->max_no_improvement)
+                        profile.stopped_by = stop_reason::no_improvement;
+                }
+
+                profile.iterations++;
+
+                if (this->on_iteration)
+                {
+                    for (size_t i = 0; i < means.size(); i++)
+                        clusters[i].mean = point_cast<T, D>(means[i]);
+
+                    this->report_iteration(clusters, {});
+                }
+
+                if (this->cancelled)
+                    profile.stopped_by = stop_reason::cancelled;
+
+                if (profile.stopped_by != stop_reason::max_iterations)
+                    break;
+            }
+
+            for (size_t i = 0; i < means.size(); i++)
+                clusters[i].mean = point_cast<T, D>(means[i]);
+
+            auto assignment = std::make_shared<labeling<T, D>>(observations, clusters.size());
+            bind_clusters(clusters, std::shared_ptr<const labeling<T, D>>(assignment));
+
+            size_t evaluations = 0;
+
+            {
+                phase_timer t(profile, partitioning_phase::assignment);
+
+                evaluations = this->assign_observations(clusters, observations, assignment->labels);
+                assignment->group(clusters.size());
+            }
+
+            k_means<T, D>::count_evaluations(profile, evaluations, observations.size() * clusters.size());
+            profile.skipped_distance_evaluations += profile.iterations * (observations.size() - batch_size) * clusters.size();
+
+            return clusters;
+        }
+    };
+
+    // K medoids with FasterPAM: every observation caches its nearest and second nearest medoid,
+    // a swap candidate is scored against all medoids in a single O(N) pass, and the first improving
+    // swap is applied right away. Only swaps that lower the total squared distance are taken, so
+    // dissimilarity() decreases monotonically. Passes may score a random sample of candidates, but
+    // the search only stops as converged once a pass over every observation finds no improving
+    // swap, i.e. at a swap-optimal set of medoids.
+    template <typename T = int32_t, size_t D = 2>
+    struct k_medoids : public k_means<T, D>
+    {
+        // Candidates scored per pass, in random order, until a sampled pass finds no improving
+        // swap; every later pass scores all observations. 0 scores all of them from the start.
+        size_t max_candidates_per_pass = 1024;
+        size_t max_passes = 100;
+
+        // Swaps must improve the total distance by more than this fraction of it, so rounding
+        // noise in the accumulated deltas cannot make two medoids trade places back and forth.
+        static constexpr double SWAP_TOLERANCE = 1e-12;
+
+        std::vector<size_t> medoids;
+
+        std::vector<label_t> nearest;
+        std::vector<label_t> second_nearest;
+        std::vector<double> nearest_distances;
+        std::vector<double> second_nearest_distances;
+
+        std::vector<double> removal_losses;
+        std::vector<std::vector<double>> swap_deltas;
+        std::vector<std::pair<double, size_t>> swap_results;
+
+        k_medoids(size_t threads = 1) : k_means<T, D>(threads)
+        {
+            this->name = "K medoids";
+            this->param_name = "K";
+            this->seeding = seeding_strategy::k_means_plus_plus;
+        }
+
+        static double distance(const point<T, D>& a, const point<T, D>& b)
+        {
+            return squared_distance<D>(a, b);
+        }
+
+        void find_nearest_medoids(observation_span<T, D> observations, size_t index)
+        {
+            double closest_distance = DBL_MAX;
+            double second_distance = DBL_MAX;
+            label_t closest = 0;
+            label_t second = 0;
+
+            for (size_t j = 0; j < this->medoids.size(); j++)
+            {
+                double distance = k_medoids::distance(observations[index], observations[this->medoids[j]]);
+
+                if (distance < closest_distance)
+                {
+                    second_distance = closest_distance;
+                    second = closest;
+                    closest_distance = distance;
+                    closest = static_cast<label_t>(j);
+                }
+
+                else if (distance < second_distance)
+                {
+                    second_distance = distance;
+                    second = static_cast<label_t>(j);
+                }
+            }
+
+            this->nearest[index] = closest;
+            this->second_nearest[index] = second;
+            this->nearest_distances[index] = closest_distance;
+            this->second_nearest_distances[index] = second_distance;
+        }
+
+        // Medoids need observation indices, so every seed is snapped to the closest observation
+        // not already taken by an earlier seed. Warm starts pass means that are not observations.
+        std::vector<size_t> find_medoid_indices(observation_span<T, D> observations, const std::vector<point<T, D>>& seeds)
+        {
+            std::vector<size_t> indices(seeds.size(), 0);
+
+            for (size_t j = 0; j < seeds.size(); j++)
+            {
+                double closest_distance = DBL_MAX;
+
+                for (size_t i = 0; i < observations.size(); i++)
+                {
+                    double distance = k_medoids::distance(observations[i], seeds[j]);
+
+                    if (distance < closest_distance && std::find(indices.begin(), indices.begin() + j, i) == indices.begin() + j)
+                    {
+                        closest_distance = distance;
+                        indices[j] = i;
+                    }
+                }
+            }
+
+            return indices;
+        }
+
+        void compute_removal_losses(size_t observations_amount)
+        {
+            this->removal_losses.assign(this->medoids.size(), 0);
+
+            for (size_t i = 0; i < observations_amount; i++)
+                this->removal_losses[this->nearest[i]] += this->second_nearest_distances[i] - this->nearest_distances[i];
+        }
+
+        // Change of the total distance when `candidate` replaces the best medoid, and that medoid.
+        std::pair<double, size_t> evaluate_swap(observation_span<T, D> observations, size_t candidate, std::vector<double>& swap_deltas)
+        {
+            // A single medoid has no second nearest to fall back on, whose infinite distance would
+            // swamp every delta; all observations simply move to the candidate.
+            if (this->medoids.size() == 1)
+            {
+                double delta = 0;
+
+                for (size_t i = 0; i < observations.size(); i++)
+                    delta += k_medoids::distance(observations[i], observations[candidate]) - this->nearest_distances[i];
+
+                return { delta, 0 };
+            }
+
+            swap_deltas = this->removal_losses;
+            double shared_delta = 0;
+
+            for (size_t i = 0; i < observations.size(); i++)
+            {
+                double distance = k_medoids::distance(observations[i], observations[candidate]);
+
+                if (distance < this->nearest_distances[i])
+                {
+                    shared_delta += distance - this->nearest_distances[i];
+                    swap_deltas[this->nearest[i]] += this->nearest_distances[i] - this->second_nearest_distances[i];
+                }
+
+                else if (distance < this->second_nearest_distances[i])
+                    swap_deltas[this->nearest[i]] += distance - this->second_nearest_distances[i];
+            }
+
+            size_t best = std::min_element(swap_deltas.begin(), swap_deltas.end()) - swap_deltas.begin();
+            return { swap_deltas[best] + shared_delta, best };
+        }
+
+        void apply_swap(observation_span<T, D> observations, size_t candidate, size_t replaced, partitioning_profile& profile)
+        {
+            this->medoids[replaced] = candidate;
+
+            std::vector<size_t> chunk_evaluations((observations.size() + k_means<T, D>::CHUNK_SIZE - 1) / k_means<T, D>::CHUNK_SIZE, 0);
+
+            this->for_each_chunk(observations.size(), [&](size_t chunk, size_t begin, size_t end) {
+                for (size_t i = begin; i < end; i++)
+                {
+                    if (this->nearest[i] == replaced || this->second_nearest[i] == replaced)
+                    {
+                        this->find_nearest_medoids(observations, i);
+                        chunk_evaluations[chunk] += this->medoids.size();
+                        continue;
+                    }
+
+                    double distance = k_medoids::distance(observations[i], observations[candidate]);
+                    chunk_evaluations[chunk]++;
+
+                    if (distance < this->nearest_distances[i])
+                    {
+                        this->second_nearest[i] = this->nearest[i];
+                        this->second_nearest_distances[i] = this->nearest_distances[i];
+                        this->nearest[i] = static_cast<label_t>(replaced);
+                        this->nearest_distances[i] = distance;
+                    }
+
+                    else if (distance < this->second_nearest_distances[i])
+                    {
+                        this->second_nearest[i] = static_cast<label_t>(replaced);
+                        this->second_nearest_distances[i] = distance;
+                    }
+                }
+            });
+
+            for (size_t evaluations : chunk_evaluations)
+                profile.distance_evaluations += evaluations;
+
+            this->compute_removal_losses(observations.size());
+        }
+
+        // Medoids are chosen by unweighted distances, so weights are ignored.
+        std::vector<cluster<T, D>> partition_weighted(
+            observation_span<T, D> observations,
+            const std::vector<double>&,
+            partitioning_profile& profile
+        ) override
+        {
+            return this->partition(observations, profile);
+        }
+
+        // Snaps the means the clusters start with to medoids and runs the swap search from there.
+        std::vector<cluster<T, D>> iterate(observation_span<T, D> observations, std::vector<cluster<T, D>>& clusters, partitioning_profile& profile) override
+        {
+            std::vector<point<T, D>> seeds(clusters.size());
+
+            for (size_t i = 0; i < clusters.size(); i++)
+                seeds[i] = clusters[i].mean;
+
+            {
+                phase_timer t(profile, partitioning_phase::assignment);
+
+                this->medoids = std::move(this->find_medoid_indices(observations, seeds));
+
+                this->nearest.resize(observations.size());
+                this->second_nearest.resize(observations.size());
+                this->nearest_distances.resize(observations.size());
+                this->second_nearest_distances.resize(observations.size());
+
+                this->for_each_chunk(observations.size(), [&](size_t, size_t begin, size_t end) {
+                    for (size_t i = begin; i < end; i++)
+                        this->find_nearest_medoids(observations, i);
+                });
+
+                profile.distance_evaluations += observations.size() * (seeds.size() + this->medoids.size());
+
+                this->compute_removal_losses(observations.size());
+            }
+
+            double total_distance = std::accumulate(this->nearest_distances.begin(), this->nearest_distances.end(), 0.0);
+
+            std::vector<size_t> candidates(observations.size());
+            std::iota(candidates.begin(), candidates.end(), 0);
+
+            size_t candidates_per_pass = this->max_candidates_per_pass == 0
+                ? candidates.size()
+                : std::min(this->max_candidates_per_pass, candidates.size());
+
+            bool full_pass = candidates_per_pass == candidates.size();
+
+            // With a thread pool, a batch of candidates is scored against the same medoids at once.
+            // Only the first improving one is applied and the rest are rescored afterwards, so the
+            // swaps taken are the same as scoring one candidate at a time.
+            size_t batch_size = this->threads() == 1 ? 1 : this->threads() * 2;
+
+            this->swap_deltas.resize(batch_size);
+            this->swap_results.resize(batch_size);
+
+            profile.stopped_by = stop_reason::max_iterations;
+
+            for (size_t pass = 0; pass < this->max_passes; pass++)
+            {
+                bool swapped = false;
+                size_t evaluations = profile.distance_evaluations;
+
+                std::shuffle(candidates.begin(), candidates.end(), this->random_engine);
+
+                phase_timer t(profile, partitioning_phase::update);
+                this->previous_labels = this->nearest;
+
+                for (size_t c = 0; c < candidates_per_pass && !this->cancelled;)
+                {
+                    size_t batch_end = std::min(c + batch_size, candidates_per_pass);
+
+                    auto score = [&](size_t slot) {
+                        size_t candidate = candidates[c + slot];
+
+                        this->swap_results[slot] = this->nearest_distances[candidate] == 0
+                            ? std::pair<double, size_t>{ 0, 0 }
+                            : this->evaluate_swap(observations, candidate, this->swap_deltas[slot]);
+                    };
+
+                    if (this->pool)
+                        this->pool->run(batch_end - c, score);
+
+                    else for (size_t slot = 0; slot < batch_end - c; slot++)
+                        score(slot);
+
+                    size_t next = batch_end;
+
+                    for (size_t slot = 0; slot < batch_end - c; slot++)
+                    {
+                        profile.distance_evaluations += observations.size();
+
+                        auto [delta, replaced] = this->swap_results[slot];
+
+                        if (delta < -SWAP_TOLERANCE * total_distance)
+                        {
+                            this->apply_swap(observations, candidates[c + slot], replaced, profile);
+                            total_distance += delta;
+
+                            swapped = true;
+                            next = c + slot + 1;
+                            break;
+                        }
+                    }
+
+                    c = next;
+                }
+
+                profile.record_iteration(profile.distance_evaluations - evaluations, this->count_reassigned(this->nearest), total_distance);
+                profile.iterations++;
+
+                if (this->on_iteration)
+                {
+                    for (size_t i = 0; i < this->medoids.size(); i++)
+                        clusters[i].mean = observations[this->medoids[i]];
+
+                    this->report_iteration(clusters, this->nearest);
+                }
+
+                if (this->cancelled || (!swapped && full_pass))
+                {
+                    profile.stopped_by = this->cancelled ? stop_reason::cancelled : stop_reason::converged;
+                    break;
+                }
+
+                // A sample without improving swaps says little about the remaining candidates.
+                if (!swapped)
+                {
+                    full_pass = true;
+                    candidates_per_pass = candidates.size();
+                }
+            }
+
+            for (size_t i = 0; i < this->medoids.size(); i++)
+                clusters[i].mean = observations[this->medoids[i]];
+
+            auto assignment = std::make_shared<labeling<T, D>>(observations, clusters.size());
+            assignment->labels = this->nearest;
+            assignment->group(clusters.size());
+
+            bind_clusters(clusters, std::shared_ptr<const labeling<T, D>>(assignment));
             return clusters;
         }
     };
-}
\ No newline at end of file
+}
@@ -0,0 +1,503 @@
+#pragma once
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <functional>
+#include <memory>
+#include <numeric>
+#include <vector>
+#include "cluster.h"
+#include "nearest_mean.h"
+#include "thread_pool.h"
+
+namespace ntf::cluster
+{
+    enum class k_criterion
+    {
+        // The K farthest below the chord joining the ends of the log inertia curve.
+        elbow,
+
+        // The K with the highest mean silhouette over the sampled observations.
+        silhouette,
+
+        // The smallest K whose gap is within one standard error of the next one's.
+        gap,
+    };
+
+    struct k_score
+    {
+        size_t k = 0;
+        double inertia = 0;
+        double silhouette = 0;
+
+        // log W*_k of the uniform reference datasets minus log W_k of the sampled observations,
+        // with the standard error of the reference term.
+        double gap = 0;
+        double gap_error = 0;
+    };
+
+    // Partitions for every K in [min_k, param] and returns the clustering of the K the criterion
+    // recommends, keeping every score. The range is cut into one contiguous segment per thread,
+    // balanced by K, and each segment warm starts K + 1 from the clustering of K through the
+    // sweeping partitioner's repartition. Silhouettes and the gap statistic only look at samples,
+    // so scoring costs the same whatever the size of the dataset.
+    template <typename T = int32_t, size_t D = 2>
+    struct k_selection : public partitioner<T, D>
+    {
+        using sweeper_factory = std::function<std::shared_ptr<partitioner<T, D>>()>;
+
+        k_criterion criterion = k_criterion::silhouette;
+        size_t min_k = 2;
+
+        size_t silhouette_sample = 1000;
+        size_t gap_sample = 2000;
+        size_t reference_datasets = 4;
+
+        // Outcome of the last partition, one score per K from min_k.
+        std::vector<k_score> scores;
+        size_t elbow_k = 0;
+        size_t silhouette_k = 0;
+        size_t gap_k = 0;
+        size_t recommended_k = 0;
+
+    private:
+        struct segment
+        {
+            size_t k_begin = 0;
+            size_t k_end = 0;
+            partitioning_profile profile;
+        };
+
+        std::vector<std::shared_ptr<partitioner<T, D>>> sweepers;
+        std::unique_ptr<thread_pool> pool;
+
+        std::vector<point<T, D>> sample;
+        std::vector<double> sample_distances;
+        std::vector<std::vector<point<T, D>>> references;
+        std::vector<std::vector<point<T, D>>> means;
+
+        void draw_samples(observation_span<T, D> observations)
+        {
+            size_t amount = std::min(std::max(this->silhouette_sample, this->gap_sample), observations.size());
+
+            std::vector<size_t> indices(observations.size());
+            std::iota(indices.begin(), indices.end(), 0);
+
+            for (size_t i = 0; i < amount; i++)
+            {
+                std::uniform_int_distribution<size_t> distribution(i, indices.size() - 1);
+                std::swap(indices[i], indices[distribution(this->random_engine)]);
+            }
+
+            this->sample.resize(amount);
+
+            for (size_t i = 0; i < amount; i++)
+                this->sample[i] = observations[indices[i]];
+
+            size_t silhouette_amount = std::min(this->silhouette_sample, amount);
+
+            this->sample_distances.assign(silhouette_amount * silhouette_amount, 0);
+
+            for (size_t i = 0; i < silhouette_amount; i++)
+            {
+                for (size_t j = i + 1; j < silhouette_amount; j++)
+                {
+                    double distance = std::sqrt(squared_distance<D>(this->sample[i], this->sample[j]));
+
+                    this->sample_distances[i * silhouette_amount + j] = distance;
+                    this->sample_distances[j * silhouette_amount + i] = distance;
+                }
+            }
+        }
+
+        // Uniform over the bounding box of the observations, the null model of the gap statistic.
+        void draw_references(observation_span<T, D> observations)
+        {
+            point<double, D> lower{};
+            point<double, D> upper{};
+
+            for_each_dimension<D>([&](size_t d) {
+                coordinate(lower, d) = DBL_MAX;
+                coordinate(upper, d) = -DBL_MAX;
+            });
+
+            for (auto& observation : observations)
+            {
+                for_each_dimension<D>([&](size_t d) {
+                    double value = static_cast<double>(coordinate(observation, d));
+
+                    coordinate(lower, d) = std::min(coordinate(lower, d), value);
+                    coordinate(upper, d) = std::max(coordinate(upper, d), value);
+                });
+            }
+
+            size_t amount = std::min(this->gap_sample, observations.size());
+
+            this->references.assign(this->reference_datasets, std::vector<point<T, D>>(amount));
+
+            for (auto& reference : this->references)
+            {
+                for (auto& observation : reference)
+                {
+                    for_each_dimension<D>([&](size_t d) {
+                        std::uniform_real_distribution<double> distribution(coordinate(lower, d), coordinate(upper, d));
+                        coordinate(observation, d) = to_coordinate<T>(distribution(this->random_engine));
+                    });
+                }
+            }
+        }
+
+        // Contiguous K ranges of about equal total K, since a partition costs about K times as
+        // much as one with a single mean.
+        std::vector<segment> make_segments(size_t k_begin, size_t k_end) const
+        {
+            size_t segments_amount = std::min(this->sweepers.size(), k_end - k_begin);
+            size_t total = 0;
+
+            for (size_t k = k_begin; k < k_end; k++)
+                total += k;
+
+            std::vector<segment> segments;
+            size_t accumulated = 0;
+            size_t begin = k_begin;
+
+            for (size_t k = k_begin; k < k_end; k++)
+            {
+                accumulated += k;
+
+                bool last = segments.size() + 1 == segments_amount;
+                bool filled = accumulated * segments_amount >= total * (segments.size() + 1);
+
+                if (k + 1 == k_end || (!last && filled))
+                {
+                    segments.push_back({ begin, k + 1, {} });
+                    begin = k + 1;
+                }
+            }
+
+            return segments;
+        }
+
+        static std::vector<label_t> nearest_labels(const std::vector<point<T, D>>& sample, size_t amount, const std::vector<point<T, D>>& means)
+        {
+            std::vector<label_t> labels(amount);
+
+            for (size_t i = 0; i < amount; i++)
+            {
+                double closest_distance = DBL_MAX;
+
+                for (size_t j = 0; j < means.size(); j++)
+                {
+                    double distance = squared_distance<D>(sample[i], means[j]);
+
+                    if (distance < closest_distance)
+                    {
+                        closest_distance = distance;
+                        labels[i] = static_cast<label_t>(j);
+                    }
+                }
+            }
+
+            return labels;
+        }
+
+        double sampled_silhouette(const std::vector<point<T, D>>& means) const
+        {
+            size_t amount = std::min(this->silhouette_sample, this->sample.size());
+
+            if (means.size() < 2 || amount < 2)
+                return 0;
+
+            std::vector<label_t> labels = nearest_labels(this->sample, amount, means);
+            std::vector<double> distance_sums(means.size());
+            std::vector<size_t> counts(means.size());
+
+            double result = 0;
+
+            for (size_t i = 0; i < amount; i++)
+            {
+                std::fill(distance_sums.begin(), distance_sums.end(), 0);
+                std::fill(counts.begin(), counts.end(), 0);
+
+                for (size_t j = 0; j < amount; j++)
+                {
+                    if (j == i)
+                        continue;
+
+                    distance_sums[labels[j]] += this->sample_distances[i * amount + j];
+                    counts[labels[j]]++;
+                }
+
+                if (counts[labels[i]] == 0)
+                    continue;
+
+                double cohesion = distance_sums[labels[i]] / counts[labels[i]];
+                double separation = DBL_MAX;
+
+                for (size_t c = 0; c < means.size(); c++)
+                {
+                    if (c != labels[i] && counts[c] > 0)
+                        separation = std::min(separation, distance_sums[c] / counts[c]);
+                }
+
+                if (separation < DBL_MAX)
+                    result += (separation - cohesion) / std::max(separation, cohesion);
+            }
+
+            return result / amount;
+        }
+
+        static double log_dispersion(double dispersion)
+        {
+            return std::log(std::max(dispersion, DBL_MIN));
+        }
+
+        // Dispersion of the gap sample around means, comparable to that of a reference dataset.
+        double sampled_dispersion(const std::vector<point<T, D>>& means) const
+        {
+            size_t amount = std::min(this->gap_sample, this->sample.size());
+            std::vector<label_t> labels = nearest_labels(this->sample, amount, means);
+
+            double result = 0;
+
+            for (size_t i = 0; i < amount; i++)
+                result += squared_distance<D>(this->sample[i], means[labels[i]]);
+
+            return result;
+        }
+
+        void sweep(partitioner<T, D>& sweeper, observation_span<T, D> observations, size_t k_first, segment& range)
+        {
+            std::vector<cluster<T, D>> clusters;
+            std::vector<std::vector<cluster<T, D>>> reference_clusters(this->references.size());
+
+            auto run = [&](observation_span<T, D> dataset, std::vector<cluster<T, D>>& previous) {
+                partitioning_profile profile;
+
+                previous = previous.empty()
+                    ? sweeper.partition(dataset, profile)
+                    : sweeper.repartition(dataset, previous, profile);
+
+                for (size_t i = 0; i < PARTITIONING_PHASES_AMOUNT; i++)
+                    range.profile.phase_times[i] += profile.phase_times[i];
+
+                range.profile.iterations += profile.iterations;
+                range.profile.distance_evaluations += profile.distance_evaluations;
+                range.profile.skipped_distance_evaluations += profile.skipped_distance_evaluations;
+                range.profile.reassigned_observations += profile.reassigned_observations;
+                range.profile.repaired_clusters += profile.repaired_clusters;
+            };
+
+            for (size_t k = range.k_begin; k < range.k_end && !this->cancelled; k++)
+            {
+                auto& score = this->scores[k - k_first];
+                auto& means = this->means[k - k_first];
+
+                sweeper.param = static_cast<uint8_t>(k);
+                run(observations, clusters);
+
+                means.resize(clusters.size());
+
+                for (size_t i = 0; i < clusters.size(); i++)
+                    means[i] = clusters[i].mean;
+
+                score.inertia = dissimilarity(clusters);
+                score.silhouette = this->sampled_silhouette(means);
+
+                if (this->references.empty())
+                    continue;
+
+                std::vector<double> reference_logs(this->references.size());
+
+                for (size_t b = 0; b < this->references.size(); b++)
+                {
+                    run(this->references[b], reference_clusters[b]);
+                    reference_logs[b] = log_dispersion(dissimilarity(reference_clusters[b]));
+                }
+
+                double mean_log = std::accumulate(reference_logs.begin(), reference_logs.end(), 0.0) / reference_logs.size();
+                double variance = 0;
+
+                for (double reference_log : reference_logs)
+                    variance += (reference_log - mean_log) * (reference_log - mean_log) / reference_logs.size();
+
+                score.gap = mean_log - log_dispersion(this->sampled_dispersion(means));
+                score.gap_error = std::sqrt(variance) * std::sqrt(1 + 1.0 / reference_logs.size());
+            }
+        }
+
+        void recommend()
+        {
+            auto& scores = this->scores;
+
+            this->silhouette_k = scores.front().k;
+            this->gap_k = scores.back().k;
+            this->elbow_k = scores.front().k;
+
+            for (auto& score : scores)
+            {
+                if (score.silhouette > scores[this->silhouette_k - scores.front().k].silhouette)
+                    this->silhouette_k = score.k;
+            }
+
+            for (size_t i = 0; i + 1 < scores.size(); i++)
+            {
+                if (scores[i].gap >= scores[i + 1].gap - scores[i + 1].gap_error)
+                {
+                    this->gap_k = scores[i].k;
+                    break;
+                }
+            }
+
+            double first = log_dispersion(scores.front().inertia);
+            double last = log_dispersion(scores.back().inertia);
+            double farthest = 0;
+
+            for (size_t i = 1; i + 1 < scores.size(); i++)
+            {
+                double chord = first + (last - first) * i / (scores.size() - 1);
+                double below = chord - log_dispersion(scores[i].inertia);
+
+                if (below > farthest)
+                {
+                    farthest = below;
+                    this->elbow_k = scores[i].k;
+                }
+            }
+
+            switch (this->criterion)
+            {
+            case k_criterion::elbow:
+                this->recommended_k = this->elbow_k;
+                break;
+
+            case k_criterion::gap:
+                this->recommended_k = this->gap_k;
+                break;
+
+            default:
+                this->recommended_k = this->silhouette_k;
+                break;
+            }
+        }
+
+        std::vector<cluster<T, D>> assign(observation_span<T, D> observations, const std::vector<point<T, D>>& means) const
+        {
+            std::vector<cluster<T, D>> clusters(means.size());
+
+            for (size_t i = 0; i < means.size(); i++)
+            {
+                clusters[i].mean = means[i];
+                clusters[i].color = cluster_color(i);
+            }
+
+            auto assignment = std::make_shared<labeling<T, D>>(observations, means.size());
+
+            mean_table<D> table;
+            table.load(means);
+            table.nearest(observations.data(), observations.size(), assignment->labels.data());
+
+            assignment->group(means.size());
+            bind_clusters(clusters, std::shared_ptr<const labeling<T, D>>(assignment));
+
+            return clusters;
+        }
+
+    public:
+        // Each thread sweeps its segment with a partitioner of its own from make_sweeper.
+        k_selection(const sweeper_factory& make_sweeper, size_t threads = 1)
+        {
+            for (size_t i = 0; i < std::max<size_t>(threads, 1); i++)
+                this->sweepers.push_back(make_sweeper());
+
+            if (threads > 1)
+                this->pool = std::make_unique<thread_pool>(threads);
+
+            this->name = "K selection (" + this->sweepers.front()->name + ")";
+            this->param_name = "Max K";
+        }
+
+        std::vector<cluster<T, D>> partition(observation_span<T, D> observations, partitioning_profile& profile = {}) override
+        {
+            profile.reset();
+            timer t(profile.elapsed_time);
+            allocation_counter a(profile.heap_allocations);
+
+            this->scores.clear();
+            this->means.clear();
+            this->elbow_k = 0;
+            this->silhouette_k = 0;
+            this->gap_k = 0;
+            this->recommended_k = 0;
+
+            if (observations.empty())
+                return {};
+
+            size_t k_end = std::min<size_t>(this->param, observations.size()) + 1;
+            size_t k_first = std::clamp<size_t>(this->min_k, 1, k_end - 1);
+
+            this->scores.assign(k_end - k_first, {});
+            this->means.assign(k_end - k_first, {});
+
+            for (size_t k = k_first; k < k_end; k++)
+                this->scores[k - k_first].k = k;
+
+            {
+                phase_timer t(profile, partitioning_phase::seeding);
+
+                this->draw_samples(observations);
+                this->draw_references(observations);
+            }
+
+            std::vector<segment> segments = this->make_segments(k_first, k_end);
+
+            for (size_t s = 0; s < segments.size(); s++)
+            {
+                auto& sweeper = *this->sweepers[s];
+
+                sweeper.seed(this->random_engine());
+                sweeper.index = this->index;
+                sweeper.cancelled = false;
+
+                sweeper.on_iteration = [this, &sweeper](const std::vector<cluster<T, D>>&, const std::vector<label_t>&) {
+                    if (this->cancelled)
+                        sweeper.cancelled = true;
+                };
+            }
+
+            auto run_segment = [&](size_t s) {
+                this->sweep(*this->sweepers[s], observations, k_first, segments[s]);
+            };
+
+            if (this->pool)
+                this->pool->run(segments.size(), run_segment);
+
+            else for (size_t s = 0; s < segments.size(); s++)
+                run_segment(s);
+
+            for (auto& range : segments)
+            {
+                for (size_t i = 0; i < PARTITIONING_PHASES_AMOUNT; i++)
+                    profile.phase_times[i] += range.profile.phase_times[i];
+
+                profile.iterations += range.profile.iterations;
+                profile.distance_evaluations += range.profile.distance_evaluations;
+                profile.skipped_distance_evaluations += range.profile.skipped_distance_evaluations;
+                profile.reassigned_observations += range.profile.reassigned_observations;
+                profile.repaired_clusters += range.profile.repaired_clusters;
+            }
+
+            if (this->cancelled)
+            {
+                profile.stopped_by = stop_reason::cancelled;
+                return {};
+            }
+
+            this->recommend();
+            profile.stopped_by = stop_reason::converged;
+
+            phase_timer p(profile, partitioning_phase::assignment);
+            return this->assign(observations, this->means[this->recommended_k - k_first]);
+        }
+    };
+}
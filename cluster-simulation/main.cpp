@@ -1,12 +1,35 @@
 #include <cassert>
+#include "birch.h"
+#include "coreset.h"
+#include "dbscan.h"
+#include "ensemble.h"
+#include "k_selection.h"
 #include "k_means.h"
 #include "simulator.h"
 
 int main()
 {
     std::vector<std::shared_ptr<ntf::cluster::partitioner<int>>> partitioners{
-        std::make_shared<ntf::cluster::k_means<>>(),
-        std::make_shared<ntf::cluster::k_medoids<>>(),
+        std::make_shared<ntf::cluster::k_means<>>(std::thread::hardware_concurrency()),
+        std::make_shared<ntf::cluster::hamerly_k_means<>>(std::thread::hardware_concurrency()),
+        std::make_shared<ntf::cluster::mini_batch_k_means<>>(std::thread::hardware_concurrency()),
+        std::make_shared<ntf::cluster::k_medoids<>>(std::thread::hardware_concurrency()),
+        std::make_shared<ntf::cluster::birch<>>(std::thread::hardware_concurrency()),
+        std::make_shared<ntf::cluster::dbscan<>>(std::thread::hardware_concurrency()),
+        std::make_shared<ntf::cluster::coreset_partitioner<>>(
+            std::make_shared<ntf::cluster::k_means<>>(),
+            1024,
+            std::thread::hardware_concurrency()
+        ),
+        std::make_shared<ntf::cluster::ensemble_partitioner<>>(
+            [] { return std::make_shared<ntf::cluster::k_means<>>(); },
+            8,
+            std::thread::hardware_concurrency()
+        ),
+        std::make_shared<ntf::cluster::k_selection<>>(
+            [] { return std::make_shared<ntf::cluster::k_means<>>(); },
+            std::thread::hardware_concurrency()
+        ),
     };
 
     std::shared_ptr<ntf::screen> simulator(std::make_shared<ntf::cluster::simulator>(partitioners));
@@ -0,0 +1,367 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include "cluster.h"
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#include <immintrin.h>
+#define NTF_CLUSTER_X86 1
+#define NTF_CLUSTER_TARGET(features)
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define NTF_CLUSTER_X86 1
+#define NTF_CLUSTER_TARGET(features) __attribute__((target(features)))
+#endif
+
+namespace ntf::cluster
+{
+    // Observations are converted to SoA doubles and labeled in blocks of this size.
+    constexpr size_t OBSERVATIONS_BLOCK = 256;
+
+    // Writes the index of the first mean with the smallest squared distance to every point.
+    using nearest_mean_kernel = void (*)(
+        const double* means_x,
+        const double* means_y,
+        size_t means_amount,
+        const double* points_x,
+        const double* points_y,
+        size_t points_amount,
+        label_t* labels
+    );
+
+    inline void nearest_mean_scalar(
+        const double* means_x,
+        const double* means_y,
+        size_t means_amount,
+        const double* points_x,
+        const double* points_y,
+        size_t points_amount,
+        label_t* labels
+    )
+    {
+        for (size_t i = 0; i < points_amount; i++)
+        {
+            double closest_distance = std::numeric_limits<double>::infinity();
+            size_t closest_index = 0;
+
+            for (size_t j = 0; j < means_amount; j++)
+            {
+                double dx = points_x[i] - means_x[j];
+                double dy = points_y[i] - means_y[j];
+                double distance = dx * dx + dy * dy;
+
+                if (distance < closest_distance)
+                {
+                    closest_distance = distance;
+                    closest_index = j;
+                }
+            }
+
+            labels[i] = static_cast<label_t>(closest_index);
+        }
+    }
+
+#ifdef NTF_CLUSTER_X86
+    // The vector kernels label 8 points per pass and walk the means in order, keeping the running
+    // minimum per lane with a strict compare-and-blend, so ties resolve exactly like the scalar loop.
+
+    NTF_CLUSTER_TARGET("sse4.1")
+    inline void nearest_mean_sse41(
+        const double* means_x,
+        const double* means_y,
+        size_t means_amount,
+        const double* points_x,
+        const double* points_y,
+        size_t points_amount,
+        label_t* labels
+    )
+    {
+        size_t i = 0;
+
+        for (; i + 8 <= points_amount; i += 8)
+        {
+            __m128d px[4];
+            __m128d py[4];
+            __m128d best_distance[4];
+            __m128d best_index[4];
+
+            for (int lane = 0; lane < 4; lane++)
+            {
+                px[lane] = _mm_loadu_pd(points_x + i + lane * 2);
+                py[lane] = _mm_loadu_pd(points_y + i + lane * 2);
+                best_distance[lane] = _mm_set1_pd(std::numeric_limits<double>::infinity());
+                best_index[lane] = _mm_setzero_pd();
+            }
+
+            for (size_t j = 0; j < means_amount; j++)
+            {
+                const __m128d mx = _mm_set1_pd(means_x[j]);
+                const __m128d my = _mm_set1_pd(means_y[j]);
+                const __m128d index = _mm_set1_pd(static_cast<double>(j));
+
+                for (int lane = 0; lane < 4; lane++)
+                {
+                    __m128d dx = _mm_sub_pd(px[lane], mx);
+                    __m128d dy = _mm_sub_pd(py[lane], my);
+                    __m128d distance = _mm_add_pd(_mm_mul_pd(dx, dx), _mm_mul_pd(dy, dy));
+                    __m128d closer = _mm_cmplt_pd(distance, best_distance[lane]);
+
+                    best_distance[lane] = _mm_blendv_pd(best_distance[lane], distance, closer);
+                    best_index[lane] = _mm_blendv_pd(best_index[lane], index, closer);
+                }
+            }
+
+            for (int lane = 0; lane < 4; lane++)
+                _mm_storel_epi64(reinterpret_cast<__m128i*>(labels + i + lane * 2), _mm_cvtpd_epi32(best_index[lane]));
+        }
+
+        nearest_mean_scalar(means_x, means_y, means_amount, points_x + i, points_y + i, points_amount - i, labels + i);
+    }
+
+    NTF_CLUSTER_TARGET("avx2")
+    inline void nearest_mean_avx2(
+        const double* means_x,
+        const double* means_y,
+        size_t means_amount,
+        const double* points_x,
+        const double* points_y,
+        size_t points_amount,
+        label_t* labels
+    )
+    {
+        size_t i = 0;
+
+        for (; i + 8 <= points_amount; i += 8)
+        {
+            __m256d px[2] = { _mm256_loadu_pd(points_x + i), _mm256_loadu_pd(points_x + i + 4) };
+            __m256d py[2] = { _mm256_loadu_pd(points_y + i), _mm256_loadu_pd(points_y + i + 4) };
+            __m256d best_distance[2] = { _mm256_set1_pd(std::numeric_limits<double>::infinity()), _mm256_set1_pd(std::numeric_limits<double>::infinity()) };
+            __m256d best_index[2] = { _mm256_setzero_pd(), _mm256_setzero_pd() };
+
+            for (size_t j = 0; j < means_amount; j++)
+            {
+                const __m256d mx = _mm256_set1_pd(means_x[j]);
+                const __m256d my = _mm256_set1_pd(means_y[j]);
+                const __m256d index = _mm256_set1_pd(static_cast<double>(j));
+
+                for (int lane = 0; lane < 2; lane++)
+                {
+                    __m256d dx = _mm256_sub_pd(px[lane], mx);
+                    __m256d dy = _mm256_sub_pd(py[lane], my);
+                    __m256d distance = _mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy));
+                    __m256d closer = _mm256_cmp_pd(distance, best_distance[lane], _CMP_LT_OQ);
+
+                    best_distance[lane] = _mm256_blendv_pd(best_distance[lane], distance, closer);
+                    best_index[lane] = _mm256_blendv_pd(best_index[lane], index, closer);
+                }
+            }
+
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(labels + i), _mm256_cvtpd_epi32(best_index[0]));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(labels + i + 4), _mm256_cvtpd_epi32(best_index[1]));
+        }
+
+        nearest_mean_scalar(means_x, means_y, means_amount, points_x + i, points_y + i, points_amount - i, labels + i);
+    }
+
+    inline bool cpu_supports_sse41()
+    {
+#if defined(_MSC_VER)
+        int info[4];
+        __cpuid(info, 1);
+
+        return (info[2] & (1 << 19)) != 0;
+#else
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("sse4.1");
+#endif
+    }
+
+    inline bool cpu_supports_avx2()
+    {
+#if defined(_MSC_VER)
+        int info[4];
+        __cpuid(info, 1);
+
+        bool osxsave = (info[2] & (1 << 27)) != 0;
+        bool avx = (info[2] & (1 << 28)) != 0;
+
+        if (!osxsave || !avx || (_xgetbv(0) & 0x6) != 0x6)
+            return false;
+
+        __cpuidex(info, 7, 0);
+        return (info[1] & (1 << 5)) != 0;
+#else
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+#endif
+    }
+#endif
+
+    inline nearest_mean_kernel select_nearest_mean_kernel()
+    {
+#ifdef NTF_CLUSTER_X86
+        if (cpu_supports_avx2())
+            return nearest_mean_avx2;
+
+        if (cpu_supports_sse41())
+            return nearest_mean_sse41;
+#endif
+        return nearest_mean_scalar;
+    }
+
+    // Means of D coordinates stored row by row. The distance loop runs over the compile-time
+    // dimension, so it unrolls and vectorizes for every instantiation.
+    template <size_t D = 2>
+    struct mean_table
+    {
+        std::vector<double> coordinates;
+
+        size_t size() const
+        {
+            return this->coordinates.size() / D;
+        }
+
+        template <typename T>
+        void load(const std::vector<vnd<T, D>>& means)
+        {
+            this->coordinates.resize(means.size() * D);
+
+            for (size_t i = 0; i < means.size(); i++)
+            {
+                for (size_t d = 0; d < D; d++)
+                    this->coordinates[i * D + d] = static_cast<double>(means[i][d]);
+            }
+        }
+
+        template <typename T>
+        void load(const std::vector<cluster<T, D>>& clusters)
+        {
+            this->coordinates.resize(clusters.size() * D);
+
+            for (size_t i = 0; i < clusters.size(); i++)
+            {
+                for (size_t d = 0; d < D; d++)
+                    this->coordinates[i * D + d] = static_cast<double>(clusters[i].mean[d]);
+            }
+        }
+
+        template <typename T>
+        void nearest(const vnd<T, D>* observations, size_t amount, label_t* labels) const
+        {
+            size_t means_amount = this->size();
+
+            for (size_t i = 0; i < amount; i++)
+            {
+                double point[D];
+
+                for (size_t d = 0; d < D; d++)
+                    point[d] = static_cast<double>(observations[i][d]);
+
+                double closest_distance = std::numeric_limits<double>::infinity();
+                label_t closest = 0;
+
+                for (size_t j = 0; j < means_amount; j++)
+                {
+                    const double* mean = this->coordinates.data() + j * D;
+                    double distance = 0;
+
+                    for (size_t d = 0; d < D; d++)
+                        distance += (point[d] - mean[d]) * (point[d] - mean[d]);
+
+                    if (distance < closest_distance)
+                    {
+                        closest_distance = distance;
+                        closest = static_cast<label_t>(j);
+                    }
+                }
+
+                labels[i] = closest;
+            }
+        }
+
+        template <typename T>
+        label_t nearest(const vnd<T, D>& observation) const
+        {
+            label_t label = 0;
+            this->nearest(&observation, 1, &label);
+
+            return label;
+        }
+    };
+
+    // Two dimensions keep the means in structure-of-arrays layout for the best nearest-mean
+    // kernel this CPU supports.
+    template <>
+    struct mean_table<2>
+    {
+        std::vector<double> x;
+        std::vector<double> y;
+
+        nearest_mean_kernel kernel = nullptr;
+
+        mean_table()
+        {
+            static const nearest_mean_kernel selected = select_nearest_mean_kernel();
+            this->kernel = selected;
+        }
+
+        template <typename T>
+        void load(const std::vector<v2d<T>>& means)
+        {
+            this->x.resize(means.size());
+            this->y.resize(means.size());
+
+            for (size_t i = 0; i < means.size(); i++)
+            {
+                this->x[i] = static_cast<double>(means[i].x);
+                this->y[i] = static_cast<double>(means[i].y);
+            }
+        }
+
+        template <typename T>
+        void load(const std::vector<cluster<T>>& clusters)
+        {
+            this->x.resize(clusters.size());
+            this->y.resize(clusters.size());
+
+            for (size_t i = 0; i < clusters.size(); i++)
+            {
+                this->x[i] = static_cast<double>(clusters[i].mean.x);
+                this->y[i] = static_cast<double>(clusters[i].mean.y);
+            }
+        }
+
+        template <typename T>
+        void nearest(const v2d<T>* observations, size_t amount, label_t* labels) const
+        {
+            alignas(32) double points_x[OBSERVATIONS_BLOCK];
+            alignas(32) double points_y[OBSERVATIONS_BLOCK];
+
+            for (size_t begin = 0; begin < amount; begin += OBSERVATIONS_BLOCK)
+            {
+                size_t block_size = std::min(OBSERVATIONS_BLOCK, amount - begin);
+
+                for (size_t i = 0; i < block_size; i++)
+                {
+                    points_x[i] = static_cast<double>(observations[begin + i].x);
+                    points_y[i] = static_cast<double>(observations[begin + i].y);
+                }
+
+                this->kernel(this->x.data(), this->y.data(), this->x.size(), points_x, points_y, block_size, labels + begin);
+            }
+        }
+
+        template <typename T>
+        label_t nearest(const v2d<T>& observation) const
+        {
+            label_t label = 0;
+            this->nearest(&observation, 1, &label);
+
+            return label;
+        }
+    };
+}
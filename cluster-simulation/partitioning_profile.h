@@ -0,0 +1,269 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include "timer.h"
+
+namespace ntf::cluster
+{
+    enum class partitioning_phase
+    {
+        seeding,
+        assignment,
+        update,
+        convergence,
+        empty_clusters,
+    };
+
+    constexpr size_t PARTITIONING_PHASES_AMOUNT = 5;
+
+    inline const char* phase_name(partitioning_phase phase)
+    {
+        switch (phase)
+        {
+        case partitioning_phase::seeding:
+            return "seeding";
+
+        case partitioning_phase::assignment:
+            return "assignment";
+
+        case partitioning_phase::update:
+            return "update";
+
+        case partitioning_phase::convergence:
+            return "convergence";
+
+        default:
+            return "empty_clusters";
+        }
+    }
+
+    // What ended a partition's iterations.
+    enum class stop_reason
+    {
+        none,
+        converged,
+        mean_shift,
+        inertia_change,
+        max_iterations,
+        no_improvement,
+        cancelled,
+    };
+
+    inline const char* stop_reason_name(stop_reason reason)
+    {
+        switch (reason)
+        {
+        case stop_reason::converged:
+            return "converged";
+
+        case stop_reason::mean_shift:
+            return "mean_shift";
+
+        case stop_reason::inertia_change:
+            return "inertia_change";
+
+        case stop_reason::max_iterations:
+            return "max_iterations";
+
+        case stop_reason::no_improvement:
+            return "no_improvement";
+
+        case stop_reason::cancelled:
+            return "cancelled";
+
+        default:
+            return "none";
+        }
+    }
+
+    // Incremented by a replacement operator new when the program installs one (the benchmark
+    // does); partitioning profiles report how much it grew while they were recorded. The counter
+    // is process-wide, so it includes allocations of any thread running meanwhile.
+    inline std::atomic<size_t> heap_allocations{ 0 };
+
+    // One timed phase, relative to the start of the profile.
+    struct phase_span
+    {
+        partitioning_phase phase = partitioning_phase::seeding;
+        size_t iteration = 0;
+
+        microseconds start = microseconds::zero();
+        microseconds duration = microseconds::zero();
+    };
+
+    struct iteration_statistics
+    {
+        size_t distance_evaluations = 0;
+        size_t reassigned_observations = 0;
+
+        // Sum of squared distances to the means the iteration assigned to. Mini-batch K means
+        // reports the inertia of its batch.
+        double inertia = 0;
+    };
+
+    struct partitioning_profile
+    {
+        size_t iterations = 0;
+        microseconds elapsed_time = microseconds::zero();
+        std::array<microseconds, PARTITIONING_PHASES_AMOUNT> phase_times{};
+
+        size_t distance_evaluations = 0;
+        size_t skipped_distance_evaluations = 0;
+        size_t reassigned_observations = 0;
+
+        // Process-wide: partitions running concurrently, like ensemble restarts or K selection
+        // segments, count each other's allocations too.
+        size_t heap_allocations = 0;
+
+        // Empty clusters given observations again without restarting the partition.
+        size_t repaired_clusters = 0;
+
+        // Time spent exchanging data with shard workers, excluding the time they spent computing.
+        microseconds communication_time = microseconds::zero();
+
+        // Time spent sampling a coreset of the observations.
+        microseconds coreset_time = microseconds::zero();
+
+        // Relative excess of a coreset partition's dissimilarity over that of the same partitioner
+        // run on every observation, when it was measured.
+        double inertia_gap = 0;
+
+        // Set by the partitioner once it stops; converged means the assignment reached a fixed point.
+        stop_reason stopped_by = stop_reason::none;
+
+        std::vector<iteration_statistics> iteration_history;
+        std::vector<phase_span> spans;
+
+        std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+
+        void reset()
+        {
+            *this = {};
+        }
+
+        microseconds phase_time(partitioning_phase phase) const
+        {
+            return this->phase_times[static_cast<size_t>(phase)];
+        }
+
+        void record_phase(
+            partitioning_phase phase,
+            size_t iteration,
+            std::chrono::steady_clock::time_point start,
+            std::chrono::steady_clock::time_point end
+        )
+        {
+            auto duration = std::chrono::duration_cast<microseconds>(end - start);
+
+            this->phase_times[static_cast<size_t>(phase)] += duration;
+            this->spans.push_back({ phase, iteration, std::chrono::duration_cast<microseconds>(start - this->started), duration });
+        }
+
+        void record_iteration(size_t distance_evaluations, size_t reassigned_observations, double inertia)
+        {
+            this->reassigned_observations += reassigned_observations;
+            this->iteration_history.push_back({ distance_evaluations, reassigned_observations, inertia });
+        }
+
+        // Totals are combined; iteration history and spans of rhs are appended by += and left
+        // untouched by -=, since they cannot be subtracted.
+        partitioning_profile& operator+= (const partitioning_profile& rhs)
+        {
+            this->iterations += rhs.iterations;
+            this->elapsed_time += rhs.elapsed_time;
+
+            for (size_t i = 0; i < PARTITIONING_PHASES_AMOUNT; i++)
+                this->phase_times[i] += rhs.phase_times[i];
+
+            this->distance_evaluations += rhs.distance_evaluations;
+            this->skipped_distance_evaluations += rhs.skipped_distance_evaluations;
+            this->reassigned_observations += rhs.reassigned_observations;
+            this->heap_allocations += rhs.heap_allocations;
+            this->repaired_clusters += rhs.repaired_clusters;
+            this->communication_time += rhs.communication_time;
+            this->coreset_time += rhs.coreset_time;
+
+            this->iteration_history.insert(this->iteration_history.end(), rhs.iteration_history.begin(), rhs.iteration_history.end());
+            this->spans.insert(this->spans.end(), rhs.spans.begin(), rhs.spans.end());
+
+            return *this;
+        }
+
+        partitioning_profile& operator-= (const partitioning_profile& rhs)
+        {
+            this->iterations -= rhs.iterations;
+            this->elapsed_time -= rhs.elapsed_time;
+
+            for (size_t i = 0; i < PARTITIONING_PHASES_AMOUNT; i++)
+                this->phase_times[i] -= rhs.phase_times[i];
+
+            this->distance_evaluations -= rhs.distance_evaluations;
+            this->skipped_distance_evaluations -= rhs.skipped_distance_evaluations;
+            this->reassigned_observations -= rhs.reassigned_observations;
+            this->heap_allocations -= rhs.heap_allocations;
+            this->repaired_clusters -= rhs.repaired_clusters;
+            this->communication_time -= rhs.communication_time;
+            this->coreset_time -= rhs.coreset_time;
+
+            return *this;
+        }
+
+        partitioning_profile operator+ (const partitioning_profile& rhs) const
+        {
+            partitioning_profile result = *this;
+            return result += rhs;
+        }
+
+        partitioning_profile operator- (const partitioning_profile& rhs) const
+        {
+            partitioning_profile result = *this;
+            return result -= rhs;
+        }
+    };
+
+    // Records the time between construction and destruction as one span of a phase.
+    class phase_timer
+    {
+    private:
+        partitioning_profile& profile;
+        partitioning_phase phase;
+        size_t iteration;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    public:
+        phase_timer(partitioning_profile& profile, partitioning_phase phase)
+            : profile(profile), phase(phase), iteration(profile.iterations)
+        {}
+
+        phase_timer(const phase_timer&) = delete;
+        phase_timer& operator= (const phase_timer&) = delete;
+
+        ~phase_timer()
+        {
+            this->profile.record_phase(this->phase, this->iteration, this->start, std::chrono::steady_clock::now());
+        }
+    };
+
+    // Stores the growth of heap_allocations between construction and destruction in a counter.
+    class allocation_counter
+    {
+    private:
+        size_t& counter;
+        size_t start = heap_allocations.load(std::memory_order_relaxed);
+
+    public:
+        allocation_counter(size_t& counter)
+            : counter(counter)
+        {}
+
+        allocation_counter(const allocation_counter&) = delete;
+        allocation_counter& operator= (const allocation_counter&) = delete;
+
+        ~allocation_counter()
+        {
+            this->counter = heap_allocations.load(std::memory_order_relaxed) - this->start;
+        }
+    };
+}
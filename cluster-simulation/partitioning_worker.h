@@ -0,0 +1,174 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "cluster.h"
+
+namespace ntf::cluster
+{
+    template <typename T = int32_t, size_t D = 2>
+    struct partitioning_snapshot
+    {
+        std::vector<point<T, D>> means;
+
+        // Empty when the partitioner has no label for every observation mid-run.
+        std::vector<label_t> labels;
+
+        size_t iteration = 0;
+    };
+
+    // Runs one partition at a time on a background thread. After every iteration the partitioner's
+    // means and labels are copied into the back buffer of a double-buffered snapshot, which is then
+    // flipped to the front under the lock, so poll() never waits for more than a copy.
+    template <typename T = int32_t, size_t D = 2>
+    class partitioning_worker
+    {
+    private:
+        std::thread thread;
+        std::shared_ptr<partitioner<T, D>> current;
+
+        std::mutex mutex;
+        partitioning_snapshot<T, D> snapshots[2];
+        size_t front = 0;
+        size_t published = 0;
+        size_t polled = 0;
+
+        std::vector<cluster<T, D>> result;
+        partitioning_profile result_profile;
+        bool finished = false;
+
+        std::atomic<bool> busy{ false };
+        std::chrono::steady_clock::time_point started;
+
+        // Runs on the worker thread, which is the only one writing front.
+        void publish(const std::vector<cluster<T, D>>& clusters, const std::vector<label_t>& labels)
+        {
+            auto& back = this->snapshots[1 - this->front];
+
+            back.means.resize(clusters.size());
+
+            for (size_t i = 0; i < clusters.size(); i++)
+                back.means[i] = clusters[i].mean;
+
+            back.labels.assign(labels.begin(), labels.end());
+            back.iteration = this->snapshots[this->front].iteration + 1;
+
+            std::lock_guard<std::mutex> lock(this->mutex);
+
+            this->front = 1 - this->front;
+            this->published++;
+        }
+
+    public:
+        partitioning_worker() = default;
+
+        partitioning_worker(const partitioning_worker&) = delete;
+        partitioning_worker& operator= (const partitioning_worker&) = delete;
+
+        ~partitioning_worker()
+        {
+            this->cancel();
+        }
+
+        // Cancels any running partition and starts a new one. observations must stay untouched
+        // until the run is finished or cancelled. A non-empty previous warm starts from it.
+        void start(
+            std::shared_ptr<partitioner<T, D>> partitioner,
+            observation_span<T, D> observations,
+            std::vector<cluster<T, D>> previous = {}
+        )
+        {
+            this->cancel();
+
+            this->current = std::move(partitioner);
+            this->snapshots[this->front].iteration = 0;
+            this->polled = this->published;
+            this->started = std::chrono::steady_clock::now();
+            this->busy = true;
+
+            this->current->on_iteration = [this](const std::vector<cluster<T, D>>& clusters, const std::vector<label_t>& labels) {
+                this->publish(clusters, labels);
+            };
+
+            this->thread = std::thread([this, observations, previous = std::move(previous)] {
+                partitioning_profile profile;
+
+                std::vector<cluster<T, D>> clusters = previous.empty()
+                    ? this->current->partition(observations, profile)
+                    : this->current->repartition(observations, previous, profile);
+
+                std::lock_guard<std::mutex> lock(this->mutex);
+
+                this->result = std::move(clusters);
+                this->result_profile = profile;
+                this->finished = !this->current->cancelled;
+                this->busy = false;
+            });
+        }
+
+        // Stops the running partition after its current iteration and discards it.
+        void cancel()
+        {
+            if (!this->thread.joinable())
+                return;
+
+            this->current->cancelled = true;
+            this->thread.join();
+
+            this->current->cancelled = false;
+            this->current->on_iteration = nullptr;
+
+            this->result.clear();
+            this->finished = false;
+        }
+
+        bool running() const
+        {
+            return this->busy;
+        }
+
+        std::chrono::microseconds elapsed() const
+        {
+            return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - this->started);
+        }
+
+        // Copies the latest snapshot if one was published since the last poll.
+        bool poll(partitioning_snapshot<T, D>& snapshot)
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+
+            if (this->polled == this->published)
+                return false;
+
+            snapshot = this->snapshots[this->front];
+            this->polled = this->published;
+
+            return true;
+        }
+
+        // Hands over the clusters and profile of a partition that ran to completion.
+        bool take_result(std::vector<cluster<T, D>>& clusters, partitioning_profile& profile)
+        {
+            {
+                std::lock_guard<std::mutex> lock(this->mutex);
+
+                if (!this->finished)
+                    return false;
+            }
+
+            this->thread.join();
+            this->current->on_iteration = nullptr;
+
+            clusters = std::move(this->result);
+            profile = this->result_profile;
+
+            this->result.clear();
+            this->finished = false;
+
+            return true;
+        }
+    };
+}
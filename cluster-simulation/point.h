@@ -0,0 +1,228 @@
+#pragma once
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+#include "vector2d.h"
+
+namespace ntf::cluster
+{
+    // Fixed-dimension point with the part of v2d's interface the partitioners use. Every loop runs
+    // over the compile-time dimension, so it unrolls and vectorizes for each instantiation.
+    template <typename T, size_t D>
+    struct vnd
+    {
+        static_assert(D > 0, "points need at least one dimension");
+
+        T coordinates[D] = {};
+
+        T& operator[] (size_t dimension)
+        {
+            return this->coordinates[dimension];
+        }
+
+        const T& operator[] (size_t dimension) const
+        {
+            return this->coordinates[dimension];
+        }
+
+        vnd& operator+= (const vnd& rhs)
+        {
+            for (size_t d = 0; d < D; d++)
+                this->coordinates[d] += rhs.coordinates[d];
+
+            return *this;
+        }
+
+        vnd& operator-= (const vnd& rhs)
+        {
+            for (size_t d = 0; d < D; d++)
+                this->coordinates[d] -= rhs.coordinates[d];
+
+            return *this;
+        }
+
+        vnd operator+ (const vnd& rhs) const
+        {
+            vnd result = *this;
+            return result += rhs;
+        }
+
+        vnd operator- (const vnd& rhs) const
+        {
+            vnd result = *this;
+            return result -= rhs;
+        }
+
+        vnd operator* (T scalar) const
+        {
+            vnd result = *this;
+
+            for (size_t d = 0; d < D; d++)
+                result.coordinates[d] *= scalar;
+
+            return result;
+        }
+
+        vnd operator/ (T scalar) const
+        {
+            vnd result = *this;
+
+            for (size_t d = 0; d < D; d++)
+                result.coordinates[d] /= scalar;
+
+            return result;
+        }
+
+        bool operator== (const vnd& rhs) const
+        {
+            for (size_t d = 0; d < D; d++)
+            {
+                if (this->coordinates[d] != rhs.coordinates[d])
+                    return false;
+            }
+
+            return true;
+        }
+
+        bool operator!= (const vnd& rhs) const
+        {
+            return !(*this == rhs);
+        }
+
+        double euclidean_distance_squared(const vnd& rhs) const
+        {
+            double result = 0;
+
+            for (size_t d = 0; d < D; d++)
+            {
+                double difference = static_cast<double>(this->coordinates[d]) - static_cast<double>(rhs.coordinates[d]);
+                result += difference * difference;
+            }
+
+            return result;
+        }
+
+        double euclidean_distance(const vnd& rhs) const
+        {
+            return std::sqrt(this->euclidean_distance_squared(rhs));
+        }
+    };
+
+    // Observations of D coordinates; two dimensions stay the window's own v2d so the simulator
+    // and its tools are unaffected.
+    template <typename T, size_t D>
+    struct point_type
+    {
+        using type = vnd<T, D>;
+    };
+
+    template <typename T>
+    struct point_type<T, 2>
+    {
+        using type = v2d<T>;
+    };
+
+    template <typename T, size_t D = 2>
+    using point = typename point_type<T, D>::type;
+
+    // Coordinate access shared by both representations. Called with a constant dimension, as
+    // for_each_dimension does, the branch for v2d folds away.
+    template <typename T>
+    T& coordinate(v2d<T>& point, size_t dimension)
+    {
+        return dimension == 0 ? point.x : point.y;
+    }
+
+    template <typename T>
+    const T& coordinate(const v2d<T>& point, size_t dimension)
+    {
+        return dimension == 0 ? point.x : point.y;
+    }
+
+    template <typename T, size_t D>
+    T& coordinate(vnd<T, D>& point, size_t dimension)
+    {
+        return point[dimension];
+    }
+
+    template <typename T, size_t D>
+    const T& coordinate(const vnd<T, D>& point, size_t dimension)
+    {
+        return point[dimension];
+    }
+
+    template <typename F, size_t... dimensions>
+    void for_each_dimension(F& function, std::index_sequence<dimensions...>)
+    {
+        (function(std::integral_constant<size_t, dimensions>{}), ...);
+    }
+
+    // Calls function(d) for d in [0, D) with d a constant expression, fully unrolled.
+    template <size_t D, typename F>
+    void for_each_dimension(F&& function)
+    {
+        for_each_dimension(function, std::make_index_sequence<D>{});
+    }
+
+    template <typename T>
+    T to_coordinate(double value)
+    {
+        if constexpr (std::is_integral_v<T>)
+            return static_cast<T>(std::llround(value));
+        else
+            return static_cast<T>(value);
+    }
+
+    // Coordinate sums: exact 64-bit integers for integral coordinates, doubles otherwise, so sums
+    // over billions of observations neither overflow nor lose the low bits of small coordinates.
+    template <typename T>
+    using accumulator_t = std::conditional_t<std::is_integral_v<T>, int64_t, double>;
+
+    template <size_t D, typename S, typename P>
+    void accumulate(S& sum, const P& point)
+    {
+        for_each_dimension<D>([&](size_t d) {
+            coordinate(sum, d) += static_cast<std::remove_reference_t<decltype(coordinate(sum, d))>>(coordinate(point, d));
+        });
+    }
+
+    template <size_t D, typename P, typename Q>
+    double squared_distance(const P& a, const Q& b)
+    {
+        double result = 0;
+
+        for_each_dimension<D>([&](size_t d) {
+            double difference = static_cast<double>(coordinate(a, d)) - static_cast<double>(coordinate(b, d));
+            result += difference * difference;
+        });
+
+        return result;
+    }
+
+    template <size_t D, typename P, typename Q>
+    double dot(const P& a, const Q& b)
+    {
+        double result = 0;
+
+        for_each_dimension<D>([&](size_t d) {
+            result += static_cast<double>(coordinate(a, d)) * static_cast<double>(coordinate(b, d));
+        });
+
+        return result;
+    }
+
+    // Converts between coordinate types, rounding when the target is integral.
+    template <typename T, size_t D, typename P>
+    point<T, D> point_cast(const P& source)
+    {
+        point<T, D> result{};
+
+        for_each_dimension<D>([&](size_t d) {
+            coordinate(result, d) = to_coordinate<T>(static_cast<double>(coordinate(source, d)));
+        });
+
+        return result;
+    }
+}
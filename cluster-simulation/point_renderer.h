@@ -0,0 +1,162 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <vector>
+#include "cluster.h"
+#include "window.h"
+
+namespace ntf::cluster
+{
+    // Rasterizes observations into a cached screen-sized sprite instead of drawing a circle per
+    // observation every frame. The cache is rebuilt only when the view moves, the screen is resized
+    // or invalidate() is called after the clusters changed. Observations outside the view are culled
+    // in world space, and observations falling into the same pixel are binned: the pixel gets the
+    // average colour of its observations and an opacity that grows with their count.
+    template <typename T = int32_t>
+    class point_renderer
+    {
+    public:
+        // Below this many pixels per world unit observations are single pixels, above it they are
+        // splatted as small crosses like the radius 1 circles they replace.
+        static constexpr float SPLAT_SCALE = 0.5f;
+
+        static constexpr uint8_t MIN_ALPHA = 96;
+
+        // Observations in one pixel needed for it to become fully opaque.
+        static constexpr uint32_t OPAQUE_DENSITY = 16;
+
+    private:
+        struct bin
+        {
+            uint32_t count = 0;
+            uint32_t r = 0;
+            uint32_t g = 0;
+            uint32_t b = 0;
+        };
+
+        std::unique_ptr<olc::Sprite> sprite;
+        std::vector<bin> bins;
+
+        v2d<T> world_offset{ 0, 0 };
+        float world_scale = 0;
+        bool dirty = true;
+
+        void accumulate(int32_t x, int32_t y, const ntf::color& color)
+        {
+            if (x < 0 || y < 0 || x >= this->sprite->width || y >= this->sprite->height)
+                return;
+
+            auto& bin = this->bins[static_cast<size_t>(y) * this->sprite->width + x];
+
+            bin.count++;
+            bin.r += color.r;
+            bin.g += color.g;
+            bin.b += color.b;
+        }
+
+        void rebuild(const std::vector<cluster<T>>& clusters)
+        {
+            std::fill(this->bins.begin(), this->bins.end(), bin{});
+
+            int32_t width = this->sprite->width;
+            int32_t height = this->sprite->height;
+
+            // World-space view, widened by a pixel so splats of points just outside still show.
+            double margin = 1.0 / this->world_scale;
+
+            double min_x = static_cast<double>(this->world_offset.x) - margin;
+            double min_y = static_cast<double>(this->world_offset.y) - margin;
+            double max_x = static_cast<double>(this->world_offset.x) + width / this->world_scale + margin;
+            double max_y = static_cast<double>(this->world_offset.y) + height / this->world_scale + margin;
+
+            bool splat = this->world_scale >= SPLAT_SCALE;
+
+            for (auto& cluster : clusters)
+            {
+                for (auto& observation : cluster.observations)
+                {
+                    double world_x = static_cast<double>(observation.x);
+                    double world_y = static_cast<double>(observation.y);
+
+                    if (world_x < min_x || world_y < min_y || world_x > max_x || world_y > max_y)
+                        continue;
+
+                    int32_t x = static_cast<int32_t>((world_x - this->world_offset.x) * this->world_scale);
+                    int32_t y = static_cast<int32_t>((world_y - this->world_offset.y) * this->world_scale);
+
+                    this->accumulate(x, y, cluster.color);
+
+                    if (!splat)
+                        continue;
+
+                    this->accumulate(x - 1, y, cluster.color);
+                    this->accumulate(x + 1, y, cluster.color);
+                    this->accumulate(x, y - 1, cluster.color);
+                    this->accumulate(x, y + 1, cluster.color);
+                }
+            }
+
+            olc::Pixel* pixels = this->sprite->GetData();
+
+            for (size_t i = 0; i < this->bins.size(); i++)
+            {
+                auto& bin = this->bins[i];
+
+                if (bin.count == 0)
+                {
+                    pixels[i] = olc::BLANK;
+                    continue;
+                }
+
+                uint32_t density = std::min(bin.count, OPAQUE_DENSITY);
+                uint32_t alpha = MIN_ALPHA + (255 - MIN_ALPHA) * (density - 1) / (OPAQUE_DENSITY - 1);
+
+                pixels[i] = olc::Pixel(
+                    static_cast<uint8_t>(bin.r / bin.count),
+                    static_cast<uint8_t>(bin.g / bin.count),
+                    static_cast<uint8_t>(bin.b / bin.count),
+                    static_cast<uint8_t>(alpha)
+                );
+            }
+
+            this->dirty = false;
+        }
+
+    public:
+        // Call whenever the clusters or their observations changed.
+        void invalidate()
+        {
+            this->dirty = true;
+        }
+
+        void draw(ntf::window& window, const std::vector<cluster<T>>& clusters, const v2d<T>& world_offset, float world_scale)
+        {
+            int32_t width = window.ScreenWidth();
+            int32_t height = window.ScreenHeight();
+
+            if (!this->sprite || this->sprite->width != width || this->sprite->height != height)
+            {
+                this->sprite = std::make_unique<olc::Sprite>(width, height);
+                this->bins.assign(static_cast<size_t>(width) * height, {});
+                this->dirty = true;
+            }
+
+            if (this->world_offset != world_offset || this->world_scale != world_scale)
+            {
+                this->world_offset = world_offset;
+                this->world_scale = world_scale;
+                this->dirty = true;
+            }
+
+            if (this->dirty)
+                this->rebuild(clusters);
+
+            olc::Pixel::Mode previous_mode = window.GetPixelMode();
+
+            window.SetPixelMode(olc::Pixel::ALPHA);
+            window.DrawSprite({ 0, 0 }, this->sprite.get());
+            window.SetPixelMode(previous_mode);
+        }
+    };
+}
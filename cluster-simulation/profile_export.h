@@ -0,0 +1,142 @@
+#pragma once
+#include <ostream>
+#include <string>
+#include <vector>
+#include "partitioning_profile.h"
+
+namespace ntf::cluster
+{
+    struct named_profile
+    {
+        std::string name;
+        const partitioning_profile* profile = nullptr;
+    };
+
+    inline void write_json_string(std::ostream& out, const std::string& value)
+    {
+        out << '"';
+
+        for (char c : value)
+        {
+            if (c == '"' || c == '\\')
+                out << '\\';
+
+            out << c;
+        }
+
+        out << '"';
+    }
+
+    // Phase durations of every iteration, summed over the spans recorded for it.
+    inline std::vector<std::array<microseconds, PARTITIONING_PHASES_AMOUNT>> iteration_phase_times(const partitioning_profile& profile)
+    {
+        std::vector<std::array<microseconds, PARTITIONING_PHASES_AMOUNT>> result(profile.iterations + 1);
+
+        for (auto& span : profile.spans)
+        {
+            if (span.iteration < result.size())
+                result[span.iteration][static_cast<size_t>(span.phase)] += span.duration;
+        }
+
+        return result;
+    }
+
+    inline void write_profile_json(std::ostream& out, const partitioning_profile& profile)
+    {
+        out << "{ \"iterations\": " << profile.iterations
+            << ", \"elapsed_us\": " << profile.elapsed_time.count()
+            << ", \"phases_us\": {";
+
+        for (size_t i = 0; i < PARTITIONING_PHASES_AMOUNT; i++)
+        {
+            out << (i == 0 ? " " : ", ") << '"' << phase_name(static_cast<partitioning_phase>(i)) << "\": " << profile.phase_times[i].count();
+        }
+
+        out << " }"
+            << ", \"distance_evaluations\": " << profile.distance_evaluations
+            << ", \"skipped_distance_evaluations\": " << profile.skipped_distance_evaluations
+            << ", \"reassigned_observations\": " << profile.reassigned_observations
+            << ", \"heap_allocations\": " << profile.heap_allocations
+            << ", \"repaired_clusters\": " << profile.repaired_clusters
+            << ", \"communication_us\": " << profile.communication_time.count()
+            << ", \"coreset_us\": " << profile.coreset_time.count()
+            << ", \"inertia_gap\": " << profile.inertia_gap
+            << ", \"stopped_by\": \"" << stop_reason_name(profile.stopped_by) << '"'
+            << ", \"history\": [";
+
+        for (size_t i = 0; i < profile.iteration_history.size(); i++)
+        {
+            auto& iteration = profile.iteration_history[i];
+
+            out << (i == 0 ? " " : ", ")
+                << "{ \"distance_evaluations\": " << iteration.distance_evaluations
+                << ", \"reassigned_observations\": " << iteration.reassigned_observations
+                << ", \"inertia\": " << iteration.inertia << " }";
+        }
+
+        out << " ] }";
+    }
+
+    inline void write_profile_csv_header(std::ostream& out)
+    {
+        out << "run,iteration,distance_evaluations,reassigned_observations,inertia";
+
+        for (size_t i = 0; i < PARTITIONING_PHASES_AMOUNT; i++)
+            out << ',' << phase_name(static_cast<partitioning_phase>(i)) << "_us";
+
+        out << '\n';
+    }
+
+    // One row per iteration; phases timed outside any iteration, like seeding, land on iteration 0.
+    inline void write_profile_csv(std::ostream& out, const partitioning_profile& profile, const std::string& run)
+    {
+        auto phase_times = iteration_phase_times(profile);
+
+        for (size_t i = 0; i < profile.iteration_history.size(); i++)
+        {
+            auto& iteration = profile.iteration_history[i];
+
+            out << run << ',' << i << ','
+                << iteration.distance_evaluations << ','
+                << iteration.reassigned_observations << ','
+                << iteration.inertia;
+
+            for (size_t phase = 0; phase < PARTITIONING_PHASES_AMOUNT; phase++)
+                out << ',' << (i < phase_times.size() ? phase_times[i][phase].count() : 0);
+
+            out << '\n';
+        }
+    }
+
+    // Chrome trace-event JSON (chrome://tracing, Perfetto). Every run is a thread of its own, with
+    // its phases as complete events starting at the run's own time zero.
+    inline void write_chrome_trace(std::ostream& out, const std::vector<named_profile>& runs)
+    {
+        out << "{ \"traceEvents\": [\n";
+
+        bool first = true;
+
+        for (size_t tid = 0; tid < runs.size(); tid++)
+        {
+            out << (first ? "  " : ",\n  ")
+                << "{ \"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << tid
+                << ", \"args\": { \"name\": ";
+
+            write_json_string(out, runs[tid].name);
+            out << " } }";
+
+            first = false;
+
+            for (auto& span : runs[tid].profile->spans)
+            {
+                out << ",\n  { \"name\": \"" << phase_name(span.phase) << "\""
+                    << ", \"ph\": \"X\", \"pid\": 1, \"tid\": " << tid
+                    << ", \"ts\": " << span.start.count()
+                    << ", \"dur\": " << span.duration.count()
+                    << ", \"args\": { \"iteration\": " << span.iteration << " } }";
+            }
+        }
+
+        out << "\n] }\n";
+    }
+}
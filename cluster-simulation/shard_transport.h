@@ -0,0 +1,257 @@
+#pragma once
+#include <cerrno>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+namespace ntf::cluster
+{
+    // Reliable, ordered byte stream between a coordinator and one shard worker. Both calls block
+    // until every byte went through and return false once the other end is gone.
+    class shard_channel
+    {
+    public:
+        virtual ~shard_channel() = default;
+
+        virtual bool send(const void* data, size_t size) = 0;
+        virtual bool receive(void* data, size_t size) = 0;
+    };
+
+#ifndef _WIN32
+    // Channel over a connected Unix-domain stream socket, which it owns.
+    class unix_socket_channel : public shard_channel
+    {
+    private:
+        int socket_fd = -1;
+
+    public:
+        explicit unix_socket_channel(int socket_fd) : socket_fd(socket_fd)
+        {}
+
+        unix_socket_channel(const unix_socket_channel&) = delete;
+        unix_socket_channel& operator= (const unix_socket_channel&) = delete;
+
+        ~unix_socket_channel() override
+        {
+            if (this->socket_fd >= 0)
+                ::close(this->socket_fd);
+        }
+
+        // Returns null when nothing listens at path.
+        static std::unique_ptr<unix_socket_channel> connect(const std::string& path)
+        {
+            sockaddr_un address{};
+            address.sun_family = AF_UNIX;
+
+            if (path.size() >= sizeof(address.sun_path))
+                return nullptr;
+
+            path.copy(address.sun_path, path.size());
+
+            int socket_fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+
+            if (socket_fd < 0)
+                return nullptr;
+
+            if (::connect(socket_fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0)
+            {
+                ::close(socket_fd);
+                return nullptr;
+            }
+
+            return std::make_unique<unix_socket_channel>(socket_fd);
+        }
+
+        bool send(const void* data, size_t size) override
+        {
+            const char* bytes = static_cast<const char*>(data);
+
+            while (size > 0)
+            {
+#ifdef MSG_NOSIGNAL
+                ssize_t sent = ::send(this->socket_fd, bytes, size, MSG_NOSIGNAL);
+#else
+                ssize_t sent = ::send(this->socket_fd, bytes, size, 0);
+#endif
+                if (sent < 0 && errno == EINTR)
+                    continue;
+
+                if (sent <= 0)
+                    return false;
+
+                bytes += sent;
+                size -= static_cast<size_t>(sent);
+            }
+
+            return true;
+        }
+
+        bool receive(void* data, size_t size) override
+        {
+            char* bytes = static_cast<char*>(data);
+
+            while (size > 0)
+            {
+                ssize_t received = ::recv(this->socket_fd, bytes, size, 0);
+
+                if (received < 0 && errno == EINTR)
+                    continue;
+
+                if (received <= 0)
+                    return false;
+
+                bytes += received;
+                size -= static_cast<size_t>(received);
+            }
+
+            return true;
+        }
+    };
+
+    // Accepts shard workers at a socket path, for workers started separately on this machine.
+    class unix_socket_listener
+    {
+    private:
+        int socket_fd = -1;
+        std::string path;
+
+    public:
+        unix_socket_listener() = default;
+
+        unix_socket_listener(const unix_socket_listener&) = delete;
+        unix_socket_listener& operator= (const unix_socket_listener&) = delete;
+
+        ~unix_socket_listener()
+        {
+            this->close();
+        }
+
+        // Replaces whatever socket file was left at path.
+        bool listen(const std::string& path, int backlog = 16)
+        {
+            this->close();
+
+            sockaddr_un address{};
+            address.sun_family = AF_UNIX;
+
+            if (path.size() >= sizeof(address.sun_path))
+                return false;
+
+            path.copy(address.sun_path, path.size());
+            ::unlink(path.c_str());
+
+            this->socket_fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+
+            if (this->socket_fd < 0)
+                return false;
+
+            if (::bind(this->socket_fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0
+                || ::listen(this->socket_fd, backlog) != 0)
+            {
+                this->close();
+                return false;
+            }
+
+            this->path = path;
+            return true;
+        }
+
+        // Blocks until a worker connects.
+        std::unique_ptr<unix_socket_channel> accept()
+        {
+            int connection = ::accept(this->socket_fd, nullptr, nullptr);
+
+            return connection < 0 ? nullptr : std::make_unique<unix_socket_channel>(connection);
+        }
+
+        void close()
+        {
+            if (this->socket_fd < 0)
+                return;
+
+            ::close(this->socket_fd);
+            ::unlink(this->path.c_str());
+
+            this->socket_fd = -1;
+            this->path.clear();
+        }
+    };
+
+    // Worker processes forked from this one, each connected by a socket pair and running serve
+    // until its channel closes. The destructor closes the channels and reaps the processes.
+    class local_shard_processes
+    {
+    private:
+        std::vector<pid_t> processes;
+
+    public:
+        std::vector<std::unique_ptr<shard_channel>> channels;
+
+        local_shard_processes() = default;
+
+        local_shard_processes(const local_shard_processes&) = delete;
+        local_shard_processes& operator= (const local_shard_processes&) = delete;
+
+        ~local_shard_processes()
+        {
+            this->channels.clear();
+
+            for (pid_t process : this->processes)
+                ::waitpid(process, nullptr, 0);
+        }
+
+        // Fork before starting threads: the children only run serve, but inherit whatever locks
+        // other threads held. Returns false when a socket pair or a fork failed.
+        bool spawn(size_t amount, const std::function<void(shard_channel&)>& serve)
+        {
+            for (size_t i = 0; i < amount; i++)
+            {
+                int sockets[2];
+
+                if (::socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0)
+                    return false;
+
+                pid_t process = ::fork();
+
+                if (process < 0)
+                {
+                    ::close(sockets[0]);
+                    ::close(sockets[1]);
+                    return false;
+                }
+
+                if (process == 0)
+                {
+                    ::close(sockets[0]);
+
+                    // Siblings' coordinator ends would keep their workers alive after the coordinator exits.
+                    this->channels.clear();
+
+                    {
+                        unix_socket_channel channel(sockets[1]);
+                        serve(channel);
+                    }
+
+                    ::_exit(0);
+                }
+
+                ::close(sockets[1]);
+
+                this->processes.push_back(process);
+                this->channels.push_back(std::make_unique<unix_socket_channel>(sockets[0]));
+            }
+
+            return true;
+        }
+    };
+#endif
+}
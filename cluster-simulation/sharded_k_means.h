@@ -0,0 +1,409 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+#include "k_means.h"
+#include "shard_transport.h"
+
+namespace ntf::cluster
+{
+    // Messages from the coordinator to a shard worker. Every one starts with a shard_header;
+    // payloads are in the native layout of the coordinator, so both ends run the same build.
+    enum class shard_message : uint32_t
+    {
+        // Followed by header.size observations, which replace the worker's shard.
+        load_shard = 1,
+
+        // Followed by header.means_amount means as point<double, D>. The worker assigns its shard
+        // to them and replies with a shard_partial_header, the sums and the counts.
+        assign = 2,
+
+        // The worker replies with the labels of its shard from the last assignment.
+        labels = 3,
+
+        // The worker returns from serve.
+        stop = 4,
+
+        // Followed by header.size labels, which replace those of the worker's last assignment
+        // after the coordinator repaired empty clusters.
+        store_labels = 5,
+    };
+
+    struct shard_header
+    {
+        uint32_t type = 0;
+        uint32_t means_amount = 0;
+        uint64_t size = 0;
+    };
+
+    struct shard_partial_header
+    {
+        uint64_t reassigned = 0;
+        uint64_t compute_us = 0;
+        double inertia = 0;
+    };
+
+    // Holds one shard of the observations and answers a coordinator's assignments with partial
+    // sums and counts of its shard.
+    template <typename T = int32_t, size_t D = 2>
+    class shard_worker
+    {
+    private:
+        std::vector<point<T, D>> shard;
+        std::vector<label_t> labels;
+        std::vector<point<double, D>> means;
+        mean_table<D> means_table;
+
+        std::vector<label_t> next_labels;
+        std::vector<point<accumulator_t<T>, D>> sums;
+        std::vector<uint64_t> counts;
+
+        bool assign(shard_channel& channel, size_t means_amount)
+        {
+            this->means.resize(means_amount);
+
+            if (!channel.receive(this->means.data(), means_amount * sizeof(point<double, D>)))
+                return false;
+
+            auto start = std::chrono::steady_clock::now();
+
+            this->next_labels.resize(this->shard.size());
+            this->means_table.load(this->means);
+            this->means_table.nearest(this->shard.data(), this->shard.size(), this->next_labels.data());
+
+            this->sums.assign(means_amount, point<accumulator_t<T>, D>{});
+            this->counts.assign(means_amount, 0);
+
+            shard_partial_header reply;
+
+            for (size_t i = 0; i < this->shard.size(); i++)
+            {
+                label_t label = this->next_labels[i];
+
+                accumulate<D>(this->sums[label], this->shard[i]);
+                this->counts[label]++;
+
+                reply.inertia += squared_distance<D>(this->shard[i], this->means[label]);
+                reply.reassigned += label != this->labels[i];
+            }
+
+            std::swap(this->labels, this->next_labels);
+
+            reply.compute_us = std::chrono::duration_cast<microseconds>(std::chrono::steady_clock::now() - start).count();
+
+            return channel.send(&reply, sizeof(reply))
+                && channel.send(this->sums.data(), means_amount * sizeof(point<accumulator_t<T>, D>))
+                && channel.send(this->counts.data(), means_amount * sizeof(uint64_t));
+        }
+
+    public:
+        // Answers one coordinator until it sends stop, which returns true, or the channel fails.
+        bool serve(shard_channel& channel)
+        {
+            while (true)
+            {
+                shard_header header;
+
+                if (!channel.receive(&header, sizeof(header)))
+                    return false;
+
+                switch (static_cast<shard_message>(header.type))
+                {
+                case shard_message::load_shard:
+                    this->shard.resize(header.size);
+                    this->labels.assign(header.size, 0);
+
+                    if (!channel.receive(this->shard.data(), header.size * sizeof(point<T, D>)))
+                        return false;
+
+                    break;
+
+                case shard_message::assign:
+                    if (!this->assign(channel, header.means_amount))
+                        return false;
+
+                    break;
+
+                case shard_message::labels:
+                    if (!channel.send(this->labels.data(), this->labels.size() * sizeof(label_t)))
+                        return false;
+
+                    break;
+
+                case shard_message::store_labels:
+                    if (header.size != this->labels.size() || !channel.receive(this->labels.data(), header.size * sizeof(label_t)))
+                        return false;
+
+                    break;
+
+                case shard_message::stop:
+                    return true;
+
+                default:
+                    return false;
+                }
+            }
+        }
+    };
+
+    // K means whose assignment runs in shard workers, usually other processes. Each iteration the
+    // means are broadcast, every worker assigns its contiguous shard and returns partial sums and
+    // counts, and the coordinator reduces them in shard order, so results do not depend on how
+    // fast the workers are. Seeding and the final labels stay with the coordinator, and so does
+    // the repair of clusters an assignment left empty, on labels gathered from the workers. When a
+    // channel fails, every shard is dropped, since the others may be left mid-exchange, and the
+    // partitioner runs locally from then on.
+    template <typename T = int32_t, size_t D = 2>
+    struct sharded_k_means : public k_means<T, D>
+    {
+        // Not owned; they must outlive the partitioner, and serve one coordinator each.
+        std::vector<shard_channel*> shards;
+
+        sharded_k_means(const std::vector<shard_channel*>& shards = {}, size_t threads = 1) : k_means<T, D>(threads), shards(shards)
+        {
+            this->name = "K means (sharded)";
+            this->param_name = "K";
+        }
+
+        // Asks every worker to return from serve.
+        void stop_shards()
+        {
+            shard_header header{ static_cast<uint32_t>(shard_message::stop) };
+
+            for (shard_channel* shard : this->shards)
+                shard->send(&header, sizeof(header));
+        }
+
+    private:
+        std::vector<size_t> shard_offsets;
+        std::vector<point<accumulator_t<T>, D>> shard_sums;
+        std::vector<uint64_t> shard_counts;
+        std::vector<label_t> shard_labels;
+
+        std::vector<cluster<T, D>> run_locally(observation_span<T, D> observations, std::vector<cluster<T, D>>& clusters, partitioning_profile& profile)
+        {
+            this->shards.clear();
+            return k_means<T, D>::iterate(observations, clusters, profile);
+        }
+
+        template <typename F>
+        bool communicate(partitioning_profile& profile, F&& exchange)
+        {
+            auto start = std::chrono::steady_clock::now();
+            bool result = exchange();
+
+            profile.communication_time += std::chrono::duration_cast<microseconds>(std::chrono::steady_clock::now() - start);
+            return result;
+        }
+
+        bool distribute(observation_span<T, D> observations, partitioning_profile& profile)
+        {
+            this->shard_offsets.resize(this->shards.size() + 1);
+
+            for (size_t s = 0; s <= this->shards.size(); s++)
+                this->shard_offsets[s] = observations.size() * s / this->shards.size();
+
+            return this->communicate(profile, [&] {
+                for (size_t s = 0; s < this->shards.size(); s++)
+                {
+                    shard_header header{ static_cast<uint32_t>(shard_message::load_shard), 0, this->shard_offsets[s + 1] - this->shard_offsets[s] };
+
+                    if (!this->shards[s]->send(&header, sizeof(header))
+                        || !this->shards[s]->send(observations.data() + this->shard_offsets[s], header.size * sizeof(point<T, D>)))
+                        return false;
+                }
+
+                return true;
+            });
+        }
+
+        // Broadcasts the centroids and reduces the replies. Time the slowest worker spent computing
+        // is not communication, the rest of the round trip is.
+        bool assign_shards(
+            std::vector<point<accumulator_t<T>, D>>& sums,
+            std::vector<size_t>& counts,
+            size_t& reassigned,
+            double& inertia,
+            partitioning_profile& profile
+        )
+        {
+            size_t means_amount = this->centroids.size();
+            microseconds slowest = microseconds::zero();
+
+            bool exchanged = this->communicate(profile, [&] {
+                shard_header header{ static_cast<uint32_t>(shard_message::assign), static_cast<uint32_t>(means_amount), 0 };
+
+                for (shard_channel* shard : this->shards)
+                {
+                    if (!shard->send(&header, sizeof(header)) || !shard->send(this->centroids.data(), means_amount * sizeof(point<double, D>)))
+                        return false;
+                }
+
+                std::fill(sums.begin(), sums.end(), point<accumulator_t<T>, D>{});
+                std::fill(counts.begin(), counts.end(), 0);
+
+                this->shard_sums.resize(means_amount);
+                this->shard_counts.resize(means_amount);
+
+                for (shard_channel* shard : this->shards)
+                {
+                    shard_partial_header partial;
+
+                    if (!shard->receive(&partial, sizeof(partial))
+                        || !shard->receive(this->shard_sums.data(), means_amount * sizeof(point<accumulator_t<T>, D>))
+                        || !shard->receive(this->shard_counts.data(), means_amount * sizeof(uint64_t)))
+                        return false;
+
+                    for (size_t j = 0; j < means_amount; j++)
+                    {
+                        sums[j] += this->shard_sums[j];
+                        counts[j] += this->shard_counts[j];
+                    }
+
+                    reassigned += partial.reassigned;
+                    inertia += partial.inertia;
+                    slowest = std::max(slowest, microseconds(partial.compute_us));
+                }
+
+                return true;
+            });
+
+            profile.communication_time -= std::min(slowest, profile.communication_time);
+            return exchanged;
+        }
+
+        bool gather_labels(std::vector<label_t>& labels, partitioning_profile& profile)
+        {
+            return this->communicate(profile, [&] {
+                shard_header header{ static_cast<uint32_t>(shard_message::labels) };
+
+                for (size_t s = 0; s < this->shards.size(); s++)
+                {
+                    size_t begin = this->shard_offsets[s];
+                    size_t end = this->shard_offsets[s + 1];
+
+                    if (!this->shards[s]->send(&header, sizeof(header)) || !this->shards[s]->receive(labels.data() + begin, (end - begin) * sizeof(label_t)))
+                        return false;
+                }
+
+                return true;
+            });
+        }
+
+        bool scatter_labels(const std::vector<label_t>& labels, partitioning_profile& profile)
+        {
+            return this->communicate(profile, [&] {
+                for (size_t s = 0; s < this->shards.size(); s++)
+                {
+                    size_t begin = this->shard_offsets[s];
+                    size_t end = this->shard_offsets[s + 1];
+
+                    shard_header header{ static_cast<uint32_t>(shard_message::store_labels), 0, end - begin };
+
+                    if (!this->shards[s]->send(&header, sizeof(header)) || !this->shards[s]->send(labels.data() + begin, (end - begin) * sizeof(label_t)))
+                        return false;
+                }
+
+                return true;
+            });
+        }
+
+        // Same repair as k_means::iterate, on the labels of the whole observation set; the
+        // repaired labels go back to the workers, which count reassignments against them.
+        bool repair_shards(
+            observation_span<T, D> observations,
+            std::vector<point<accumulator_t<T>, D>>& sums,
+            std::vector<size_t>& counts,
+            partitioning_profile& profile
+        )
+        {
+            if (std::find(counts.begin(), counts.end(), 0) == counts.end())
+                return true;
+
+            this->shard_labels.resize(observations.size());
+
+            if (!this->gather_labels(this->shard_labels, profile))
+                return false;
+
+            return !this->repair_empty_clusters(observations, this->shard_labels, sums, counts, profile)
+                || this->scatter_labels(this->shard_labels, profile);
+        }
+
+    public:
+        std::vector<cluster<T, D>> iterate(observation_span<T, D> observations, std::vector<cluster<T, D>>& clusters, partitioning_profile& profile) override
+        {
+            if (this->shards.empty() || !this->distribute(observations, profile))
+                return this->run_locally(observations, clusters, profile);
+
+            std::vector<point<double, D>> previous_centroids;
+            this->load_centroids(clusters);
+
+            std::vector<point<accumulator_t<T>, D>> sums(clusters.size());
+            std::vector<size_t> counts(clusters.size());
+
+            while (true)
+            {
+                {
+                    phase_timer t(profile, partitioning_phase::convergence);
+
+                    profile.stopped_by = this->check_convergence(previous_centroids, profile);
+
+                    if (profile.stopped_by != stop_reason::none)
+                        break;
+                }
+
+                size_t reassigned = 0;
+                double inertia = 0;
+
+                {
+                    phase_timer t(profile, partitioning_phase::assignment);
+
+                    if (!this->assign_shards(sums, counts, reassigned, inertia, profile))
+                        return this->run_locally(observations, clusters, profile);
+                }
+
+                size_t evaluations = observations.size() * clusters.size();
+
+                profile.distance_evaluations += evaluations;
+                profile.record_iteration(evaluations, reassigned, inertia);
+
+                {
+                    phase_timer t(profile, partitioning_phase::empty_clusters);
+
+                    if (!this->repair_shards(observations, sums, counts, profile))
+                        return this->run_locally(observations, clusters, profile);
+                }
+
+                {
+                    phase_timer t(profile, partitioning_phase::update);
+
+                    previous_centroids = this->centroids;
+                    this->update_centroids(sums, counts, clusters);
+                }
+
+                profile.iterations++;
+                this->report_iteration(clusters, {});
+            }
+
+            auto assignment = std::make_shared<labeling<T, D>>(observations, clusters.size());
+
+            {
+                phase_timer t(profile, partitioning_phase::assignment);
+
+                if (!this->gather_labels(assignment->labels, profile))
+                {
+                    this->shards.clear();
+
+                    this->means_table.load(this->centroids);
+                    this->means_table.nearest(observations.data(), observations.size(), assignment->labels.data());
+                }
+            }
+
+            assignment->group(clusters.size());
+            bind_clusters(clusters, std::shared_ptr<const labeling<T, D>>(assignment));
+
+            return clusters;
+        }
+    };
+}
@@ -1,19 +1,28 @@
 #pragma once
 #include "cluster.h"
+#include "csv_loader.h"
+#include "dataset_file.h"
+#include "dataset_generator.h"
+#include "dbscan.h"
+#include "k_selection.h"
+#include "partitioning_worker.h"
+#include "point_renderer.h"
+#include "spatial_index.h"
 #include "window.h"
 
 namespace ntf::cluster
 {
-    using int_distribution = std::uniform_int_distribution<int32_t>;
-
     constexpr const char* APP_NAME = "Cluster Simulator";
 
     constexpr uint16_t DEFAULT_PLANE_SIZE = 10000;
     constexpr uint16_t DEFAULT_OFFSET = 100;
     constexpr uint16_t DEFAULT_ROOT_OBSERVATIONS_AMOUNT = 20;
-    constexpr uint16_t DEFAULT_OBSERVATIONS_AMOUNT = 40000;
-    constexpr uint16_t OBSERVATIONS_INC = 1000;
+    constexpr size_t DEFAULT_OBSERVATIONS_AMOUNT = 40000;
+    constexpr size_t OBSERVATIONS_INC = 1000;
     constexpr int32_t PANNING_SPEED = 1800;
+    constexpr const char* DATASET_FILE_PATH = "observations.ntfo";
+    constexpr const char* PARTITION_FILE_PATH = "partition.ntfp";
+    constexpr const char* CSV_FILE_PATH = "observations.csv";
 
     class simulator : public screen
     {
@@ -23,17 +32,28 @@ namespace ntf::cluster
         std::default_random_engine random_engine;
 
         constrained<uint16_t, 1, UINT16_MAX> root_observations_amount = DEFAULT_ROOT_OBSERVATIONS_AMOUNT;
-        constrained_uint16_t observations_amount = DEFAULT_OBSERVATIONS_AMOUNT;
+        constrained<size_t, 1, SIZE_MAX> observations_amount = DEFAULT_OBSERVATIONS_AMOUNT;
         v2d_u16 offset = { DEFAULT_OFFSET, DEFAULT_OFFSET };
         v2d_u16 plane_size = { DEFAULT_PLANE_SIZE, DEFAULT_PLANE_SIZE };
 
         std::vector<v2d_i32> observations = {};
+        dataset_generator<int32_t> generator{ nullptr, 0, std::thread::hardware_concurrency() };
         std::vector<cluster<int32_t>> clusters = {};
         std::vector<partitioner_shared_ptr> partitioners = {};
+        std::shared_ptr<grid_index<int32_t>> index = {};
+        point_renderer<int32_t> renderer = {};
+        mean_table<2> means_table = {};
+
+        partitioning_worker<int32_t> worker;
+        partitioning_snapshot<int32_t> snapshot = {};
             
         partitioning_profile partitioning_profile = {};
         size_t current_partitioner_index = 0;
 
+        // Whether partitioning was requested since the observations were generated, so later
+        // changes restart it warm from the current clusters.
+        bool partitioned = false;
+
         v2d_i32 pan_start_pos;
         v2d_i32 world_offset = { 0, 0 };
         float world_scale = 1.0f;
@@ -52,7 +72,7 @@ namespace ntf::cluster
             const v2d_u16& plane_size,
             const v2d_u16& offset,
             uint16_t root_observations_amount,
-            uint16_t observations_amount
+            size_t observations_amount
         ) :
             screen("Simulation", olc::P, "P"),
             root_observations_amount(root_observations_amount),
@@ -68,7 +88,7 @@ namespace ntf::cluster
             v2d_u16&& plane_size,
             v2d_u16&& offset,
             uint16_t root_observations_amount,
-            uint16_t observations_amount
+            size_t observations_amount
         ) :
             screen("Simulation", olc::P, "P"),
             root_observations_amount(root_observations_amount),
@@ -82,7 +102,7 @@ namespace ntf::cluster
     private:
         olc::Pixel get_cluster_color(size_t index)
         {
-            return VISUALLY_DISTINCT_COLORS[index % VISUALLY_DISTINCT_COLORS.size()];
+            return cluster_color(index);
         }
 
         v2d_i32 size_v2d_i32()
@@ -112,6 +132,8 @@ namespace ntf::cluster
 
         void generate_observations()
         {
+            this->worker.cancel();
+
             v2d_i32 plane_size = std::move(this->size_v2d_i32());
 
             this->clusters.clear();
@@ -119,44 +141,234 @@ namespace ntf::cluster
 
             this->clusters.push_back({ {}, plane_size / 2, VISUALLY_DISTINCT_COLORS[0] });
 
-            for (uint16_t i = 0; i < this->root_observations_amount; i++)
+            this->generator.distribution = std::make_shared<root_offset_distribution<int32_t>>(
+                v2d_i32{ 0, 0 },
+                plane_size - v2d_i32{ 1, 1 },
+                this->root_observations_amount,
+                v2d_i32{ static_cast<int32_t>(this->offset.x), static_cast<int32_t>(this->offset.y) }
+            );
+
+            this->generator.seed = this->random_engine();
+            this->generator.generate(this->observations, this->observations_amount);
+
+            bind_clusters(this->clusters, std::make_shared<const labeling<int32_t>>(this->observations));
+
+            this->index = std::make_shared<grid_index<int32_t>>(v2d_i32{ 0, 0 }, plane_size, this->observations.size());
+            this->index->update(this->observations);
+
+            for (auto& partitioner : this->partitioners)
+                partitioner->index = this->index;
+
+            this->partitioned = false;
+            this->renderer.invalidate();
+        }
+
+        // Grows the current observations up to observations_amount instead of generating new ones,
+        // so a partitioned simulation only needs to place the appended observations.
+        void append_observations()
+        {
+            this->worker.cancel();
+
+            this->generator.seed = this->random_engine();
+
+            // Appending may move the observations, leaving the clusters' labelings pointing at the
+            // old buffer; their labels are kept and rebound before anything reads them.
+            std::vector<label_t> previous_labels;
+
+            if (!this->clusters.empty() && this->clusters.front().observations.get_source())
+                previous_labels = this->clusters.front().observations.get_source()->labels;
+
+            previous_labels.resize(std::min(previous_labels.size(), this->observations.size()));
+
+            if (this->observations.size() < this->observations_amount)
+                this->generator.generate(this->observations, this->observations_amount - this->observations.size());
+
+            this->index->update(this->observations);
+
+            if (!this->partitioned)
             {
-                int_distribution x_distr(0, plane_size.x - 1);
-                int_distribution y_distr(0, plane_size.y - 1);
+                bind_clusters(this->clusters, std::make_shared<const labeling<int32_t>>(this->observations));
+                this->renderer.invalidate();
+
+                return;
+            }
 
-                v2d_i32 observation{ x_distr(this->random_engine), y_distr(this->random_engine) };
+            if (this->clusters.empty())
+            {
+                this->repartition();
+                this->renderer.invalidate();
 
-                this->observations.push_back(observation);
-                this->clusters[0].observations.push_back(std::make_shared<v2d_i32>(observation));
+                return;
             }
 
-            for (uint16_t i = root_observations_amount; i < this->observations_amount; i++)
+            // The warm start gets the previous labels only, so it knows which observations are new.
+            auto previous = std::make_shared<labeling<int32_t>>();
+
+            previous->observations = this->observations.data();
+            previous->labels = previous_labels;
+
+            // DBSCAN labels its noise one past the clusters.
+            size_t groups_amount = this->clusters.size();
+
+            for (label_t label : previous_labels)
+                groups_amount = std::max<size_t>(groups_amount, label + 1);
+
+            previous->group(groups_amount);
+
+            bind_clusters(this->clusters, std::shared_ptr<const labeling<int32_t>>(previous));
+            this->repartition();
+
+            // Until the first snapshot, appended observations are shown in the cluster of their
+            // nearest mean.
+            auto shown = std::make_shared<labeling<int32_t>>();
+
+            shown->observations = this->observations.data();
+            shown->labels = std::move(previous_labels);
+            shown->labels.resize(this->observations.size());
+
+            size_t appended_begin = previous->labels.size();
+
+            this->means_table.load(this->clusters);
+            this->means_table.nearest(this->observations.data() + appended_begin, this->observations.size() - appended_begin, shown->labels.data() + appended_begin);
+
+            shown->group(groups_amount);
+            bind_clusters(this->clusters, std::shared_ptr<const labeling<int32_t>>(shown));
+
+            this->renderer.invalidate();
+        }
+
+        // Binds clusters to a labeling of the current observations by their nearest means.
+        void bind_nearest(std::vector<cluster<int32_t>>& clusters)
+        {
+            auto assignment = std::make_shared<labeling<int32_t>>();
+
+            assignment->observations = this->observations.data();
+            assignment->labels.resize(this->observations.size());
+
+            this->means_table.load(clusters);
+            this->means_table.nearest(this->observations.data(), this->observations.size(), assignment->labels.data());
+
+            assignment->group(clusters.size());
+            bind_clusters(clusters, std::shared_ptr<const labeling<int32_t>>(assignment));
+        }
+
+        // Saves the observations and, once partitioned, the clusters next to the executable.
+        void save_simulation()
+        {
+            if (!write_dataset<int32_t>(DATASET_FILE_PATH, this->observations))
+                return;
+
+            if (this->partitioned && !this->worker.running())
+                write_partition(PARTITION_FILE_PATH, this->clusters, this->observations.size(), this->partitioning_profile);
+            else
+                std::remove(PARTITION_FILE_PATH);
+        }
+
+        // Restores what save_simulation wrote; the partition is only restored when it was
+        // computed on the loaded observations.
+        void load_simulation()
+        {
+            std::vector<v2d_i32> observations;
+
+            if (!read_dataset(DATASET_FILE_PATH, observations))
+                return;
+
+            this->replace_observations(std::move(observations));
+            this->partitioned = read_partition<int32_t>(PARTITION_FILE_PATH, this->observations, this->clusters, this->partitioning_profile);
+
+            if (this->partitioned)
+                this->renderer.invalidate();
+        }
+
+        // Loads x,y columns of CSV_FILE_PATH, keeping the current observations when it is unreadable.
+        void load_csv()
+        {
+            std::vector<v2d_i32> observations;
+
+            csv_loader<int32_t> loader;
+            loader.overlapped = true;
+
+            if (!loader.load(CSV_FILE_PATH, observations) || observations.empty())
+                return;
+
+            this->replace_observations(std::move(observations));
+        }
+
+        // Swaps in observations that were not generated, as a single unpartitioned cluster.
+        void replace_observations(std::vector<v2d_i32>&& observations)
+        {
+            this->worker.cancel();
+
+            this->observations = std::move(observations);
+            this->observations_amount = std::max<size_t>(this->observations.size(), 1);
+
+            // Loaded observations may lie outside the plane, so the index spans their own bounds.
+            this->index = std::make_shared<grid_index<int32_t>>(grid_index<int32_t>::from_observations(this->observations));
+
+            for (auto& partitioner : this->partitioners)
+                partitioner->index = this->index;
+
+            this->clusters.clear();
+            this->clusters.push_back({ {}, this->size_v2d_i32() / 2, VISUALLY_DISTINCT_COLORS[0] });
+
+            bind_clusters(this->clusters, std::make_shared<const labeling<int32_t>>(this->observations));
+
+            this->partitioned = false;
+            this->renderer.invalidate();
+        }
+
+        void repartition()
+        {
+            this->worker.start(this->current_partitioner(), this->observations, this->clusters);
+        }
+
+        // Shows the latest snapshot of a running partition, or its result once it finished.
+        void update_partitioning()
+        {
+            if (this->worker.take_result(this->clusters, this->partitioning_profile))
             {
-                int_distribution i_distr(0, static_cast<int>(this->observations.size()) - 1);
+                this->renderer.invalidate();
+                return;
+            }
 
-                auto& random_cell = this->observations[i_distr(this->random_engine)];
+            if (!this->worker.poll(this->snapshot))
+                return;
+
+            size_t clusters_amount = this->snapshot.means.size();
+            std::vector<cluster<int32_t>> clusters(clusters_amount);
+
+            for (size_t i = 0; i < clusters_amount; i++)
+            {
+                clusters[i].mean = this->snapshot.means[i];
+                clusters[i].color = this->get_cluster_color(i);
+            }
 
-                int_distribution x_offset_distr(this->offset.x * -1, this->offset.x);
-                int_distribution y_offset_distr(this->offset.y * -1, this->offset.y);
+            if (this->snapshot.labels.size() == this->observations.size())
+            {
+                auto assignment = std::make_shared<labeling<int32_t>>();
 
-                v2d_i32 offset_pos{ x_offset_distr(this->random_engine), y_offset_distr(this->random_engine) };
-                v2d_i32 observation{ random_cell + offset_pos };
+                assignment->observations = this->observations.data();
+                assignment->labels = this->snapshot.labels;
+                assignment->group(clusters_amount);
 
-                this->observations.push_back(observation);
-                this->clusters[0].observations.push_back(std::make_shared<v2d_i32>(observation));
+                bind_clusters(clusters, std::shared_ptr<const labeling<int32_t>>(assignment));
             }
+
+            // Partitioners without labels mid-run are shown by the nearest of their current means.
+            else if (clusters_amount > 0)
+                this->bind_nearest(clusters);
+
+            this->clusters = std::move(clusters);
+            this->partitioning_profile.iterations = this->snapshot.iteration;
+            this->renderer.invalidate();
         }
 
         void draw_observations()
         {
+            this->renderer.draw(*this->window, this->clusters, this->world_offset, this->world_scale);
+
             for (auto& cluster : this->clusters)
             {
-                for (auto& observation : cluster.observations)
-                {
-                    auto position = std::move(this->world_to_screen(*observation));
-                    this->window->FillCircle(position, 1, cluster.color);
-                }
-
                 auto mean_pos = std::move(this->world_to_screen(cluster.mean));
                     
                 this->window->FillCircle(mean_pos, 3, olc::BLACK);
@@ -204,9 +416,21 @@ namespace ntf::cluster
                 }
             );
 
+            std::string clusters_str = "Clusters: " + std::to_string(this->clusters.size());
+
+            if (auto selection = std::dynamic_pointer_cast<k_selection<int32_t>>(this->current_partitioner()))
+            {
+                if (selection->recommended_k > 0)
+                    clusters_str += " (elbow " + std::to_string(selection->elbow_k) + ", silhouette " + std::to_string(selection->silhouette_k)
+                        + ", gap " + std::to_string(selection->gap_k) + ")";
+            }
+
+            if (auto density = std::dynamic_pointer_cast<dbscan<int32_t>>(this->current_partitioner()))
+                clusters_str += " (noise " + std::to_string(density->noise.size()) + ")";
+
             this->window->DrawString(
                 { BASE_GAP, this->window->ScreenHeight() - STRING_HEIGHT * 3 - BASE_GAP },
-                "Clusters: " + std::to_string(this->clusters.size())
+                clusters_str
             );
 
             this->window->DrawString(
@@ -214,7 +438,18 @@ namespace ntf::cluster
                 "Iterations: " + std::to_string(this->partitioning_profile.iterations)
             );
 
-            uint64_t elapsed_time = this->partitioning_profile.elapsed_time.count();
+            if (this->worker.running())
+            {
+                this->window->DrawString(
+                    { BASE_GAP, this->window->ScreenHeight() - STRING_HEIGHT * 4 - BASE_GAP },
+                    "Partitioning... (C to cancel)",
+                    olc::YELLOW
+                );
+            }
+
+            uint64_t elapsed_time = this->worker.running()
+                ? this->worker.elapsed().count()
+                : this->partitioning_profile.elapsed_time.count();
 
             std::string elapsed_time_str = std::to_string(elapsed_time);
             std::string time_unit = "micrs";
@@ -319,7 +554,7 @@ namespace ntf::cluster
             else if (this->window->GetKey(olc::CTRL).bHeld && this->window->GetKey(olc::EQUALS).bPressed)
             {
                 this->observations_amount += OBSERVATIONS_INC;
-                this->generate_observations();
+                this->append_observations();
             }
 
             else if (this->window->GetKey(olc::CTRL).bHeld && this->window->GetKey(olc::MINUS).bPressed)
@@ -329,30 +564,68 @@ namespace ntf::cluster
             }
 
             else if (this->window->GetKey(olc::CTRL).bHeld && this->window->GetKey(olc::K).bPressed)
+            {
+                this->worker.cancel();
                 this->current_partitioner()->param++;
 
+                if (this->partitioned)
+                    this->repartition();
+            }
+
             else if (this->window->GetKey(olc::CTRL).bHeld && this->window->GetKey(olc::J).bPressed)
+            {
+                this->worker.cancel();
                 this->current_partitioner()->param--;
 
+                if (this->partitioned)
+                    this->repartition();
+            }
+
+            else if (this->window->GetKey(olc::CTRL).bHeld && this->window->GetKey(olc::S).bPressed)
+                this->save_simulation();
+
+            else if (this->window->GetKey(olc::CTRL).bHeld && this->window->GetKey(olc::L).bPressed)
+                this->load_simulation();
+
+            else if (this->window->GetKey(olc::CTRL).bHeld && this->window->GetKey(olc::O).bPressed)
+                this->load_csv();
+
             else if (this->window->GetKey(olc::SHIFT).bHeld && this->window->GetKey(olc::TAB).bPressed)
             {
                 if (this->current_partitioner_index == 0)
                     this->current_partitioner_index = this->partitioners.size() - 1;
                 else
                     this->current_partitioner_index = (this->current_partitioner_index - 1) % this->partitioners.size();
+
+                if (this->partitioned)
+                    this->repartition();
             }
 
             else if (this->window->GetKey(olc::TAB).bPressed)
+            {
                 this->current_partitioner_index = (this->current_partitioner_index + 1) % this->partitioners.size();
 
+                if (this->partitioned)
+                    this->repartition();
+            }
+
             else if (this->window->GetKey(olc::S).bPressed)
             {
-                this->clusters = std::move(this->current_partitioner()->partition(this->observations, this->partitioning_profile));
+                this->worker.start(this->current_partitioner(), this->observations);
+                this->partitioned = true;
+            }
+
+            else if (this->window->GetKey(olc::C).bPressed)
+            {
+                this->worker.cancel();
+                this->partitioned = false;
             }
 
             else if (this->window->GetKey(olc::R).bPressed)
                 this->generate_observations();
 
+            this->update_partitioning();
+
             this->zoom_and_pan(elapsed_time);
             this->draw_observations();
             this->draw_axis();
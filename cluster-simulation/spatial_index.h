@@ -0,0 +1,349 @@
+#pragma once
+#include <cmath>
+#include <limits>
+#include <queue>
+#include "cluster.h"
+#include "nearest_mean.h"
+#include "thread_pool.h"
+
+namespace ntf::cluster
+{
+    // Uniform grid over an observation set. Cells keep the indices of their observations and the
+    // bounding box of the observations actually inside them, so points outside the grid's extent
+    // are clamped into border cells without making any query or pruning decision inexact.
+    template <typename T = int32_t>
+    class grid_index
+    {
+    public:
+        static constexpr size_t DEFAULT_POINTS_PER_CELL = 32;
+
+        // Cells handed to one thread pool task during filtered assignment.
+        static constexpr size_t CELLS_PER_TASK = 256;
+
+        struct cell
+        {
+            std::vector<size_t> indices;
+
+            v2d<double> min{ std::numeric_limits<double>::infinity(), std::numeric_limits<double>::infinity() };
+            v2d<double> max{ -std::numeric_limits<double>::infinity(), -std::numeric_limits<double>::infinity() };
+        };
+
+    private:
+        const v2d<T>* observations = nullptr;
+        size_t indexed_amount = 0;
+
+        v2d<double> origin{ 0, 0 };
+        double cell_size = 1;
+        size_t columns = 1;
+        size_t rows = 1;
+
+        std::vector<cell> cells;
+
+        static double squared(double value)
+        {
+            return value * value;
+        }
+
+        size_t column_of(double x) const
+        {
+            double column = std::floor((x - this->origin.x) / this->cell_size);
+            return static_cast<size_t>(std::clamp(column, 0.0, static_cast<double>(this->columns - 1)));
+        }
+
+        size_t row_of(double y) const
+        {
+            double row = std::floor((y - this->origin.y) / this->cell_size);
+            return static_cast<size_t>(std::clamp(row, 0.0, static_cast<double>(this->rows - 1)));
+        }
+
+        void insert(size_t index)
+        {
+            double x = static_cast<double>(this->observations[index].x);
+            double y = static_cast<double>(this->observations[index].y);
+
+            auto& cell = this->cells[this->row_of(y) * this->columns + this->column_of(x)];
+
+            cell.indices.push_back(index);
+            cell.min = { std::min(cell.min.x, x), std::min(cell.min.y, y) };
+            cell.max = { std::max(cell.max.x, x), std::max(cell.max.y, y) };
+        }
+
+        static double min_squared_distance(const cell& cell, double x, double y)
+        {
+            double dx = std::max({ cell.min.x - x, 0.0, x - cell.max.x });
+            double dy = std::max({ cell.min.y - y, 0.0, y - cell.max.y });
+
+            return dx * dx + dy * dy;
+        }
+
+        static double max_squared_distance(const cell& cell, double x, double y)
+        {
+            double dx = std::max(std::abs(x - cell.min.x), std::abs(x - cell.max.x));
+            double dy = std::max(std::abs(y - cell.min.y), std::abs(y - cell.max.y));
+
+            return dx * dx + dy * dy;
+        }
+
+        double squared_distance(size_t index, double x, double y) const
+        {
+            return grid_index::squared(static_cast<double>(this->observations[index].x) - x)
+                + grid_index::squared(static_cast<double>(this->observations[index].y) - y);
+        }
+
+    public:
+        grid_index(
+            const v2d<T>& plane_start,
+            const v2d<T>& plane_end,
+            size_t expected_observations,
+            size_t points_per_cell = DEFAULT_POINTS_PER_CELL
+        )
+        {
+            double width = std::max(static_cast<double>(plane_end.x) - static_cast<double>(plane_start.x), 1.0);
+            double height = std::max(static_cast<double>(plane_end.y) - static_cast<double>(plane_start.y), 1.0);
+            double cells_amount = std::max(static_cast<double>(expected_observations) / std::max<size_t>(points_per_cell, 1), 1.0);
+
+            this->origin = { static_cast<double>(plane_start.x), static_cast<double>(plane_start.y) };
+            this->cell_size = std::sqrt(width * height / cells_amount);
+            this->columns = std::max<size_t>(static_cast<size_t>(std::ceil(width / this->cell_size)), 1);
+            this->rows = std::max<size_t>(static_cast<size_t>(std::ceil(height / this->cell_size)), 1);
+            this->cells.resize(this->columns * this->rows);
+        }
+
+        static grid_index from_observations(observation_span<T> observations, size_t points_per_cell = DEFAULT_POINTS_PER_CELL)
+        {
+            v2d<T> plane_start = observations.empty() ? v2d<T>{} : observations[0];
+            v2d<T> plane_end = plane_start;
+
+            for (auto& observation : observations)
+            {
+                plane_start = { std::min(plane_start.x, observation.x), std::min(plane_start.y, observation.y) };
+                plane_end = { std::max(plane_end.x, observation.x), std::max(plane_end.y, observation.y) };
+            }
+
+            grid_index index(plane_start, plane_end, observations.size(), points_per_cell);
+            index.update(observations);
+
+            return index;
+        }
+
+        size_t size() const
+        {
+            return this->indexed_amount;
+        }
+
+        bool covers(observation_span<T> observations) const
+        {
+            return this->observations == observations.data() && this->indexed_amount == observations.size();
+        }
+
+        const std::vector<cell>& get_cells() const
+        {
+            return this->cells;
+        }
+
+        // Indexes observations appended since the last update. Use rebuild when existing
+        // observations were changed or removed.
+        void update(observation_span<T> observations)
+        {
+            if (observations.size() < this->indexed_amount)
+                return this->rebuild(observations);
+
+            this->observations = observations.data();
+
+            for (size_t i = this->indexed_amount; i < observations.size(); i++)
+                this->insert(i);
+
+            this->indexed_amount = observations.size();
+        }
+
+        void rebuild(observation_span<T> observations)
+        {
+            for (auto& cell : this->cells)
+                cell = {};
+
+            this->indexed_amount = 0;
+            this->update(observations);
+        }
+
+        void radius(const v2d<T>& point, double radius, std::vector<size_t>& result) const
+        {
+            double x = static_cast<double>(point.x);
+            double y = static_cast<double>(point.y);
+            double radius_squared = radius * radius;
+
+            result.clear();
+
+            for (size_t row = this->row_of(y - radius); row <= this->row_of(y + radius); row++)
+            {
+                for (size_t column = this->column_of(x - radius); column <= this->column_of(x + radius); column++)
+                {
+                    auto& cell = this->cells[row * this->columns + column];
+
+                    if (cell.indices.empty() || grid_index::min_squared_distance(cell, x, y) > radius_squared)
+                        continue;
+
+                    for (size_t index : cell.indices)
+                    {
+                        if (this->squared_distance(index, x, y) <= radius_squared)
+                            result.push_back(index);
+                    }
+                }
+            }
+        }
+
+        // Indices of the k observations closest to point, nearest first.
+        std::vector<size_t> k_nearest(const v2d<T>& point, size_t k) const
+        {
+            double x = static_cast<double>(point.x);
+            double y = static_cast<double>(point.y);
+
+            size_t center_column = this->column_of(x);
+            size_t center_row = this->row_of(y);
+
+            std::priority_queue<std::pair<double, size_t>> nearest;
+            size_t max_ring = std::max(this->columns, this->rows);
+
+            for (size_t ring = 0; ring <= max_ring && k > 0; ring++)
+            {
+                // Every cell of this ring is at least (ring - 1) cells away from the point.
+                if (nearest.size() == k && ring > 0 && grid_index::squared((ring - 1) * this->cell_size) > nearest.top().first)
+                    break;
+
+                size_t row_begin = center_row >= ring ? center_row - ring : 0;
+                size_t row_end = std::min(center_row + ring, this->rows - 1);
+                size_t column_begin = center_column >= ring ? center_column - ring : 0;
+                size_t column_end = std::min(center_column + ring, this->columns - 1);
+
+                for (size_t row = row_begin; row <= row_end; row++)
+                {
+                    for (size_t column = column_begin; column <= column_end; column++)
+                    {
+                        bool on_ring = row == center_row - ring || row == center_row + ring
+                            || column == center_column - ring || column == center_column + ring;
+
+                        auto& cell = this->cells[row * this->columns + column];
+
+                        if (!on_ring || cell.indices.empty())
+                            continue;
+
+                        if (nearest.size() == k && grid_index::min_squared_distance(cell, x, y) > nearest.top().first)
+                            continue;
+
+                        for (size_t index : cell.indices)
+                        {
+                            double distance = this->squared_distance(index, x, y);
+
+                            if (nearest.size() < k)
+                                nearest.push({ distance, index });
+
+                            else if (distance < nearest.top().first)
+                            {
+                                nearest.pop();
+                                nearest.push({ distance, index });
+                            }
+                        }
+                    }
+                }
+            }
+
+            std::vector<size_t> result(nearest.size());
+
+            for (size_t i = result.size(); i > 0; i--)
+            {
+                result[i - 1] = nearest.top().second;
+                nearest.pop();
+            }
+
+            return result;
+        }
+
+        // Filtering assignment: means that cannot be the nearest to any point of a cell are pruned
+        // using the cell's bounding box, and a cell left with a single candidate is assigned without
+        // looking at its points. Labels match a full scan, ties included. Returns the number of
+        // point and bounding box distance evaluations performed.
+        size_t assign(const mean_table<>& means, label_t* labels, thread_pool* pool = nullptr) const
+        {
+            size_t tasks_amount = (this->cells.size() + CELLS_PER_TASK - 1) / CELLS_PER_TASK;
+            std::vector<size_t> task_evaluations(tasks_amount, 0);
+
+            auto task = [&](size_t task_index) {
+                std::vector<label_t> candidates;
+                size_t evaluations = 0;
+
+                size_t end = std::min((task_index + 1) * CELLS_PER_TASK, this->cells.size());
+
+                for (size_t c = task_index * CELLS_PER_TASK; c < end; c++)
+                {
+                    auto& cell = this->cells[c];
+
+                    if (cell.indices.empty())
+                        continue;
+
+                    double closest_max_distance = std::numeric_limits<double>::infinity();
+
+                    for (size_t j = 0; j < means.x.size(); j++)
+                        closest_max_distance = std::min(closest_max_distance, grid_index::max_squared_distance(cell, means.x[j], means.y[j]));
+
+                    candidates.clear();
+
+                    for (size_t j = 0; j < means.x.size(); j++)
+                    {
+                        if (grid_index::min_squared_distance(cell, means.x[j], means.y[j]) <= closest_max_distance)
+                            candidates.push_back(static_cast<label_t>(j));
+                    }
+
+                    evaluations += means.x.size() * 2;
+
+                    if (candidates.size() == 1)
+                    {
+                        for (size_t index : cell.indices)
+                            labels[index] = candidates.front();
+
+                        continue;
+                    }
+
+                    for (size_t index : cell.indices)
+                    {
+                        double x = static_cast<double>(this->observations[index].x);
+                        double y = static_cast<double>(this->observations[index].y);
+
+                        double closest_distance = std::numeric_limits<double>::infinity();
+                        label_t closest = candidates.front();
+
+                        for (label_t candidate : candidates)
+                        {
+                            double dx = x - means.x[candidate];
+                            double dy = y - means.y[candidate];
+                            double distance = dx * dx + dy * dy;
+
+                            if (distance < closest_distance)
+                            {
+                                closest_distance = distance;
+                                closest = candidate;
+                            }
+                        }
+
+                        labels[index] = closest;
+                    }
+
+                    evaluations += cell.indices.size() * candidates.size();
+                }
+
+                task_evaluations[task_index] = evaluations;
+            };
+
+            if (pool)
+                pool->run(tasks_amount, task);
+
+            else for (size_t i = 0; i < tasks_amount; i++)
+                task(i);
+
+            size_t evaluations = 0;
+
+            for (size_t task_evaluation : task_evaluations)
+                evaluations += task_evaluation;
+
+            return evaluations;
+        }
+    };
+}
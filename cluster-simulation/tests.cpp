@@ -0,0 +1,1030 @@
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include "birch.h"
+#include "coreset.h"
+#include "csv_loader.h"
+#include "dataset_file.h"
+#include "dataset_generator.h"
+#include "dbscan.h"
+#include "ensemble.h"
+#include "k_means.h"
+#include "k_selection.h"
+#include "sharded_k_means.h"
+
+// Invariants the partitioners promise, checked on small seeded datasets. Every check that fails
+// is reported; the exit code is the number of failures.
+namespace ntf::cluster::tests
+{
+    constexpr uint64_t SEED = 7;
+    constexpr size_t THREADS = 4;
+
+    size_t failures = 0;
+
+    void check(bool condition, const std::string& what)
+    {
+        if (condition)
+            return;
+
+        std::cerr << "FAILED: " << what << '\n';
+        failures++;
+    }
+
+    std::vector<v2d<int32_t>> generate(size_t amount, size_t threads = 1, uint64_t seed = SEED)
+    {
+        auto model = std::make_shared<root_offset_distribution<int32_t>>(v2d<int32_t>{ 0, 0 }, v2d<int32_t>{ 9999, 9999 }, 20, v2d<int32_t>{ 100, 100 });
+        return dataset_generator<int32_t>(model, seed, threads).generate(amount);
+    }
+
+    const std::vector<label_t>& labels_of(const std::vector<cluster<int32_t>>& clusters)
+    {
+        static const std::vector<label_t> none;
+
+        if (clusters.empty() || !clusters.front().observations.get_source())
+            return none;
+
+        return clusters.front().observations.get_source()->labels;
+    }
+
+    bool same_partition(const std::vector<cluster<int32_t>>& a, const std::vector<cluster<int32_t>>& b)
+    {
+        if (a.size() != b.size() || labels_of(a) != labels_of(b))
+            return false;
+
+        for (size_t i = 0; i < a.size(); i++)
+        {
+            if (!(a[i].mean == b[i].mean))
+                return false;
+        }
+
+        return true;
+    }
+
+    template <typename P>
+    std::vector<cluster<int32_t>> run(P& partitioner, observation_span<int32_t> observations, size_t param, partitioning_profile& profile, uint64_t seed = SEED)
+    {
+        partitioner.param = static_cast<uint8_t>(param);
+        partitioner.seed(static_cast<std::default_random_engine::result_type>(seed));
+
+        return partitioner.partition(observations, profile);
+    }
+
+    template <typename P>
+    std::vector<cluster<int32_t>> run(P& partitioner, observation_span<int32_t> observations, size_t param)
+    {
+        partitioning_profile profile;
+        return run(partitioner, observations, param, profile);
+    }
+
+    // Every observation is a member of exactly one cluster, the one its label names, and members
+    // are listed in observation order.
+    bool consistent_labeling(const std::vector<cluster<int32_t>>& clusters, observation_span<int32_t> observations)
+    {
+        if (clusters.empty())
+            return observations.empty();
+
+        auto& source = clusters.front().observations.get_source();
+
+        if (!source || source->observations != observations.data() || source->labels.size() != observations.size())
+            return false;
+
+        if (source->offsets.size() < clusters.size() + 1 || source->offsets.front() != 0 || source->offsets.back() != observations.size())
+            return false;
+
+        std::vector<char> seen(observations.size(), 0);
+        size_t members = 0;
+
+        for (size_t i = 0; i < clusters.size(); i++)
+        {
+            auto& range = clusters[i].observations;
+
+            if (range.get_source() != source)
+                return false;
+
+            for (size_t position = 0; position < range.size(); position++)
+            {
+                size_t index = range.index(position);
+
+                if (index >= observations.size() || seen[index] || source->labels[index] != i || !(range[position] == observations[index]))
+                    return false;
+
+                if (position > 0 && range.index(position - 1) >= index)
+                    return false;
+
+                seen[index] = 1;
+                members++;
+            }
+        }
+
+        return members == observations.size();
+    }
+
+    // Total squared distance of the observations to their nearest mean.
+    double nearest_inertia(const std::vector<cluster<int32_t>>& clusters, observation_span<int32_t> observations)
+    {
+        double total = 0;
+
+        for (auto& observation : observations)
+        {
+            double nearest = std::numeric_limits<double>::infinity();
+
+            for (auto& cluster : clusters)
+                nearest = std::min(nearest, squared_distance<2>(observation, cluster.mean));
+
+            total += nearest;
+        }
+
+        return total;
+    }
+
+#ifndef _WIN32
+    void serve_shard(shard_channel& channel)
+    {
+        shard_worker<int32_t>().serve(channel);
+    }
+
+    // Runs first, since the workers are forked from this process.
+    void sharded_matches_local()
+    {
+        local_shard_processes processes;
+
+        if (!processes.spawn(2, serve_shard))
+        {
+            check(false, "shard workers start");
+            return;
+        }
+
+        std::vector<shard_channel*> channels;
+
+        for (auto& channel : processes.channels)
+            channels.push_back(channel.get());
+
+        // With this seed, many clusters over few observations leave some empty, which exercises
+        // the repair.
+        for (auto [amount, k] : { std::pair<size_t, size_t>{ 500, 100 }, { 40000, 8 } })
+        {
+            auto observations = generate(amount, 1, 1);
+
+            for (auto repair : { empty_cluster_repair::farthest_point, empty_cluster_repair::split_largest, empty_cluster_repair::steal_largest })
+            {
+                k_means<int32_t> local;
+                sharded_k_means<int32_t> sharded(channels);
+
+                local.repair = repair;
+                sharded.repair = repair;
+
+                partitioning_profile local_profile;
+                partitioning_profile sharded_profile;
+
+                auto expected = run(local, observations, k, local_profile, 1);
+                auto actual = run(sharded, observations, k, sharded_profile, 1);
+
+                std::string name = "sharded K means matches K means, n=" + std::to_string(amount) + " k=" + std::to_string(k);
+
+                if (amount == 500)
+                    check(local_profile.repaired_clusters > 0, name + ": clusters were repaired");
+
+                check(sharded.shards.size() == channels.size(), name + ": shards kept");
+                check(same_partition(expected, actual), name);
+                check(local_profile.repaired_clusters == sharded_profile.repaired_clusters, name + ": repaired clusters");
+                check(local_profile.reassigned_observations == sharded_profile.reassigned_observations, name + ": reassigned observations");
+            }
+        }
+
+        sharded_k_means<int32_t>(channels).stop_shards();
+    }
+#endif
+
+    void labelings_are_consistent()
+    {
+        labeling<int32_t> grouped;
+
+        grouped.labels = { 2, 0, 2, 1, 0 };
+        grouped.group(4);
+
+        check(grouped.offsets == std::vector<size_t>{ 0, 2, 3, 5, 5 }, "labeling offsets count each label");
+        check(grouped.indices == std::vector<size_t>{ 1, 4, 3, 0, 2 }, "labeling indices grouped by label in observation order");
+
+        auto observations = generate(20000);
+
+        for (size_t k : { 1, 8, 40 })
+        {
+            k_means<int32_t> partitioner(THREADS);
+            auto clusters = run(partitioner, observations, k);
+
+            check(clusters.size() == k && consistent_labeling(clusters, observations), "K means labeling is consistent, k=" + std::to_string(k));
+        }
+    }
+
+    void generation_ignores_threads()
+    {
+        check(generate(150000, 1) == generate(150000, THREADS), "generated observations do not depend on threads");
+
+        auto model = std::make_shared<gaussian_blobs_distribution<int32_t>>(v2d<int32_t>{ 0, 0 }, v2d<int32_t>{ 9999, 9999 }, 20, 100.0, 500.0);
+
+        std::vector<v2d<int32_t>> serial;
+        std::vector<v2d<int32_t>> parallel;
+
+        dataset_generator<int32_t> serial_generator(model, SEED, 1);
+        dataset_generator<int32_t> parallel_generator(model, SEED, THREADS);
+
+        serial_generator.generate(serial, 100000);
+        serial_generator.generate(serial, 50000);
+        parallel_generator.generate(parallel, 100000);
+        parallel_generator.generate(parallel, 50000);
+
+        check(serial == parallel, "appended observations do not depend on threads");
+    }
+
+    void k_means_ignores_threads()
+    {
+        auto observations = generate(50000);
+
+        for (auto seeding : { seeding_strategy::random, seeding_strategy::k_means_plus_plus, seeding_strategy::k_means_parallel })
+        {
+            k_means<int32_t> serial(1);
+            k_means<int32_t> parallel(THREADS);
+
+            serial.seeding = seeding;
+            parallel.seeding = seeding;
+
+            check(same_partition(run(serial, observations, 8), run(parallel, observations, 8)), "K means does not depend on threads, seeding " + std::to_string(static_cast<int>(seeding)));
+        }
+    }
+
+    void k_means_stops_by_criteria()
+    {
+        auto observations = generate(30000);
+
+        auto stop = [&](const convergence_criteria& convergence, partitioning_profile& profile, bool cancelled = false) {
+            k_means<int32_t> partitioner(THREADS);
+            partitioner.convergence = convergence;
+
+            partitioner.param = 8;
+            partitioner.seed(SEED);
+            partitioner.cancelled = cancelled;
+
+            return partitioner.partition(observations, profile);
+        };
+
+        partitioning_profile converged;
+        stop({}, converged);
+
+        bool non_increasing = true;
+
+        for (size_t i = 1; i < converged.iteration_history.size(); i++)
+            non_increasing = non_increasing && converged.iteration_history[i].inertia <= converged.iteration_history[i - 1].inertia;
+
+        check(converged.stopped_by == stop_reason::converged && converged.iterations > 2, "K means runs to a fixed point by default");
+        check(non_increasing, "K means inertia never increases");
+
+        partitioning_profile capped;
+        stop({ 0, 0, 2 }, capped);
+
+        check(capped.stopped_by == stop_reason::max_iterations && capped.iterations == 2, "K means stops at the iteration cap");
+
+        partitioning_profile shifted;
+        stop({ 1e9, 0, 300 }, shifted);
+
+        check(shifted.stopped_by == stop_reason::mean_shift && shifted.iterations == 1, "K means stops once means move less than the shift");
+
+        partitioning_profile flattened;
+        stop({ 0, 0.5, 300 }, flattened);
+
+        auto& history = flattened.iteration_history;
+
+        check(flattened.stopped_by == stop_reason::inertia_change && history.size() >= 2
+            && history[history.size() - 2].inertia - history.back().inertia <= 0.5 * history[history.size() - 2].inertia, "K means stops once inertia flattens");
+
+        partitioning_profile cancelled;
+        stop({}, cancelled, true);
+
+        check(cancelled.stopped_by == stop_reason::cancelled && cancelled.iterations == 0, "K means stops when cancelled");
+
+        // Sums near the coordinate limit must not overflow.
+        std::vector<v2d<int32_t>> far;
+        double x = 0;
+        double y = 0;
+
+        for (int32_t i = 0; i < 1000; i++)
+        {
+            far.push_back({ INT32_MAX - i, INT32_MAX - 2 * i });
+
+            x += far.back().x;
+            y += far.back().y;
+        }
+
+        k_means<int32_t> single;
+        auto clusters = run(single, far, 1);
+
+        check(clusters.size() == 1 && clusters[0].mean == v2d<int32_t>{ to_coordinate<int32_t>(x / 1000), to_coordinate<int32_t>(y / 1000) }, "K means sums coordinates without overflow");
+    }
+
+    void seeding_handles_few_observations()
+    {
+        auto observations = generate(64);
+
+        k_means<int32_t> partitioner;
+        partitioner.param = 64;
+
+        auto means = partitioner.get_random_means(observations);
+        std::sort(means.begin(), means.end(), [](auto& a, auto& b) { return a.x != b.x ? a.x < b.x : a.y < b.y; });
+
+        auto sorted = observations;
+        std::sort(sorted.begin(), sorted.end(), [](auto& a, auto& b) { return a.x != b.x ? a.x < b.x : a.y < b.y; });
+
+        check(means == sorted, "random seeding picks distinct observations");
+
+        // More clusters than observations: the extra means are duplicates instead of a search
+        // that never ends.
+        auto few = generate(5);
+
+        for (auto seeding : { seeding_strategy::random, seeding_strategy::k_means_plus_plus, seeding_strategy::k_means_parallel })
+        {
+            k_means<int32_t> seeded;
+            seeded.seeding = seeding;
+
+            auto clusters = run(seeded, few, 10);
+
+            check(clusters.size() == 10 && consistent_labeling(clusters, few), "K means with K above the observations, seeding " + std::to_string(static_cast<int>(seeding)));
+        }
+    }
+
+    void hamerly_matches_k_means()
+    {
+        auto observations = generate(50000);
+
+        for (size_t k : { 1, 8, 40 })
+        {
+            k_means<int32_t> lloyd(THREADS);
+            hamerly_k_means<int32_t> hamerly(THREADS);
+
+            check(same_partition(run(lloyd, observations, k), run(hamerly, observations, k)), "Hamerly K means matches K means, k=" + std::to_string(k));
+        }
+    }
+
+    void grid_index_matches_brute_force()
+    {
+        auto observations = generate(10000);
+
+        // Indexed in two steps, so appended observations go through update.
+        auto index = grid_index<int32_t>::from_observations({ observations.data(), 6000 });
+        index.update(observations);
+
+        check(index.covers(observations), "grid index covers appended observations");
+
+        std::vector<v2d<int32_t>> queries{ observations[17], observations[9000], { 5000, 5000 }, { -700, -300 }, { 12000, 4000 } };
+        std::vector<size_t> found;
+
+        bool radius_exact = true;
+        bool k_nearest_exact = true;
+
+        for (auto& query : queries)
+        {
+            for (double radius : { 0.0, 150.0, 900.0 })
+            {
+                index.radius(query, radius, found);
+                std::sort(found.begin(), found.end());
+
+                std::vector<size_t> expected;
+
+                for (size_t i = 0; i < observations.size(); i++)
+                {
+                    if (squared_distance<2>(observations[i], query) <= radius * radius)
+                        expected.push_back(i);
+                }
+
+                radius_exact = radius_exact && found == expected;
+            }
+
+            std::vector<double> distances;
+
+            for (auto& observation : observations)
+                distances.push_back(squared_distance<2>(observation, query));
+
+            std::sort(distances.begin(), distances.end());
+
+            for (size_t k : { 1, 7, 64 })
+            {
+                auto nearest = index.k_nearest(query, k);
+                bool exact = nearest.size() == k;
+
+                for (size_t i = 0; exact && i < k; i++)
+                    exact = squared_distance<2>(observations[nearest[i]], query) == distances[i];
+
+                k_nearest_exact = k_nearest_exact && exact;
+            }
+        }
+
+        check(radius_exact, "grid index radius queries match brute force");
+        check(k_nearest_exact, "grid index k nearest match brute force");
+
+        // Filtered assignment labels like a full scan.
+        for (size_t k : { 1, 8, 40 })
+        {
+            k_means<int32_t> scanned(THREADS);
+            k_means<int32_t> filtered(THREADS);
+
+            filtered.index = std::make_shared<grid_index<int32_t>>(index);
+
+            partitioning_profile profile;
+            auto expected = run(scanned, observations, k);
+
+            check(same_partition(expected, run(filtered, observations, k, profile)), "indexed K means matches K means, k=" + std::to_string(k));
+            check(k == 1 || profile.skipped_distance_evaluations > 0, "indexed K means prunes means, k=" + std::to_string(k));
+        }
+
+        for (auto& observation : observations)
+            observation = { observation.y, observation.x };
+
+        index.rebuild(observations);
+        index.radius(queries[2], 900, found);
+
+        size_t expected = 0;
+
+        for (auto& observation : observations)
+            expected += squared_distance<2>(observation, queries[2]) <= 900.0 * 900.0;
+
+        check(found.size() == expected, "rebuilt grid index reflects moved observations");
+    }
+
+    void k_means_warm_starts()
+    {
+        auto model = std::make_shared<root_offset_distribution<int32_t>>(v2d<int32_t>{ 0, 0 }, v2d<int32_t>{ 9999, 9999 }, 20, v2d<int32_t>{ 100, 100 });
+        dataset_generator<int32_t> generator(model, SEED, 1);
+
+        auto observations = generator.generate(20000);
+        auto grown = observations;
+        generator.generate(grown, 5000);
+
+        k_means<int32_t> partitioner;
+        partitioning_profile cold_profile;
+
+        auto previous = run(partitioner, observations, 6, cold_profile);
+
+        partitioning_profile profile;
+        auto same = partitioner.repartition(observations, previous, profile);
+
+        check(same_partition(previous, same) && profile.iterations < cold_profile.iterations, "K means warm start at a fixed point stays there");
+
+        partitioner.param = 9;
+        auto split = partitioner.repartition(observations, previous, profile);
+
+        check(split.size() == 9 && consistent_labeling(split, observations), "K means warm start splits clusters up to K");
+        check(dissimilarity(split) < dissimilarity(previous), "K means warm start with more clusters lowers the dissimilarity");
+
+        partitioner.param = 3;
+        auto merged = partitioner.repartition(observations, previous, profile);
+
+        check(merged.size() == 3 && consistent_labeling(merged, observations), "K means warm start merges clusters down to K");
+
+        partitioner.param = 6;
+        auto appended = partitioner.repartition(grown, previous, profile);
+
+        check(appended.size() == 6 && consistent_labeling(appended, grown), "K means warm start absorbs appended observations");
+    }
+
+    void mini_batch_k_means_streams()
+    {
+        auto observations = generate(40000);
+
+        k_means<int32_t> lloyd(THREADS);
+        double reference = dissimilarity(run(lloyd, observations, 8));
+
+        mini_batch_k_means<int32_t> batched(THREADS);
+        auto clusters = run(batched, observations, 8);
+
+        check(consistent_labeling(clusters, observations), "mini-batch K means labeling is consistent");
+        check(dissimilarity(clusters) <= reference * 1.2, "mini-batch K means stays near K means");
+
+        mini_batch_k_means<int32_t> streamed;
+        streamed.param = 8;
+
+        for (size_t begin = 0; begin < observations.size(); begin += 1000)
+            streamed.consume({ observations.data() + begin, 1000 });
+
+        auto streamed_clusters = streamed.streamed_clusters();
+
+        check(streamed_clusters.size() == 8, "streamed K means keeps K means");
+        check(nearest_inertia(streamed_clusters, observations) <= reference * 1.5, "streamed K means stays near K means");
+
+        // Lowering K while streaming merges means instead of seeding past K.
+        streamed.param = 3;
+        streamed.consume({ observations.data(), 1000 });
+
+        size_t counted = 0;
+
+        for (size_t count : streamed.streamed_counts)
+            counted += count;
+
+        check(streamed.streamed_means.size() == 3, "streamed K means shrinks to a lowered K");
+        check(counted == observations.size() + 1000, "streamed K means counts every consumed observation once");
+    }
+
+    // Many clusters over few observations leave some empty, so every strategy gets to repair.
+    void empty_clusters_are_repaired()
+    {
+        auto observations = generate(500, 1, 1);
+
+        for (auto repair : { empty_cluster_repair::farthest_point, empty_cluster_repair::split_largest, empty_cluster_repair::steal_largest })
+        {
+            k_means<int32_t> lloyd(THREADS);
+            hamerly_k_means<int32_t> hamerly(THREADS);
+
+            lloyd.repair = repair;
+            hamerly.repair = repair;
+
+            partitioning_profile lloyd_profile;
+            partitioning_profile hamerly_profile;
+
+            auto expected = run(lloyd, observations, 100, lloyd_profile, 1);
+            auto actual = run(hamerly, observations, 100, hamerly_profile, 1);
+
+            std::string name = "empty cluster repair " + std::to_string(static_cast<int>(repair));
+
+            check(lloyd_profile.repaired_clusters > 0, name + ": clusters were repaired");
+            check(find_empty_cluster(expected) == expected.end() && consistent_labeling(expected, observations), name + ": no cluster is left empty");
+            check(same_partition(expected, actual) && lloyd_profile.repaired_clusters == hamerly_profile.repaired_clusters, name + ": Hamerly K means matches K means");
+        }
+    }
+
+    void ensemble_keeps_the_best_restart()
+    {
+        auto observations = generate(20000);
+        auto make_restart = [] { return std::make_shared<k_means<int32_t>>(); };
+
+        // Restarts are seeded in order from the ensemble's engine, so each can be rerun alone.
+        std::default_random_engine seeds(static_cast<std::default_random_engine::result_type>(SEED));
+        std::vector<double> alone;
+
+        for (size_t r = 0; r < 6; r++)
+        {
+            k_means<int32_t> restart;
+            partitioning_profile profile;
+
+            alone.push_back(dissimilarity(run(restart, observations, 12, profile, seeds())));
+        }
+
+        size_t best = std::min_element(alone.begin(), alone.end()) - alone.begin();
+
+        ensemble_partitioner<int32_t> serial(make_restart, 6, 1);
+        ensemble_partitioner<int32_t> parallel(make_restart, 6, THREADS);
+
+        serial.prune_margin = 0;
+        parallel.prune_margin = 0;
+
+        auto expected = run(serial, observations, 12);
+
+        check(serial.best_restart == best && dissimilarity(expected) == alone[best], "ensemble returns the best restart");
+        check(same_partition(expected, run(parallel, observations, 12)), "unpruned ensemble does not depend on threads");
+
+        // Pruning cancels restarts that lag behind; what is returned is still a restart run to the end.
+        ensemble_partitioner<int32_t> pruning(make_restart, 6, 1);
+        pruning.warmup_iterations = 2;
+        pruning.prune_margin = 0.01;
+
+        auto pruned = run(pruning, observations, 12);
+
+        check(pruning.pruned_restarts > 0, "ensemble prunes lagging restarts");
+        check(dissimilarity(pruned) == alone[pruning.best_restart] && dissimilarity(pruned) >= alone[best], "pruned ensemble returns a finished restart");
+        check(same_partition(pruned, run(pruning, observations, 12)), "pruned ensemble on one thread is reproducible");
+    }
+
+    void k_selection_finds_separated_blobs()
+    {
+        // With this seed, the closest blob centers are over 2300 apart, about 30 deviations.
+        auto model = std::make_shared<gaussian_blobs_distribution<int32_t>>(v2d<int32_t>{ 0, 0 }, v2d<int32_t>{ 9999, 9999 }, 5, 60.0, 80.0);
+        auto observations = dataset_generator<int32_t>(model, 1, 1).generate(20000);
+
+        for (auto criterion : { k_criterion::elbow, k_criterion::silhouette, k_criterion::gap })
+        {
+            k_selection<int32_t> selection([] { return std::make_shared<k_means<int32_t>>(); }, THREADS);
+            selection.criterion = criterion;
+
+            auto clusters = run(selection, observations, 12);
+
+            bool scored = selection.scores.size() == 11;
+
+            for (size_t i = 0; scored && i < selection.scores.size(); i++)
+                scored = selection.scores[i].k == i + 2;
+
+            std::string name = "K selection, criterion " + std::to_string(static_cast<int>(criterion));
+
+            check(scored, name + " scores every K");
+            check(selection.recommended_k == 5 && clusters.size() == 5 && consistent_labeling(clusters, observations), name + " finds the blobs");
+        }
+
+        k_selection<int32_t> selection([] { return std::make_shared<k_means<int32_t>>(); });
+
+        check(run(selection, observation_span<int32_t>{}, 12).empty() && selection.scores.empty() && selection.recommended_k == 0, "K selection over no observations");
+
+        auto few = generate(3);
+        auto clusters = run(selection, few, 12);
+
+        check(selection.scores.size() == 2 && clusters.size() == selection.recommended_k && consistent_labeling(clusters, few), "K selection caps K at the observations");
+    }
+
+    void k_medoids_loss_never_increases()
+    {
+        auto observations = generate(3000);
+
+        for (size_t k : { 1, 5, 20 })
+        {
+            k_medoids<int32_t> medoids(THREADS);
+            partitioning_profile profile;
+
+            run(medoids, observations, k, profile);
+
+            bool non_increasing = true;
+
+            for (size_t i = 1; i < profile.iteration_history.size(); i++)
+                non_increasing = non_increasing && profile.iteration_history[i].inertia <= profile.iteration_history[i - 1].inertia;
+
+            check(non_increasing, "K medoids loss never increases, k=" + std::to_string(k));
+        }
+
+        // Scoring every candidate, a single medoid must end at the best observation.
+        auto few = generate(400);
+
+        k_medoids<int32_t> medoids;
+        medoids.max_candidates_per_pass = 0;
+
+        auto clusters = run(medoids, few, 1);
+
+        double best = std::numeric_limits<double>::infinity();
+
+        for (auto& candidate : few)
+        {
+            double total = 0;
+
+            for (auto& observation : few)
+                total += squared_distance<2>(observation, candidate);
+
+            best = std::min(best, total);
+        }
+
+        check(dissimilarity(clusters) <= best * (1 + 1e-12), "K medoids finds the best single medoid");
+    }
+
+    // Sampled passes may end the search only once a pass over every candidate finds no improving
+    // swap, so no single swap can improve the medoids it returns.
+    void k_medoids_converges_to_swap_optimum()
+    {
+        auto observations = generate(1200);
+
+        k_medoids<int32_t> sampled;
+        sampled.max_candidates_per_pass = 64;
+
+        partitioning_profile profile;
+        auto clusters = run(sampled, observations, 6, profile);
+
+        std::vector<v2d<int32_t>> chosen;
+
+        for (auto& cluster : clusters)
+            chosen.push_back(cluster.mean);
+
+        auto loss = [&](const std::vector<v2d<int32_t>>& means) {
+            double total = 0;
+
+            for (auto& observation : observations)
+            {
+                double nearest = std::numeric_limits<double>::infinity();
+
+                for (auto& mean : means)
+                    nearest = std::min(nearest, squared_distance<2>(observation, mean));
+
+                total += nearest;
+            }
+
+            return total;
+        };
+
+        double current = loss(chosen);
+        bool swap_optimal = true;
+
+        for (size_t j = 0; j < chosen.size() && swap_optimal; j++)
+        {
+            auto swapped = chosen;
+
+            for (auto& candidate : observations)
+            {
+                swapped[j] = candidate;
+
+                if (loss(swapped) < current * (1 - 1e-9))
+                {
+                    swap_optimal = false;
+                    break;
+                }
+            }
+        }
+
+        check(profile.stopped_by == stop_reason::converged && swap_optimal, "sampled K medoids converges to swap-optimal medoids");
+    }
+
+    // Leaf summaries must add up to exactly what was inserted; integral coordinates keep the
+    // double sums exact whatever order they are added in.
+    bool summarizes_exactly(const cf_tree<2>& tree, const std::vector<v2d<int32_t>>& observations)
+    {
+        clustering_feature<2> expected;
+        clustering_feature<2> summarized;
+
+        for (auto& observation : observations)
+            expected.merge(clustering_feature<2>::of(observation));
+
+        for (auto& entry : tree.leaf_entries())
+            summarized.merge(entry);
+
+        return tree.size() == observations.size()
+            && summarized.count == expected.count
+            && summarized.linear_sum == expected.linear_sum
+            && summarized.squared_sum == expected.squared_sum;
+    }
+
+    void birch_stays_within_budget()
+    {
+        auto observations = generate(20000);
+
+        // With room to spare the threshold stays at zero, so leaves split instead of merging
+        // distinct observations.
+        cf_tree<2> roomy(64 << 20);
+
+        for (auto& observation : observations)
+            roomy.insert(observation);
+
+        auto leaves = roomy.leaf_entries();
+        bool unmerged = roomy.rebuilds == 0 && roomy.threshold == 0 && leaves.size() > 1000;
+
+        for (auto& entry : leaves)
+            unmerged = unmerged && entry.radius() == 0;
+
+        check(unmerged, "CF tree splits without merging distinct observations");
+        check(summarizes_exactly(roomy, observations), "CF tree summarizes every observation after splits");
+
+        cf_tree<2> bounded(16 << 10);
+        bool within_budget = true;
+
+        for (auto& observation : observations)
+        {
+            bounded.insert(observation);
+            within_budget = within_budget && bounded.memory_usage() <= bounded.memory_budget;
+        }
+
+        check(within_budget, "CF tree stays within its memory budget");
+        check(bounded.rebuilds > 0 && bounded.threshold > 0, "CF tree raises its threshold when over budget");
+        check(summarizes_exactly(bounded, observations), "CF tree summarizes every observation after rebuilds");
+
+        k_means<int32_t> lloyd(THREADS);
+        double reference = dissimilarity(run(lloyd, observations, 8));
+
+        birch<int32_t> partitioner(THREADS);
+        auto clusters = run(partitioner, observations, 8);
+
+        check(partitioner.tree.rebuilds > 0 && partitioner.tree.memory_usage() <= partitioner.tree.memory_budget, "BIRCH partitions within its budget");
+        check(consistent_labeling(clusters, observations) && dissimilarity(clusters) <= reference * 1.05, "BIRCH stays near K means");
+
+        // Streaming the same observations in batches summarizes them the same way.
+        birch<int32_t> streamed;
+        streamed.param = 8;
+        streamed.seed(SEED);
+
+        for (size_t begin = 0; begin < observations.size(); begin += 4096)
+            streamed.insert({ observations.data() + begin, std::min<size_t>(4096, observations.size() - begin) });
+
+        auto streamed_clusters = streamed.streamed_clusters();
+        bool same_means = streamed_clusters.size() == clusters.size();
+
+        for (size_t i = 0; same_means && i < clusters.size(); i++)
+            same_means = streamed_clusters[i].mean == clusters[i].mean;
+
+        check(same_means, "streamed BIRCH matches BIRCH over the whole span");
+    }
+
+    void dbscan_ignores_threads()
+    {
+        auto observations = generate(30000);
+
+        dbscan<int32_t> serial(1);
+        dbscan<int32_t> parallel(THREADS);
+
+        auto expected = run(serial, observations, 8);
+        auto actual = run(parallel, observations, 8);
+
+        check(same_partition(expected, actual), "DBSCAN labels do not depend on threads");
+        check(serial.noise.size() == parallel.noise.size(), "DBSCAN noise does not depend on threads");
+    }
+
+    void coreset_ignores_threads()
+    {
+        auto observations = generate(50000);
+
+        coreset_partitioner<int32_t> serial(std::make_shared<k_means<int32_t>>(), 4096, 1);
+        coreset_partitioner<int32_t> parallel(std::make_shared<k_means<int32_t>>(), 4096, THREADS);
+
+        check(same_partition(run(serial, observations, 8), run(parallel, observations, 8)), "coreset partition does not depend on threads");
+        check(serial.weights == parallel.weights, "coreset does not depend on threads");
+    }
+
+    void csv_loader_parses_lines_across_chunks()
+    {
+        std::string path = (std::filesystem::temp_directory_path() / "cluster-tests.csv").string();
+
+        {
+            std::ofstream out(path, std::ios::binary);
+            out << "x,y,name\r\n" << "12, -7,first\r\n" << "not,a number\n" << "\n" << "+3.6,4e2\n";
+
+            for (int32_t i = 0; i < 500; i++)
+                out << i << ',' << 2 * i << ",row " << i << '\n';
+
+            out << "-1,-2";
+        }
+
+        std::vector<v2d<int32_t>> expected{ { 12, -7 }, { 4, 400 } };
+
+        for (int32_t i = 0; i < 500; i++)
+            expected.push_back({ i, 2 * i });
+
+        expected.push_back({ -1, -2 });
+
+        for (size_t chunk_size : { size_t{ 24 }, size_t{ 1000 }, csv_loader<int32_t>::DEFAULT_CHUNK_SIZE })
+        {
+            for (bool overlapped : { false, true })
+            {
+                csv_loader<int32_t> loader;
+                loader.chunk_size = chunk_size;
+                loader.overlapped = overlapped;
+
+                std::vector<v2d<int32_t>> loaded;
+                bool read = loader.load(path, loaded);
+
+                std::string name = "CSV loader, chunk " + std::to_string(chunk_size) + (overlapped ? " overlapped" : "");
+
+                check(read && loaded == expected, name + " reads every observation");
+                check(loader.statistics.lines == 506 && loader.statistics.skipped_lines == 3, name + " counts skipped lines");
+            }
+        }
+
+        csv_loader<int32_t> short_chunks;
+        short_chunks.chunk_size = 8;
+
+        std::vector<v2d<int32_t>> loaded;
+        check(!short_chunks.load(path, loaded), "CSV loader rejects lines longer than a chunk");
+
+        {
+            std::ofstream out(path, std::ios::binary);
+            out << "a;b;c\n" << "1;2;3\n" << "4;5;6\n";
+        }
+
+        csv_loader<int32_t> columns;
+        columns.delimiter = ';';
+        columns.x_column = 2;
+        columns.y_column = 0;
+
+        loaded.clear();
+        check(columns.load(path, loaded) && loaded == std::vector<v2d<int32_t>>{ { 3, 1 }, { 6, 4 } }, "CSV loader picks the configured columns");
+
+        std::filesystem::remove(path);
+    }
+
+    struct weights_recorder : public k_means<int32_t>
+    {
+        std::vector<double> received;
+
+        std::vector<cluster<int32_t>> partition_weighted(observation_span<int32_t> observations, const std::vector<double>& weights, partitioning_profile& profile) override
+        {
+            this->received = weights;
+            return k_means<int32_t>::partition_weighted(observations, weights, profile);
+        }
+    };
+
+    void weighted_k_means_counts_weights()
+    {
+        auto observations = generate(3000);
+
+        // Integral weights must give the same iterations as repeating each observation that often.
+        std::vector<double> weights;
+        std::vector<v2d<int32_t>> repeated;
+        std::default_random_engine random_engine(static_cast<std::default_random_engine::result_type>(SEED));
+
+        for (auto& observation : observations)
+        {
+            weights.push_back(static_cast<double>(std::uniform_int_distribution<int>(1, 4)(random_engine)));
+            repeated.insert(repeated.end(), static_cast<size_t>(weights.back()), observation);
+        }
+
+        k_means<int32_t> weighted;
+        k_means<int32_t> plain;
+
+        weighted.param = 12;
+        plain.param = 12;
+
+        std::vector<v2d<int32_t>> initial_means(observations.begin(), observations.begin() + 12);
+
+        auto weighted_clusters = weighted.init_clusters(initial_means);
+        auto plain_clusters = plain.init_clusters(initial_means);
+
+        partitioning_profile weighted_profile;
+        partitioning_profile plain_profile;
+
+        weighted.iterate_weighted(observations, weights, weighted_clusters, weighted_profile);
+        plain.iterate(repeated, plain_clusters, plain_profile);
+
+        bool same_means = weighted_profile.iterations == plain_profile.iterations;
+
+        for (size_t i = 0; same_means && i < weighted_clusters.size(); i++)
+            same_means = weighted_clusters[i].mean == plain_clusters[i].mean;
+
+        check(same_means, "weighted K means matches K means over repeated observations");
+        check(consistent_labeling(weighted_clusters, observations), "weighted K means labeling is consistent");
+
+        auto inner = std::make_shared<weights_recorder>();
+        coreset_partitioner<int32_t> coreset(inner, 4096);
+
+        auto clusters = run(coreset, generate(50000), 8);
+
+        check(clusters.size() == 8 && !inner->received.empty() && inner->received == coreset.weights, "coreset hands its weights to the inner partitioner");
+    }
+
+    void files_round_trip()
+    {
+        auto directory = std::filesystem::temp_directory_path();
+        std::string dataset_path = (directory / "cluster-tests.ntfo").string();
+        std::string partition_path = (directory / "cluster-tests.ntfp").string();
+
+        auto observations = generate(5000);
+
+        std::vector<v2d<int32_t>> loaded;
+
+        check(write_dataset<int32_t>(dataset_path, observations), "dataset file written");
+        check(read_dataset<int32_t>(dataset_path, loaded) && loaded == observations, "dataset file round trip");
+
+        k_means<int32_t> partitioner;
+        partitioning_profile profile;
+
+        auto clusters = run(partitioner, observations, 6, profile);
+
+        profile.repaired_clusters = 3;
+        profile.communication_time = microseconds(11);
+        profile.coreset_time = microseconds(13);
+        profile.inertia_gap = 0.125;
+
+        std::vector<cluster<int32_t>> restored;
+        partitioning_profile restored_profile;
+
+        check(write_partition<int32_t>(partition_path, clusters, observations.size(), profile), "partition file written");
+        check(read_partition<int32_t>(partition_path, observations, restored, restored_profile), "partition file read");
+
+        check(same_partition(clusters, restored), "partition file round trip");
+        check(restored_profile.iterations == profile.iterations
+            && restored_profile.elapsed_time == profile.elapsed_time
+            && restored_profile.distance_evaluations == profile.distance_evaluations
+            && restored_profile.phase_times == profile.phase_times
+            && restored_profile.repaired_clusters == profile.repaired_clusters
+            && restored_profile.stopped_by == profile.stopped_by
+            && restored_profile.communication_time == profile.communication_time
+            && restored_profile.coreset_time == profile.coreset_time
+            && restored_profile.inertia_gap == profile.inertia_gap, "partition profile round trip");
+
+        std::filesystem::resize_file(partition_path, std::filesystem::file_size(partition_path) - 8);
+        check(!read_partition<int32_t>(partition_path, observations, restored, restored_profile), "truncated partition file rejected");
+
+        std::filesystem::remove(dataset_path);
+        std::filesystem::remove(partition_path);
+    }
+}
+
+int main()
+{
+    using namespace ntf::cluster;
+
+#ifndef _WIN32
+    tests::sharded_matches_local();
+#endif
+
+    tests::labelings_are_consistent();
+    tests::generation_ignores_threads();
+    tests::k_means_ignores_threads();
+    tests::k_means_stops_by_criteria();
+    tests::seeding_handles_few_observations();
+    tests::hamerly_matches_k_means();
+    tests::grid_index_matches_brute_force();
+    tests::k_means_warm_starts();
+    tests::mini_batch_k_means_streams();
+    tests::empty_clusters_are_repaired();
+    tests::ensemble_keeps_the_best_restart();
+    tests::k_selection_finds_separated_blobs();
+    tests::k_medoids_loss_never_increases();
+    tests::k_medoids_converges_to_swap_optimum();
+    tests::birch_stays_within_budget();
+    tests::dbscan_ignores_threads();
+    tests::coreset_ignores_threads();
+    tests::csv_loader_parses_lines_across_chunks();
+    tests::weighted_k_means_counts_weights();
+    tests::files_round_trip();
+
+    if (tests::failures == 0)
+        std::cout << "All checks passed\n";
+
+    return static_cast<int>(tests::failures);
+}
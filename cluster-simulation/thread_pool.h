@@ -0,0 +1,120 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace ntf::cluster
+{
+    class thread_pool
+    {
+    private:
+        std::vector<std::thread> workers;
+
+        std::mutex mutex;
+        std::condition_variable work_available;
+        std::condition_variable work_done;
+
+        const std::function<void(size_t)>* task = nullptr;
+        size_t tasks_amount = 0;
+        std::atomic<size_t> next_task{ 0 };
+
+        size_t generation = 0;
+        size_t busy_workers = 0;
+        bool stopping = false;
+
+        void drain()
+        {
+            for (size_t i = this->next_task++; i < this->tasks_amount; i = this->next_task++)
+                (*this->task)(i);
+        }
+
+        void work()
+        {
+            size_t seen_generation = 0;
+
+            while (true)
+            {
+                {
+                    std::unique_lock<std::mutex> lock(this->mutex);
+
+                    this->work_available.wait(lock, [&] { return this->stopping || this->generation != seen_generation; });
+
+                    if (this->stopping)
+                        return;
+
+                    seen_generation = this->generation;
+                }
+
+                this->drain();
+
+                std::lock_guard<std::mutex> lock(this->mutex);
+
+                if (--this->busy_workers == 0)
+                    this->work_done.notify_one();
+            }
+        }
+
+    public:
+        // The calling thread takes part in every run, so `threads` counts it too.
+        explicit thread_pool(size_t threads = std::thread::hardware_concurrency())
+        {
+            for (size_t i = 1; i < std::max<size_t>(threads, 1); i++)
+                this->workers.emplace_back([this] { this->work(); });
+        }
+
+        thread_pool(const thread_pool&) = delete;
+        thread_pool& operator= (const thread_pool&) = delete;
+
+        ~thread_pool()
+        {
+            {
+                std::lock_guard<std::mutex> lock(this->mutex);
+                this->stopping = true;
+            }
+
+            this->work_available.notify_all();
+
+            for (auto& worker : this->workers)
+                worker.join();
+        }
+
+        size_t size() const
+        {
+            return this->workers.size() + 1;
+        }
+
+        // Calls task(i) for every i in [0, tasks_amount) and returns once all of them finished.
+        // Tasks are handed out dynamically, so they must not depend on which thread runs them.
+        void run(size_t tasks_amount, const std::function<void(size_t)>& task)
+        {
+            if (this->workers.empty() || tasks_amount <= 1)
+            {
+                for (size_t i = 0; i < tasks_amount; i++)
+                    task(i);
+
+                return;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(this->mutex);
+
+                this->task = &task;
+                this->tasks_amount = tasks_amount;
+                this->next_task = 0;
+                this->busy_workers = this->workers.size();
+                this->generation++;
+            }
+
+            this->work_available.notify_all();
+            this->drain();
+
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->work_done.wait(lock, [&] { return this->busy_workers == 0; });
+
+            this->task = nullptr;
+        }
+    };
+}